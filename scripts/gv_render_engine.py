@@ -29,6 +29,44 @@ def get_gv_render():
     global __GV_PREVIEW_RENDER__
     return __GV_PREVIEW_RENDER__
 
+# Final renders share one Headless session (GL context and compiled shaders) until the render job ends
+__GV_FINAL_ENGINE__ = None
+__GV_FINAL_SOURCES__ = None
+__GV_FINAL_SIZE__ = None
+def get_gv_final_engine(width, height):
+    global __GV_FINAL_ENGINE__
+    global __GV_FINAL_SIZE__
+    if __GV_FINAL_ENGINE__ is None:
+        __GV_FINAL_ENGINE__ = gv.Headless()
+        lygia_path = os.path.join( Path(__file__).parent.resolve(), '../deps/' )
+        __GV_FINAL_ENGINE__.include_folders = [ lygia_path ]
+        __GV_FINAL_ENGINE__.init()
+    # Resizing drops the render buffers, only when the output size changed between frames
+    if __GV_FINAL_SIZE__ != (width, height):
+        __GV_FINAL_ENGINE__.resize(width, height)
+        __GV_FINAL_SIZE__ = (width, height)
+    return __GV_FINAL_ENGINE__
+
+@persistent
+def close_final_engine(dummy):
+    global __GV_FINAL_ENGINE__
+    global __GV_FINAL_SOURCES__
+    global __GV_FINAL_SIZE__
+    if __GV_FINAL_ENGINE__:
+        __GV_FINAL_ENGINE__.close()
+    __GV_FINAL_ENGINE__ = None
+    __GV_FINAL_SOURCES__ = None
+    __GV_FINAL_SIZE__ = None
+
+    global __GV_HOLD_PREVIEW__
+    __GV_HOLD_PREVIEW__ = False
+
+    try:
+        if __GV_PREVIEW_RENDER__:
+            __GV_PREVIEW_RENDER__.tag_update()
+    except:
+        pass
+
 @persistent
 def load_new_scene(dummy):
     # print("Event: load_new_scene", bpy.data.filepath)
@@ -44,6 +82,13 @@ def load_new_scene(dummy):
     __GV_PREVIEW_RENDER__ = None
 
 
+# Blender pixels are floats, read in bulk they reach the engine as a float32 array without a copy
+def read_pixels(img):
+    pixels = np.empty(len(img.pixels), dtype=np.float32)
+    img.pixels.foreach_get(pixels)
+    return pixels
+
+
 class GVRenderEngine(bpy.types.RenderEngine):
     '''
     These three members are used by blender to set up the
@@ -163,9 +208,9 @@ class GVRenderEngine(bpy.types.RenderEngine):
         engine.setSkyGround( scene.world.color[0], scene.world.color[1], scene.world.color[2] )
         for name, value in bpy.context.scene.world.items():
             if isinstance(value, float):
-                self.preview_engine.setUniform(name, [value])
+                engine.setUniform(name, [value])
             elif isinstance(value, idprop.types.IDPropertyArray):
-                self.preview_engine.setUniform(name, value.to_list())
+                engine.setUniform(name, value.to_list())
 
         engine.setSkyTurbidity( scene.glsl_viewer_skybox_turbidity )
         engine.setFxaa( scene.glsl_viewer_fxaa )
@@ -210,8 +255,7 @@ class GVRenderEngine(bpy.types.RenderEngine):
             if img.file_format == 'HDR':
                 if not engine.haveCubemap(name):
                     # print("Add Cubemap", img.name, "as", name)
-                    pixels = np.array(img.pixels)
-                    engine.addCubemap(name, img.size[0], img.size[1], img.channels, pixels)
+                    engine.addCubemap(name, img.size[0], img.size[1], img.channels, read_pixels(img))
 
             else:
                 name = "u_" + name + "Tex"
@@ -220,8 +264,7 @@ class GVRenderEngine(bpy.types.RenderEngine):
                     # If this is a FINAL RENDER, we need to load the texture as a file
                     if not engine.haveTexture(name):
                         # print("Add Texture", img.name, "as", name)
-                        pixels = np.array(img.pixels)
-                        engine.addTexture(name, img.size[0], img.size[1], img.channels, pixels)
+                        engine.loadTexture(name, img.size[0], img.size[1], img.channels, read_pixels(img))
                 else:
                     # If this is a PREVIEW RENDER, we can piggy bag from what's uploaded on texture
                     img.gl_load()
@@ -230,9 +273,10 @@ class GVRenderEngine(bpy.types.RenderEngine):
 
 
     
-    def update_shaders(self, engine, reload_shaders = False):
-        # print("update shaders")
+    def read_shaders(self):
+        # Brings frag_code and vert_code up to date with their texts, returns True if any changed
         context = bpy.context
+        changed = False
 
         frag_filename = bpy.context.scene.glsl_viewer_frag
         vert_filename = bpy.context.scene.glsl_viewer_vert
@@ -264,8 +308,7 @@ class GVRenderEngine(bpy.types.RenderEngine):
             
                 if text.as_string() != self.frag_code:
                     self.frag_code = text.as_string()
-                    engine.setSource(gv.FRAGMENT, self.frag_code)
-                    reload_shaders = True
+                    changed = True
 
             elif text.name_full == vert_filename:
                 if not text.is_in_memory and text.is_modified and context != None:
@@ -282,10 +325,14 @@ class GVRenderEngine(bpy.types.RenderEngine):
 
                 if text.as_string() != self.vert_code:
                     self.vert_code = text.as_string()
-                    engine.setSource(gv.VERTEX, self.vert_code)
-                    reload_shaders = True
+                    changed = True
+
+        return changed
+
 
-        if reload_shaders:
+    def update_shaders(self, engine, reload_shaders = False):
+        # print("update shaders")
+        if self.read_shaders() or reload_shaders:
             engine.setSource(gv.VERTEX, self.vert_code)
             engine.setSource(gv.FRAGMENT, self.frag_code)
             engine.loadShaders()
@@ -443,55 +490,41 @@ class GVRenderEngine(bpy.types.RenderEngine):
         width = int(scene.render.resolution_x * scale)
         height = int(scene.render.resolution_y * scale)
         camera = self.camera_override
-        filepath = bpy.context.scene.render.filepath
-        absolutepath = bpy.path.abspath(filepath)
-        out_image = os.path.join(absolutepath, '_render.png')
-
-        final_engine = gv.Headless()
-        lygia_path = os.path.join( Path(__file__).parent.resolve(), '../deps/' )
-        final_engine.include_folders = [ lygia_path ]
 
-        final_engine.init()
-        final_engine.enableCubemap( True )
+        # The session is kept between the frames of an animation, only the first one pays for the context
+        final_engine = get_gv_final_engine(width, height)
         self.reloadScene(final_engine, depsgraph)
-        self.update_shaders(final_engine, True)
-        final_engine.setSource(gv.FRAGMENT, self.frag_code)
-        final_engine.setSource(gv.VERTEX, self.vert_code)
-        final_engine.loadShaders()
-        final_engine.resize(width, height)
-        final_engine.setCamera( bl2veraCamera(camera) )
-        final_engine.setFrame( scene.frame_current )
+        self.read_shaders()
 
-        final_engine.resize(width, height)
+        # Shaders are only compiled again when their code changed since the last frame
+        global __GV_FINAL_SOURCES__
+        if __GV_FINAL_SOURCES__ != (self.vert_code, self.frag_code):
+            final_engine.setSource(gv.FRAGMENT, self.frag_code)
+            final_engine.setSource(gv.VERTEX, self.vert_code)
+            final_engine.loadShaders()
+            __GV_FINAL_SOURCES__ = (self.vert_code, self.frag_code)
+
+        final_engine.setCamera( bl2veraCamera(camera) )
         final_engine.enableCubemap( scene.glsl_viewer_enable_cubemap )
         final_engine.showCubemap( scene.glsl_viewer_show_cubemap )
         final_engine.showTextures( False)
         final_engine.showPasses( False )
         final_engine.showBoudningBox( False )
 
-        final_engine.draw()
+        # Straight from the GPU, bottom row first like Blender expects
+        final_engine.renderSequence([ scene.frame_current ], lambda frame, pixels: self.write_result(width, height, pixels), 'rgba32f')
 
-        final_engine.setOutput( out_image )
-        final_engine.draw()
+        # Single frames end here, animations once the whole job is done (see close_final_engine)
+        if not self.is_animation:
+            close_final_engine(None)
 
-        final_engine.close()
-
-        global __GV_HOLD_PREVIEW__
-        __GV_HOLD_PREVIEW__ = False
 
+    def write_result(self, width, height, pixels):
         result = self.begin_result(0, 0, width, height)
-
         layer = result.layers[0]
-        layer.load_from_file(out_image)
-
+        layer.passes["Combined"].rect = pixels.reshape(-1, 4)
         self.end_result(result)
 
-        try:
-            if __GV_PREVIEW_RENDER__:
-                __GV_PREVIEW_RENDER__.tag_update()
-        except:
-            pass
-
 
 def get_panels():
     '''
@@ -522,6 +555,8 @@ def register_render_engine():
     # Register the RenderEngine
     bpy.utils.register_class(GVRenderEngine)
     bpy.app.handlers.load_pre.append(load_new_scene)
+    bpy.app.handlers.render_complete.append(close_final_engine)
+    bpy.app.handlers.render_cancel.append(close_final_engine)
 
     for panel in get_panels():
         panel.COMPAT_ENGINES.add('GLSLVIEWER_ENGINE')
@@ -530,6 +565,8 @@ def register_render_engine():
 def unregister_render_engine():
     bpy.utils.unregister_class(GVRenderEngine)
     bpy.app.handlers.load_pre.remove(load_new_scene)
+    bpy.app.handlers.render_complete.remove(close_final_engine)
+    bpy.app.handlers.render_cancel.remove(close_final_engine)
 
     for panel in get_panels():
         if 'GLSLVIEWER_ENGINE' in panel.COMPAT_ENGINES:
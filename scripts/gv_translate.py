@@ -144,48 +144,47 @@ def bl2veraMesh(bl_mesh: bpy.types.Mesh):
     W = bl_mesh.matrix_world
     N = W.inverted_safe().transposed().to_3x3()
 
-    bl_mesh.data.calc_loop_triangles()
-    has_uv = bl_mesh.data.uv_layers != None and len(bl_mesh.data.uv_layers) > 0
-    has_color = bl_mesh.data.vertex_colors != None and len(bl_mesh.data.vertex_colors) > 0
+    data = bl_mesh.data
+    data.calc_loop_triangles()
+    has_uv = data.uv_layers != None and len(data.uv_layers) > 0
+    has_color = data.vertex_colors != None and len(data.vertex_colors) > 0
 
-    if len(bl_mesh.data.loop_triangles) == 0:
-        mesh.setDrawMode(gl.POINTS)
+    # Attributes are read in bulk into NumPy arrays and handed to the mesh whole
+    def read(collection, attribute, size, dtype=np.float32):
+        values = np.empty(len(collection) * size, dtype=dtype)
+        collection.foreach_get(attribute, values)
+        return values.reshape(-1, size) if size > 1 else values
 
-        att = 'Normal' in bl_mesh.data.attributes
-        if att:
-            att = bl_mesh.data.attributes['Normal']
-        else:
-            att = None
+    vertices = read(data.vertices, 'co', 3)
 
-        for i, v in enumerate(bl_mesh.data.vertices):
-            mesh.addVertex(-v.co[0], -v.co[1], -v.co[2])
+    if len(data.loop_triangles) == 0:
+        mesh.setDrawMode(gl.POINTS)
 
-            if att:
-                n = att.data[i].vector
-                mesh.addNormal(-n[0], -n[1], -n[2])
-            else:
-                mesh.addNormal(-v.normal[0], -v.normal[1], -v.normal[2])
+        if 'Normal' in data.attributes:
+            normals = read(data.attributes['Normal'].data, 'vector', 3)
+        else:
+            normals = read(data.vertices, 'normal', 3)
 
+        mesh.setVertices(-vertices)
+        mesh.setNormals(-normals)
 
     else:
-        bl_mesh.data.calc_normals_split()
-        for triangle_loop in bl_mesh.data.loop_triangles:
-            for loop_index in triangle_loop.loops:
-                loop = bl_mesh.data.loops[loop_index]
+        data.calc_normals_split()
+        normals = read(data.vertices, 'normal', 3)
 
-                v = bl_mesh.data.vertices[loop.vertex_index].co 
-                mesh.addVertex(-v[0], -v[1], -v[2])
+        # One vertex per corner of each triangle
+        loops = read(data.loop_triangles, 'loops', 3, np.int32).ravel()
+        loop_vertex = read(data.loops, 'vertex_index', 1, np.int32)
+        corners = loop_vertex[loops]
 
-                n = bl_mesh.data.vertices[loop.vertex_index].normal
-                mesh.addNormal(-n[0], -n[1], -n[2])
+        mesh.setVertices(-vertices[corners])
+        mesh.setNormals(-normals[corners])
 
-                if has_color:
-                    c = bl_mesh.data.vertex_colors.active.data[loop_index].color
-                    mesh.addColor(c[0], c[1], c[2], c[3])
+        if has_color:
+            mesh.setColors(read(data.vertex_colors.active.data, 'color', 4)[loops])
 
-                if has_uv:
-                    t = bl_mesh.data.uv_layers.active.data[loop_index].uv
-                    mesh.addTexCoord(t[0], t[1])
+        if has_uv:
+            mesh.setTexCoords(read(data.uv_layers.active.data, 'uv', 2)[loops])
 
     if has_uv:
         mesh.computeTangents()
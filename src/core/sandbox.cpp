@@ -2,11 +2,15 @@
 
 #include <sys/stat.h>   // stat
 #include <algorithm>    // std::find
+#include <chrono>
 #include <fstream>
 #include <math.h>
 #include <memory>
 
 #include "tools/job.h"
+#include "tools/sdf.h"
+#include "tools/hash.h"
+#include "tools/cache.h"
 #include "tools/text.h"
 #include "tools/record.h"
 #include "tools/console.h"
@@ -53,9 +57,10 @@ Sandbox::Sandbox():
     // PostProcessing
     m_postprocessing(false),
     // Plot helpers
-    m_plot(PLOT_OFF),
+    m_plot_texture(nullptr), m_plot(PLOT_OFF), m_plot_history(nullptr),
 
     // Record
+    m_capture(false),
     #if defined(SUPPORT_MULTITHREAD_RECORDING)
     m_task_count(0),
     /** allow 500 MB to be used for the image save queue **/
@@ -65,6 +70,8 @@ Sandbox::Sandbox():
 
     // Scene
     m_view2d(1.0), m_time_offset(0.0), m_camera_elevation(1.0), m_camera_azimuth(180.0), m_error_screen(vera::SHOW_MAGENTA_SHADER), 
+    m_load_sun(false),
+    m_sdf_padding(0.01f), m_sdf_resolution(64), m_sdf_compare(false), m_sdf_pending(false),
     m_change(true), m_change_viewport(true), m_update_buffers(true), m_initialized(false), 
 
     // Debug
@@ -138,6 +145,28 @@ Sandbox::Sandbox():
         return std::string("");
     });
 
+    // PLOT
+    uniforms.functions["u_histogram"] = UniformFunction("sampler2D", [this](vera::Shader& _shader) {
+        if (m_plot != PLOT_LUMA && m_plot != PLOT_RGB && m_plot != PLOT_RED && m_plot != PLOT_GREEN && m_plot != PLOT_BLUE)
+            return;
+
+        if (m_histogram.isGpu())
+            _shader.setUniformTexture("u_histogram", m_histogram.getFbo(), _shader.textureIndex++);
+        else if (m_plot_texture)
+            _shader.setUniformTexture("u_histogram", m_plot_texture, _shader.textureIndex++);
+        else
+            return;
+        _shader.setUniform("u_histogramResolution", 256.0f, 1.0f);
+    });
+
+    uniforms.functions["u_history"] = UniformFunction("sampler2D", [this](vera::Shader& _shader) {
+        if (m_history.getTexture() == nullptr)
+            return;
+        _shader.setUniformTexture("u_history", m_history.getTexture(), _shader.textureIndex++);
+        _shader.setUniform("u_historyHead", float(m_history.getHead()));
+        _shader.setUniform("u_historyResolution", float(HISTORY_SIZE), 1.0f);
+    });
+
     // SCENE
     uniforms.functions["u_view2d"] = UniformFunction("mat3", [this](vera::Shader& _shader) {
         _shader.setUniform("u_view2d", m_view2d);
@@ -155,7 +184,16 @@ Sandbox::~Sandbox() {
     
     while (m_task_count > 0)
         std::this_thread::sleep_for(std::chrono::milliseconds{10});
-    
+
+    /** a model can't stop loading half way, wait for it **/
+    if (m_load_thread.joinable())
+        m_load_thread.join();
+
+    uniforms.loadMutex.lock();
+    for (size_t i = 0; i < uniforms.loadModels.size(); i++)
+        delete uniforms.loadModels[i];
+    uniforms.loadModels.clear();
+    uniforms.loadMutex.unlock();
     #endif
 }
 
@@ -362,6 +400,20 @@ void Sandbox::commandsInit(CommandList &_commands ) {
     },
     "plot[,off|luma|red|green|blue|rgb|fps|ms]", "show/hide a histogram or FPS plot on screen", false));
 
+    _commands.push_back(Command("history", [&](const std::string& _line){
+        std::vector<std::string> values = vera::split(_line,',');
+        if (values.size() == 1) {
+            std::cout << "history," << ((m_history_uniform == "")? "off" : m_history_uniform) << std::endl;
+            return true;
+        }
+        else if (values.size() == 2) {
+            m_history_uniform = (values[1] == "off")? "" : values[1];
+            return true;
+        }
+        return false;
+    },
+    "history[,<uniform>|off]", "record the first two values of a uniform on u_history z and w, next to fps/60 and frame time", false));
+
     _commands.push_back(Command("reset", [&](const std::string& _line){
         if (_line == "reset") {
             m_time_offset = vera::getTime();
@@ -990,16 +1042,67 @@ void Sandbox::commandsInit(CommandList &_commands ) {
             if (values.size() > 1)
                 padding = vera::toFloat(values[1]);
 
+            // The GPU path floods the whole volume at once, so it takes the final resolution
+            // directly. It has to run on the main thread, here it's only requested
+            std::string mode = (values.size() > 3)? values[3] : "cpu";
+            if (mode == "gpu" || mode == "compare") {
+                if (SdfFlood::supported()) {
+                    int resolution = 6;
+                    if (values.size() > 2)
+                        resolution = vera::toInt(values[2]);
+
+                    uniforms.loadMutex.lock();
+                    m_sdf_padding = padding;
+                    m_sdf_resolution = 1u << glm::clamp(resolution, 1, 9);
+                    m_sdf_compare = (mode == "compare");
+                    m_sdf_pending = true;
+                    uniforms.loadMutex.unlock();
+                    m_change = true;
+                    return true;
+                }
+                std::cout << "Flooding SDFs needs GLSL 130 or above, using the CPU instead" << std::endl;
+            }
+
             for (vera::ModelsMap::iterator it = uniforms.models.begin(); it != uniforms.models.end(); ++it) {
                 std::string name = "u_" + it->first + "Sdf";
                 addDefine("MODEL_SDF_TEXTURE", name );
 
-                clock_t start, end;
-                start = clock();
+                // Wall time, the slices are voxelized on several threads at once
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
                 vera::Mesh mesh = it->second->mesh;
                 mesh.setMaterial(it->second->mesh.getMaterial());
                 vera::center(mesh);
+
+                // Hand a level to the main thread to be uploaded
+                auto publish = [&](const vera::Image& _sprite, size_t _voxels) {
+                    uniforms.loadMutex.lock();
+                    uniforms.loadQueue[ name ] = _sprite;
+                    uniforms.loadMutex.unlock();
+                    addDefine("MODEL_SDF_VOXEL_RESOLUTION", vera::toString(_voxels) + ".0" );
+                    addDefine("MODEL_SDF_TEXTURE_RESOLUTION", "vec2(" + vera::toString( _sprite.getWidth() ) + ".0)" );
+                };
+
+                // The same geometry with the same padding always gives the same field
+                int voxel_resolution_lod_0  = std::pow(2, 2);
+                size_t lod_total = 4;
+                uint64_t key = hashMesh(mesh);
+                key = hashBytes(&padding, sizeof(padding), key);
+                key = hashBytes(&voxel_resolution_lod_0, sizeof(voxel_resolution_lod_0), key);
+                key = hashBytes(&lod_total, sizeof(lod_total), key);
+
+                std::string cache = getCacheFolder("sdf");
+                if (cache != "")
+                    cache += "/" + hashToString(key) + ".sdf";
+
+                vera::Image cached;
+                uint32_t cached_voxels = 0;
+                if (cache != "" && loadSdfCache(cache, cached, cached_voxels)) {
+                    publish(cached, cached_voxels);
+                    if (verbose)
+                        std::cout << "SDF of " << it->first << " loaded from " << cache << std::endl;
+                    continue;
+                }
                 
                 std::vector<vera::Triangle> tris = mesh.getTriangles();
                 vera::BVH acc(tris, vera::SPLIT_MIDPOINT );
@@ -1013,45 +1116,34 @@ void Sandbox::commandsInit(CommandList &_commands ) {
                 // bbox.expand( (max_dist*max_dist) * padding );
                 // it->second->addDefine("MODEL_SDF_SCALE", vera::toString(2.0f-bbox.getArea()/area) );
 
-                int voxel_resolution_lod_0  = std::pow(2, 2);
                 glm::vec3   bdiagonal       = acc.getDiagonal();
                 float       max_dist        = glm::length(bdiagonal);
                 acc.expand( (max_dist*max_dist) * padding );
 
                 std::vector<vera::Image> current_lod;
-                for (int z = 0; z < voxel_resolution_lod_0; z++)
-                    current_lod.push_back( vera::toSdfLayer( &acc, voxel_resolution_lod_0, z) );
-                
-                uniforms.loadMutex.lock();
-                uniforms.loadQueue[ name ] = packSprite(current_lod);
-                uniforms.loadMutex.unlock();
-                addDefine("MODEL_SDF_VOXEL_RESOLUTION", vera::toString(voxel_resolution_lod_0) + ".0" );
-                addDefine("MODEL_SDF_TEXTURE_RESOLUTION", "vec2(" + vera::toString( uniforms.loadQueue[ name ].getWidth() ) + ".0)" );
+                toSdfLayers(&acc, voxel_resolution_lod_0, current_lod);
+                vera::Image sprite = vera::packSprite(current_lod);
+                publish(sprite, current_lod.size());
 
-                size_t lod_total = 4;
                 for (int l = 1; l < lod_total; l++) {
+                    // The previous level scaled up is shown while the new one is computed
                     std::vector<vera::Image> new_lod = vera::scaleSprite(current_lod, 4);
-                    uniforms.loadMutex.lock();
-                    uniforms.loadQueue[ name ] = vera::packSprite(new_lod);
-                    uniforms.loadMutex.unlock();
-                    addDefine("MODEL_SDF_VOXEL_RESOLUTION", vera::toString(new_lod.size()) + ".0" );
-                    addDefine("MODEL_SDF_TEXTURE_RESOLUTION", "vec2(" + vera::toString( uniforms.loadQueue[ name ].getWidth() ) + ".0)" );
+                    sprite = vera::packSprite(new_lod);
+                    publish(sprite, new_lod.size());
 
                     if (l < (lod_total-1)) {
-                        for (int z = 0; z < new_lod.size(); z++) {
-                            new_lod[z] = vera::toSdfLayer( &acc, new_lod.size(), z);
-                            console_draw_pct( float(z) / float(new_lod.size() - 1) );
-                            uniforms.loadMutex.lock();
-                            uniforms.loadQueue[ name ] = vera::packSprite(new_lod);
-                            uniforms.loadMutex.unlock();
-                        }
+                        toSdfLayers(&acc, new_lod.size(), new_lod, [](float _pct) { console_draw_pct(_pct); });
+                        sprite = vera::packSprite(new_lod);
+                        publish(sprite, new_lod.size());
                     }
                     
                     current_lod = new_lod;
                 }
 
-                end = clock();
-                double duration_sec = double(end-start)/CLOCKS_PER_SEC;
+                if (cache != "" && !saveSdfCache(cache, sprite, current_lod.size()))
+                    std::cerr << "Couldn't save the SDF of " << it->first << " to " << cache << std::endl;
+
+                double duration_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
                 std::cout << "Took " << duration_sec << "secs" << std::endl;
             }
 
@@ -1059,7 +1151,7 @@ void Sandbox::commandsInit(CommandList &_commands ) {
         }
         return false;
     },
-    "generate_sdf[,padding[,resolution]]", "create an 3D SDF texture of loaded models, default padding = 0.01, resolution = 6"));
+    "generate_sdf[,padding[,resolution[,cpu|gpu|compare]]]", "create an 3D SDF texture of loaded models, default padding = 0.01, resolution = 6 (2^6 voxels per side on the gpu). compare prints the error of the gpu against the cpu"));
 
 
     #if defined(SUPPORT_MULTITHREAD_RECORDING)
@@ -1120,9 +1212,17 @@ void Sandbox::loadAssets(WatchFileList &_files) {
     // LOAD GEOMETRY
     // -----------------------------------------------
     if (geom_index != -1) {
-        uniforms.load(_files[geom_index].path, verbose);
-        m_sceneRender.loadScene(uniforms);
-        uniforms.activeCamera->orbit(m_camera_azimuth, m_camera_elevation, m_sceneRender.getArea() * 2.0);
+        #if defined(SUPPORT_MULTITHREAD_RECORDING) && !defined(PYTHON_RENDER)
+        // The scene is set up once the worker thread is done (see _updateModels)
+        if (_loadModelsAsync(_files[geom_index].path))
+            uniforms.activeCamera->orbit(m_camera_azimuth, m_camera_elevation, 2.0);
+        else
+        #endif
+        {
+            uniforms.load(_files[geom_index].path, verbose);
+            m_sceneRender.loadScene(uniforms);
+            uniforms.activeCamera->orbit(m_camera_azimuth, m_camera_elevation, m_sceneRender.getArea() * 2.0);
+        }
     }
     else {
         m_canvas_shader.addDefine("MODEL_VERTEX_TEXCOORD", "v_texcoord");
@@ -1198,6 +1298,102 @@ void Sandbox::loadModel(vera::Model* _model) {
     uniforms.activeCamera->lookAt(uniforms.activeCamera->getTarget());
 }
 
+bool Sandbox::_loadModelsAsync(const std::string& _path) {
+    #if defined(SUPPORT_MULTITHREAD_RECORDING)
+    // Other formats also load the textures of their materials, which needs the GL context of the main thread
+    if (!vera::haveExt(_path,"ply") && !vera::haveExt(_path,"PLY") &&
+        !vera::haveExt(_path,"stl") && !vera::haveExt(_path,"STL") )
+        return false;
+
+    // Only one at a time, the last one requested wins
+    if (m_load_thread.joinable())
+        m_load_thread.join();
+
+    uniforms.loadMutex.lock();
+    for (size_t i = 0; i < uniforms.loadModels.size(); i++)
+        delete uniforms.loadModels[i];
+    uniforms.loadModels.clear();
+    uniforms.loadMutex.unlock();
+
+    m_load_pending = true;
+    m_load_done = false;
+    m_load_sun = !m_initialized;
+    m_load_defines.clear();
+
+    bool verb = verbose;
+    m_load_thread = std::thread([this, _path, verb]() {
+        // Parse on a scene of its own. GPU buffers are created when the models are first drawn
+        vera::Scene scene;
+        scene.load(_path, verb);
+
+        uniforms.loadMutex.lock();
+        for (vera::ModelsMap::iterator it = scene.models.begin(); it != scene.models.end(); ++it)
+            uniforms.loadModels.push_back(it->second);
+        scene.models.clear();
+        uniforms.loadMutex.unlock();
+
+        m_load_done = true;
+    });
+
+    return true;
+    #else
+    return false;
+    #endif
+}
+
+void Sandbox::_updateModels() {
+    #if defined(SUPPORT_MULTITHREAD_RECORDING)
+    if (!m_load_done)
+        return;
+
+    if (m_load_thread.joinable())
+        m_load_thread.join();
+    m_load_done = false;
+
+    uniforms.loadMutex.lock();
+    ModelsQueue models;
+    models.swap(uniforms.loadModels);
+    uniforms.loadMutex.unlock();
+
+    for (size_t i = 0; i < models.size(); i++) {
+        vera::ModelsMap::iterator it = uniforms.models.find( models[i]->getName() );
+        if (it != uniforms.models.end())
+            delete it->second;
+        uniforms.models[ models[i]->getName() ] = models[i];
+    }
+
+    // Defines set while there was no model to hold them
+    if (uniforms.models.size() > 0) {
+        for (std::map<std::string, std::string>::iterator it = m_load_defines.begin(); it != m_load_defines.end(); ++it) {
+            uniforms.addDefine(it->first, it->second);
+            m_sceneRender.addDefine(it->first, it->second);
+        }
+    }
+    m_load_defines.clear();
+
+    // Same framing a synchronous load does, now that the area of the scene is known
+    m_sceneRender.loadScene(uniforms);
+    float distance = (quilt_resolution >= 0)? 8.5f : 2.0f;
+    uniforms.activeCamera->orbit(m_camera_azimuth, m_camera_elevation, m_sceneRender.getArea() * distance);
+    uniforms.activeCamera->lookAt( uniforms.activeCamera->getTarget() );
+
+    if (m_load_sun && uniforms.models.size() > 0) {
+        float area = m_sceneRender.getArea();
+        uniforms.setSunPosition( glm::vec3(0.0,area*10.0,area*10.0) );
+    }
+
+    if (uniforms.models.size() > 0)
+        _updateSceneShaders();
+    else {
+        m_canvas_shader.setDefaultErrorBehaviour(m_error_screen);
+        m_canvas_shader.setSource(m_frag_source, m_vert_source);
+    }
+
+    m_load_pending = false;
+    flagChange();
+    #endif
+}
+
 void Sandbox::addDefine(const std::string &_define, const std::string &_value) {
     for (int i = 0; i < m_buffers_total; i++)
         m_buffers_shaders[i].addDefine(_define, _value);
@@ -1209,6 +1405,8 @@ void Sandbox::addDefine(const std::string &_define, const std::string &_value) {
         uniforms.addDefine(_define, _value);
         m_sceneRender.addDefine(_define, _value);
     }
+    else if (isLoadingModels())
+        m_load_defines[_define] = _value;
     else
         m_canvas_shader.addDefine(_define, _value);
 
@@ -1226,6 +1424,8 @@ void Sandbox::delDefine(const std::string &_define) {
         uniforms.delDefine(_define);
         m_sceneRender.delDefine(_define);
     }
+    else if (isLoadingModels())
+        m_load_defines.erase(_define);
     else
         m_canvas_shader.delDefine(_define);
 
@@ -1235,7 +1435,15 @@ void Sandbox::delDefine(const std::string &_define) {
 // ------------------------------------------------------------------------- GET
 
 bool Sandbox::isReady() {
-    return m_initialized;
+    return m_initialized && !isLoadingModels();
+}
+
+bool Sandbox::isLoadingModels() const {
+    #if defined(SUPPORT_MULTITHREAD_RECORDING)
+    return m_load_pending;
+    #else
+    return false;
+    #endif
 }
 
 void Sandbox::flagChange() { 
@@ -1252,6 +1460,9 @@ void Sandbox::unflagChange() {
 bool Sandbox::haveChange() { 
     return  m_change ||
             isRecording() ||
+            #if defined(SUPPORT_MULTITHREAD_RECORDING)
+            m_load_done ||
+            #endif
             screenshotFile != "" ||
             m_sceneRender.haveChange() ||
             uniforms.haveChange();
@@ -1278,6 +1489,129 @@ void Sandbox::setSource(ShaderType _type, const std::string& _source) {
     }
 };
 
+void Sandbox::_updateSceneShaders() {
+    m_sceneRender.setShaders(uniforms, m_frag_source, m_vert_source);
+
+    addDefine("LIGHT_SHADOWMAP", "u_lightShadowMap");
+    #if defined(PLATFORM_RPI)
+    addDefine("LIGHT_SHADOWMAP_SIZE", "512.0");
+    #else
+    addDefine("LIGHT_SHADOWMAP_SIZE", "2048.0");
+    #endif
+
+    if (m_sceneRender.getShadowCascades() > 0)
+        addDefine("LIGHT_SHADOWMAP_CASCADES", vera::toString(m_sceneRender.getShadowCascades()));
+}
+
+void Sandbox::_updateSdf() {
+    uniforms.loadMutex.lock();
+    bool pending = m_sdf_pending;
+    float padding = m_sdf_padding;
+    uint32_t resolution = m_sdf_resolution;
+    bool compare = m_sdf_compare;
+    m_sdf_pending = false;
+    uniforms.loadMutex.unlock();
+
+    if (!pending)
+        return;
+
+    // Every voxel takes 64 bytes over the four sprites of the flood
+    uint32_t maxResolution = SdfFlood::getMaxResolution();
+    if (resolution > maxResolution) {
+        std::cout << "A " << resolution << "^3 SDF doesn't fit in GL_MAX_TEXTURE_SIZE or in " << (SDF_FLOOD_MEMORY_MAX >> 20) << "MB, using " << maxResolution << "^3 instead" << std::endl;
+        resolution = maxResolution;
+    }
+
+    for (vera::ModelsMap::iterator it = uniforms.models.begin(); it != uniforms.models.end(); ++it) {
+        std::string name = "u_" + it->first + "Sdf";
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        vera::Mesh mesh = it->second->mesh;
+        vera::center(mesh);
+
+        const std::vector<glm::vec3>& vertices = mesh.getVertices();
+        if (vertices.size() == 0)
+            continue;
+
+        // Same cube the CPU path gets from the BVH once squared and expanded
+        glm::vec3 lo = vertices[0];
+        glm::vec3 hi = vertices[0];
+        for (size_t i = 1; i < vertices.size(); i++) {
+            lo = glm::min(lo, vertices[i]);
+            hi = glm::max(hi, vertices[i]);
+        }
+        glm::vec3 diagonal = hi - lo;
+        float side = glm::max(diagonal.x, glm::max(diagonal.y, diagonal.z));
+        float max_dist = glm::length(glm::vec3(side));
+        float pad = (max_dist*max_dist) * padding;
+        glm::vec3 corner = (lo + hi) * 0.5f - glm::vec3(side * 0.5f + pad);
+        float size = side + pad * 2.0f;
+
+        std::unique_ptr<SdfFlood>& flood = m_sdf_floods[name];
+        if (!flood)
+            flood.reset(new SdfFlood());
+
+        if (!flood->compute(mesh, corner, size, resolution)) {
+            std::cout << "Couldn't flood the SDF of " << it->first << std::endl;
+            continue;
+        }
+        glFinish();
+
+        double duration_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Took " << duration_sec << "secs" << std::endl;
+
+        // A CPU version of the same field would be fed after this one, drop it
+        vera::TexturesMap::iterator tex = uniforms.textures.find(name);
+        if (tex != uniforms.textures.end()) {
+            delete tex->second;
+            uniforms.textures.erase(tex);
+        }
+
+        uniforms.functions[name] = UniformFunction("sampler2D", [this, name](vera::Shader& _shader) {
+            std::map<std::string, std::unique_ptr<SdfFlood>>::iterator flood = m_sdf_floods.find(name);
+            if (flood != m_sdf_floods.end() && uniforms.textures.find(name) == uniforms.textures.end())
+                _shader.setUniformTexture(name, flood->second->getFbo(), _shader.textureIndex++ );
+        });
+        uniforms.functions[name].present = true;
+
+        addDefine("MODEL_SDF_TEXTURE", name );
+        addDefine("MODEL_SDF_VOXEL_RESOLUTION", vera::toString(resolution) + ".0" );
+        addDefine("MODEL_SDF_TEXTURE_RESOLUTION", "vec2(" + vera::toString( flood->getWidth() ) + ".0)" );
+
+        if (!compare)
+            continue;
+
+        // The CPU path is the reference
+        std::vector<float> distances;
+        if (!flood->readback(distances))
+            continue;
+
+        std::vector<vera::Triangle> tris = mesh.getTriangles();
+        vera::BVH acc(tris, vera::SPLIT_MIDPOINT );
+        acc.square();
+        acc.expand( (max_dist*max_dist) * padding );
+
+        std::vector<vera::Image> layers;
+        toSdfLayers(&acc, resolution, layers, [](float _pct) { console_draw_pct(_pct); });
+
+        float max_error = 0.0f;
+        double sum_error = 0.0;
+        for (uint32_t z = 0; z < resolution; z++) {
+            const float* data = layers[z].getData();
+            int channels = layers[z].getChannels();
+            for (uint32_t i = 0; i < resolution * resolution; i++) {
+                float error = std::abs(data[i * channels] - distances[z * resolution * resolution + i]);
+                max_error = std::max(max_error, error);
+                sum_error += error;
+            }
+        }
+        std::cout << it->first << " SDF at " << resolution << "^3, gpu vs cpu max error " << max_error;
+        std::cout << " mean error " << (sum_error / double(distances.size())) << std::endl;
+    }
+
+    m_change = true;
+}
+
 void Sandbox::resetShaders( WatchFileList &_files ) {
 
     if (vera::getWindowStyle() != vera::EMBEDDED)
@@ -1290,16 +1624,10 @@ void Sandbox::resetShaders( WatchFileList &_files ) {
         if (verbose)
             std::cout << "Reset 3D scene shaders" << std::endl;
 
-        m_sceneRender.setShaders(uniforms, m_frag_source, m_vert_source);
-
-        addDefine("LIGHT_SHADOWMAP", "u_lightShadowMap");
-        #if defined(PLATFORM_RPI)
-        addDefine("LIGHT_SHADOWMAP_SIZE", "512.0");
-        #else
-        addDefine("LIGHT_SHADOWMAP_SIZE", "2048.0");
-        #endif
+        _updateSceneShaders();
     }
-    else {
+    // Models still loading will compile them once they arrive
+    else if (!isLoadingModels()) {
         if (verbose)
             std::cout << "Reset 2D shaders" << std::endl;
 
@@ -1336,6 +1664,12 @@ void Sandbox::resetShaders( WatchFileList &_files ) {
     uniforms.checkUniforms(m_vert_source, m_frag_source); // Check active native uniforms
     uniforms.flagChange();                                // Flag all user defined uniforms as changed
 
+    // The ambient occlusion is computed from the normal and position buffers
+    if (uniforms.functions["u_sceneSsao"].present) {
+        uniforms.functions["u_sceneNormal"].present = true;
+        uniforms.functions["u_scenePosition"].present = true;
+    }
+
     // UPDATE Buffers
     m_buffers_total = countBuffers(m_frag_source);
     m_doubleBuffers_total = countDoubleBuffers(m_frag_source);
@@ -1756,6 +2090,20 @@ void Sandbox::renderPrep() {
             uniforms.loadQueue.clear();
             uniforms.loadMutex.unlock();
         }
+
+        // Models parsed on a worker thread
+        _updateModels();
+
+        // Distance fields requested to be flooded on the GPU
+        _updateSdf();
+
+        // Vertex layout changes, packed textures, simplified models and floors ready on the worker threads
+        // Each model decodes its own compact layout, so the programs shared between them change
+        if (m_sceneRender.updateCompact(uniforms))
+            _updateSceneShaders();
+        m_sceneRender.updateTextureArrays(uniforms);
+        m_sceneRender.updateLods(uniforms);
+        m_sceneRender.updateFloor();
     }
 
     // BUFFERS
@@ -1778,16 +2126,24 @@ void Sandbox::renderPrep() {
     
     // MAIN SCENE
     // ----------------------------------------------- < main scene start
-    if (screenshotFile != "" || isRecording() )
+    if (screenshotFile != "" || isRecording() || m_capture)
         if (!m_record_fbo.isAllocated())
             m_record_fbo.allocate(vera::getWindowWidth(), vera::getWindowHeight(), vera::COLOR_TEXTURE_DEPTH_BUFFER);
 
-    if (uniforms.functions["u_sceneNormal"].present)
+    // Normal and position share one geometry pass when multiple render targets are supported
+    bool gbuffer =  uniforms.functions["u_sceneNormal"].present && 
+                    uniforms.functions["u_scenePosition"].present &&
+                    m_sceneRender.renderGBuffer(uniforms);
+
+    if (!gbuffer && uniforms.functions["u_sceneNormal"].present)
         m_sceneRender.renderNormalBuffer(uniforms);
 
-    if (uniforms.functions["u_scenePosition"].present)
+    if (!gbuffer && uniforms.functions["u_scenePosition"].present)
         m_sceneRender.renderPositionBuffer(uniforms);
 
+    if (uniforms.functions["u_sceneSsao"].present)
+        m_sceneRender.renderSsao(uniforms);
+
     if (m_sceneRender.getBuffersTotal() != 0)
         m_sceneRender.renderBuffers(uniforms);
 
@@ -1801,7 +2157,7 @@ void Sandbox::renderPrep() {
         }
         m_record_fbo.bind();
     }
-    else if (isRecording())
+    else if (isRecording() || m_capture)
         m_record_fbo.bind();
 
     // Clear the background
@@ -1809,6 +2165,10 @@ void Sandbox::renderPrep() {
 }
 
 void Sandbox::render() {
+    // Nothing to draw until the models arrive
+    if (uniforms.models.size() == 0 && isLoadingModels())
+        return;
+
     // RENDER CONTENT
     if (uniforms.models.size() == 0) {
         TRACK_BEGIN("render:2D_scene")
@@ -1894,7 +2254,7 @@ void Sandbox::renderPost() {
             }
             m_record_fbo.bind();
         }
-        else if (isRecording())
+        else if (isRecording() || m_capture)
             m_record_fbo.bind();
     
         m_postprocessing_shader.use();
@@ -1927,13 +2287,13 @@ void Sandbox::renderPost() {
             }
             m_record_fbo.bind();
         }
-        else if (isRecording())
+        else if (isRecording() || m_capture)
             m_record_fbo.bind();
 
         vera::image(m_sceneRender.renderFbo);
     }
         
-    if (screenshotFile != "" || isRecording()) {
+    if (screenshotFile != "" || isRecording() || m_capture) {
         m_record_fbo.unbind();
 
         glEnable(GL_BLEND);
@@ -2007,6 +2367,7 @@ void Sandbox::renderUI() {
         }
         nTotal += uniforms.functions["u_sceneNormal"].present;
         nTotal += uniforms.functions["u_scenePosition"].present;
+        nTotal += uniforms.functions["u_sceneSsao"].present;
         nTotal += m_sceneRender.getBuffersTotal();
         
         if (nTotal > 0) {
@@ -2115,6 +2476,12 @@ void Sandbox::renderUI() {
                 yOffset -= yStep * 2.0;
             }
 
+            if (uniforms.functions["u_sceneSsao"].present && m_sceneRender.getSsaoFbo()) {
+                vera::image(m_sceneRender.getSsaoFbo(), xOffset, yOffset, xStep, yStep);
+                vera::text("u_sceneSsao", xOffset - xStep, vera::getWindowHeight() - yOffset - yStep);
+                yOffset -= yStep * 2.0;
+            }
+
             for (size_t i = 0; i < m_sceneRender.buffersFbo.size(); i++) {
                 vera::image(m_sceneRender.buffersFbo[i], xOffset, yOffset, xStep, yStep);
                 vera::text("u_sceneBuffer" + vera::toString(i), xOffset - xStep, vera::getWindowHeight() - yOffset - yStep);
@@ -2139,7 +2506,9 @@ void Sandbox::renderUI() {
         TRACK_END("renderUI:buffers")
     }
 
-    if (m_plot != PLOT_OFF && m_plot_texture ) {
+    bool histogram = m_plot == PLOT_LUMA || m_plot == PLOT_RGB || m_plot == PLOT_RED || m_plot == PLOT_GREEN || m_plot == PLOT_BLUE;
+    bool history = m_plot == PLOT_FPS || m_plot == PLOT_MS;
+    if (m_plot != PLOT_OFF && ((histogram && (m_plot_texture || m_histogram.isGpu())) || (history && m_plot_history)) ) {
         glDisable(GL_DEPTH_TEST);
         TRACK_BEGIN("renderUI:plot_data")
 
@@ -2159,7 +2528,12 @@ void Sandbox::renderUI() {
         m_plot_shader.setUniform("u_viewMatrix", glm::mat4(1.0f));
         m_plot_shader.setUniform("u_projectionMatrix", glm::mat4(1.0f));
         m_plot_shader.setUniform("u_modelViewProjectionMatrix", vera::getOrthoMatrix());
-        m_plot_shader.setUniformTexture("u_plotData", m_plot_texture, 0);
+        if (history)
+            m_plot_shader.setUniformTexture("u_plotData", m_plot_history, 0);
+        else if (histogram && m_histogram.isGpu())
+            m_plot_shader.setUniformTexture("u_plotData", m_histogram.getFbo(), 0);
+        else
+            m_plot_shader.setUniformTexture("u_plotData", m_plot_texture, 0);
         
         vera::getBillboard()->render(&m_plot_shader);
         TRACK_END("renderUI:plot_data")
@@ -2305,7 +2679,7 @@ void Sandbox::renderDone() {
 
     unflagChange();
 
-    if (m_plot != PLOT_OFF)
+    if (m_plot != PLOT_OFF || uniforms.functions["u_history"].present)
         onPlot();
 
     if (!m_initialized) {
@@ -2502,7 +2876,7 @@ void Sandbox::onViewportResize(int _newWidth, int _newHeight) {
     else 
         m_sceneRender.updateBuffers(uniforms, _newWidth, _newHeight);
 
-    if (screenshotFile != "" || isRecording()) 
+    if (screenshotFile != "" || isRecording() || m_capture) 
         m_record_fbo.allocate(_newWidth, _newHeight, vera::COLOR_TEXTURE_DEPTH_BUFFER);
 
     flagChange();
@@ -2582,92 +2956,42 @@ void Sandbox::onScreenshot(std::string _file) {
 void Sandbox::onPlot() {
     // if ( !vera::isGL() )
     //     return;
-    if (!m_sceneRender.renderFbo.isAllocated())
-        return;
-
-    if ( (m_plot == PLOT_LUMA || m_plot == PLOT_RGB || m_plot == PLOT_RED || m_plot == PLOT_GREEN || m_plot == PLOT_BLUE ) && haveChange() ) {
+    if ( (m_plot == PLOT_LUMA || m_plot == PLOT_RGB || m_plot == PLOT_RED || m_plot == PLOT_GREEN || m_plot == PLOT_BLUE ) && 
+         (haveChange() || m_histogram.isPending()) && m_sceneRender.renderFbo.isAllocated() ) {
         TRACK_BEGIN("plot::histogram")
 
+        if (m_histogram.update(&m_sceneRender.renderFbo)) {
+            // Counted on the CPU, otherwise they are already on a texture
+            if (!m_histogram.isGpu()) {
+                std::copy(m_histogram.getValues(), m_histogram.getValues() + 256, m_plot_values);
 
-        // Extract pixels
-        glBindFramebuffer(GL_FRAMEBUFFER, m_sceneRender.renderFbo.getId());
-        int w = vera::getWindowWidth();
-        int h = vera::getWindowHeight();
-        int c = 3;
-        int total = w * h * c;
-        unsigned char* pixels = new unsigned char[total];
-        glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, pixels);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-        // Count frequencies of appearances 
-        float max_rgb_freq = 0;
-        float max_luma_freq = 0;
-        glm::vec4 freqs[256];
-        for (int i = 0; i < total; i += c) {
-            m_plot_values[pixels[i]].r++;
-            if (m_plot_values[pixels[i]].r > max_rgb_freq)
-                max_rgb_freq = m_plot_values[pixels[i]].r;
-
-            m_plot_values[pixels[i+1]].g++;
-            if (m_plot_values[pixels[i+1]].g > max_rgb_freq)
-                max_rgb_freq = m_plot_values[pixels[i+1]].g;
-
-            m_plot_values[pixels[i+2]].b++;
-            if (m_plot_values[pixels[i+2]].b > max_rgb_freq)
-                max_rgb_freq = m_plot_values[pixels[i+2]].b;
-
-            int luma = 0.299 * pixels[i] + 0.587 * pixels[i+1] + 0.114 * pixels[i+2];
-            m_plot_values[luma].a++;
-            if (m_plot_values[luma].a > max_luma_freq)
-                max_luma_freq = m_plot_values[luma].a;
+                if (m_plot_texture == nullptr)
+                    m_plot_texture = new vera::Texture();
+                m_plot_texture->load(256, 1, 4, 32, &m_plot_values[0], vera::NEAREST, vera::CLAMP);
+            }
+            uniforms.flagChange();
         }
-        delete[] pixels;
-
-        // Normalize frequencies
-        for (int i = 0; i < 256; i ++)
-            m_plot_values[i] = m_plot_values[i] / glm::vec4(max_rgb_freq, max_rgb_freq, max_rgb_freq, max_luma_freq);
 
-        if (m_plot_texture == nullptr)
-            m_plot_texture = new vera::Texture();
-        m_plot_texture->load(256, 1, 4, 32, &m_plot_values[0], vera::NEAREST, vera::CLAMP);
-
-        uniforms.textures["u_histogram"] = m_plot_texture;
-        uniforms.flagChange();
         TRACK_END("plot::histogram")
     }
 
-    else if (m_plot == PLOT_FPS ) {
-        TRACK_BEGIN("plot::fps")
-
-        // Push back values one position
-        for (int i = 0; i < 255; i ++)
-            m_plot_values[i] = m_plot_values[i+1];
-        m_plot_values[255] = glm::vec4( vera::getFps()/60.0f, 0.0f, 0.0f, 1.0f);
+    // fps, frame time and the user uniform picked with the history command, one texel per frame
+    if (m_plot == PLOT_FPS || m_plot == PLOT_MS || uniforms.functions["u_history"].present) {
+        TRACK_BEGIN("plot::history")
 
-        if (m_plot_texture == nullptr)
-            m_plot_texture = new vera::Texture();
-
-        m_plot_texture->load(256, 1, 4, 32, &m_plot_values[0], vera::NEAREST, vera::CLAMP);
-        // uniforms.textures["u_sceneFps"] = m_plot_texture;
-
-        TRACK_END("plot::fps")
-    }
-
-    else if (m_plot == PLOT_MS ) {
-        TRACK_BEGIN("plot::ms")
-
-        // Push back values one position
-        for (int i = 0; i < 255; i ++)
-            m_plot_values[i] = m_plot_values[i+1];
-        m_plot_values[255] = glm::vec4( vera::getDelta(), 0.0f, 0.0f, 1.0f);
-
-        if (m_plot_texture == nullptr)
-            m_plot_texture = new vera::Texture();
-
-        m_plot_texture->load(256, 1, 4, 32, &m_plot_values[0], vera::NEAREST, vera::CLAMP);
+        glm::vec4 value = glm::vec4( vera::getFps()/60.0f, vera::getDelta(), 0.0f, 0.0f);
+        if (m_history_uniform != "") {
+            UniformDataMap::iterator it = uniforms.data.find(m_history_uniform);
+            if (it != uniforms.data.end()) {
+                value.z = it->second.value[0];
+                value.w = (it->second.size > 1)? it->second.value[1] : 0.0f;
+            }
+        }
+        m_history.push(value);
 
-        // uniforms.textures["u_sceneMs"] = m_plot_texture;
+        if (m_plot == PLOT_FPS || m_plot == PLOT_MS)
+            m_plot_history = m_history.unroll( (m_plot == PLOT_FPS)? 0 : 1 );
 
-        TRACK_END("plot::ms")
+        TRACK_END("plot::history")
     }
 }
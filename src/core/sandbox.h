@@ -7,6 +7,9 @@
 
 #include "sceneRender.h"
 #include "tools/files.h"
+#include "tools/history.h"
+#include "tools/histogram.h"
+#include "tools/sdfFlood.h"
 #include "vera/ops/string.h"
 
 enum ShaderType {
@@ -50,6 +53,7 @@ public:
     void                renderDone();
 
     bool                isReady();
+    bool                isLoadingModels() const;
 
     void                addDefine( const std::string &_define, const std::string &_value = "");
     void                delDefine( const std::string &_define );
@@ -95,6 +99,11 @@ protected:
     void                _updateBuffers();
     void                _renderBuffers();
 
+    bool                _loadModelsAsync(const std::string& _path);
+    void                _updateModels();
+    void                _updateSceneShaders();
+    void                _updateSdf();
+
     // Main Shader
     std::string         m_frag_source;
     std::string         m_vert_source;
@@ -140,14 +149,34 @@ protected:
     vera::Texture*                  m_plot_texture;
     glm::vec4                       m_plot_values[256];
     PlotType                        m_plot;
+    Histogram                       m_histogram;
+    History                         m_history;
+    const vera::Fbo*                m_plot_history;
+    std::string                     m_history_uniform;  // user uniform recorded on u_history z and w
 
     // Recording
     vera::Fbo                       m_record_fbo;
+    bool                            m_capture;          // render into m_record_fbo every frame, for readbacks
     #if defined(SUPPORT_MULTITHREAD_RECORDING)
     std::atomic<int>                m_task_count {0};
     std::atomic<long long>          m_max_mem_in_queue {0};
     thread_pool::ThreadPool         m_save_threads;
+
+    // Geometry parsed on a worker thread
+    std::thread                     m_load_thread;
+    std::atomic<bool>               m_load_pending {false};
+    std::atomic<bool>               m_load_done {false};
     #endif
+    std::map<std::string, std::string> m_load_defines;
+    bool                            m_load_sun;
+
+    // Signed distance fields flooded on the GPU by uniform name. generate_sdf only requests
+    // them (guarded by uniforms.loadMutex), they are computed on the main thread
+    std::map<std::string, std::unique_ptr<SdfFlood>> m_sdf_floods;
+    float                           m_sdf_padding;
+    uint32_t                        m_sdf_resolution;
+    bool                            m_sdf_compare;
+    bool                            m_sdf_pending;
 
     // Other state properties
     glm::mat3                       m_view2d;
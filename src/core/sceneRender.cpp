@@ -7,6 +7,11 @@
 
 #include <sys/stat.h>
 #include <random>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <chrono>
+#include <sstream>
 
 #include "vera/ops/fs.h"
 #include "vera/ops/draw.h"
@@ -19,6 +24,10 @@
 #include "vera/xr/xr.h"
 
 #include "tools/text.h"
+#include "tools/hash.h"
+#include "tools/cache.h"
+#include "tools/cascades.h"
+#include "tools/simplify.h"
 
 
 #if defined(DEBUG)
@@ -39,18 +48,47 @@ SceneRender::SceneRender():
     // Camera.
     m_blend(vera::BLEND_ALPHA), m_culling(vera::CULL_NONE), m_depth_test(true),
     // Light
-    dynamicShadows(false), m_shadows(false),
+    dynamicShadows(false), cachedShadows(true), m_shadows(false), m_shadows_dynamic_total(0), m_shadows_animated(false),
+    m_shadows_cascades_total(0), m_shadows_frame(0),
+    // Culling
+    frustumCulling(true), singlePassGBuffer(true), depthPrepass(false), levelOfDetail(true), compactVertices(false), textureArrays(false), m_gbuffer_shaders(false), m_depth_shaders(false), m_depth_discard(false),
+    // Level of detail
+    m_lods_queue(new LodQueue()), m_lods_generation(0),
+    // Compact vertex formats
+    m_compact_active(false),
+    // Texture arrays
+    m_texture_arrays_active(false),
     // Background
     m_background(false), 
     // Floor
-    m_floor_height(0.0), m_floor_subd_target(-1), m_floor_subd(-1),
+    m_floor_height(0.0), m_floor_subd_target(-1), m_floor_subd(-1), m_floor_queue(new FloorQueue()),
 
     m_buffers_total(0), m_commands_loaded(false), m_uniforms_loaded(false)
+    #if defined(SUPPORT_MULTITHREAD_RECORDING)
+    , m_threads(std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / 2))
+    #endif
     {
     m_origin.setPosition(glm::vec3(0.0));
+
+    // Near cascades are sharper and refresh every frame, far ones are coarser and refresh less often
+    #if defined(PLATFORM_RPI)
+    const int sizes[SHADOW_CASCADES_MAX] = { 512, 512, 256, 256 };
+    #else
+    const int sizes[SHADOW_CASCADES_MAX] = { 2048, 2048, 1024, 1024 };
+    #endif
+    const int every[SHADOW_CASCADES_MAX] = { 1, 1, 2, 4 };
+    for (size_t i = 0; i < SHADOW_CASCADES_MAX; i++) {
+        m_shadows_cascades[i].size = sizes[i];
+        m_shadows_cascades[i].every = every[i];
+        m_shadows_cascades[i].split = 0.0f;
+        m_shadows_cascades[i].valid = false;
+    }
 }
 
 SceneRender::~SceneRender() {
+    clearInstances();
+    clearLods();
+    clearCompact();
 }
 
 void SceneRender::commandsInit(CommandList& _commands, Uniforms& _uniforms) {
@@ -204,6 +242,7 @@ void SceneRender::commandsInit(CommandList& _commands, Uniforms& _uniforms) {
                 std::vector<std::string> values = vera::split(_line,',');
                 if (values.size() == 2) {
                     dynamicShadows = (values[1] == "on");
+                    invalidateShadows();
                     return true;
                 }
             }
@@ -211,6 +250,195 @@ void SceneRender::commandsInit(CommandList& _commands, Uniforms& _uniforms) {
         },
         "dynamic_shadows[,on|off]", "get or set dynamic shadows"));
 
+        _commands.push_back(Command("cached_shadows", [&](const std::string& _line){ 
+            if (_line == "cached_shadows") {
+                std::string rta = cachedShadows ? "on" : "off";
+                std::cout <<  rta << std::endl; 
+                return true;
+            }
+            else {
+                std::vector<std::string> values = vera::split(_line,',');
+                if (values.size() == 2) {
+                    cachedShadows = (values[1] == "on");
+                    invalidateShadows();
+                    return true;
+                }
+            }
+            return false;
+        },
+        "cached_shadows[,on|off]", "get or set if static shadow casters are cached"));
+
+        _commands.push_back(Command("frustum_culling", [&](const std::string& _line){ 
+            if (_line == "frustum_culling") {
+                std::string rta = frustumCulling ? "on" : "off";
+                std::cout <<  rta << std::endl; 
+                return true;
+            }
+            else {
+                std::vector<std::string> values = vera::split(_line,',');
+                if (values.size() == 2) {
+                    if (values[1] == "toggle")
+                        values[1] = frustumCulling ? "off" : "on";
+
+                    frustumCulling = (values[1] == "on");
+                    return true;
+                }
+            }
+            return false;
+        },
+        "frustum_culling[,on|off]", "skip models outside the camera or light frustum"));
+
+        _commands.push_back(Command("gbuffer", [&](const std::string& _line){ 
+            if (_line == "gbuffer") {
+                std::string rta = singlePassGBuffer ? "on" : "off";
+                std::cout <<  rta << std::endl; 
+                return true;
+            }
+            else {
+                std::vector<std::string> values = vera::split(_line,',');
+                if (values.size() == 2) {
+                    singlePassGBuffer = (values[1] == "on");
+                    return true;
+                }
+            }
+            return false;
+        },
+        "gbuffer[,on|off]", "get or set if u_sceneNormal and u_scenePosition are drawn on a single pass"));
+
+        _commands.push_back(Command("ssao", [&](const std::string& _line){ 
+            if (_line == "ssao") {
+                std::cout << m_ssao.getSamples() << ',' << m_ssao.radius << ',' << 
+                            (m_ssao.halfResolution ? "half" : "full") << ',' << 
+                            (m_ssao.temporal ? "temporal" : "off") << std::endl; 
+                return true;
+            }
+            else {
+                std::vector<std::string> values = vera::split(_line,',');
+                if (values.size() >= 2 && values.size() <= 5) {
+                    m_ssao.setSamples( vera::toInt(values[1]) );
+                    if (values.size() > 2)
+                        m_ssao.radius = vera::toFloat(values[2]);
+                    if (values.size() > 3)
+                        m_ssao.halfResolution = (values[3] == "half");
+                    if (values.size() > 4)
+                        m_ssao.temporal = (values[4] == "temporal");
+                    return true;
+                }
+            }
+            return false;
+        },
+        "ssao[,<samples>[,<radius>[,half|full[,temporal|off]]]]", "get or set how u_sceneSsao is computed"));
+
+        _commands.push_back(Command("depth_prepass", [&](const std::string& _line){ 
+            if (_line == "depth_prepass") {
+                std::string rta = depthPrepass ? "on" : "off";
+                std::cout <<  rta << std::endl; 
+                return true;
+            }
+            else {
+                std::vector<std::string> values = vera::split(_line,',');
+                if (values.size() == 2) {
+                    depthPrepass = (values[1] == "on");
+                    return true;
+                }
+            }
+            return false;
+        },
+        "depth_prepass[,on|off]", "get or set if the scene depth is drawn first so each pixel is shaded only once (needs blend,none and materials that don't discard)"));
+
+        _commands.push_back(Command("lod", [&](const std::string& _line){ 
+            if (_line == "lod") {
+                std::string rta = levelOfDetail ? "on" : "off";
+                std::cout <<  rta << std::endl; 
+                return true;
+            }
+            else {
+                std::vector<std::string> values = vera::split(_line,',');
+                if (values.size() == 2) {
+                    levelOfDetail = (values[1] == "on");
+                    invalidateShadows();
+                    return true;
+                }
+            }
+            return false;
+        },
+        "lod[,on|off]", "get or set if dense models are replaced by simplified versions when they look small on screen (instanced models are always drawn whole)"));
+
+        _commands.push_back(Command("compact_vertices", [&](const std::string& _line){ 
+            if (_line == "compact_vertices") {
+                std::string rta = compactVertices ? "on" : "off";
+                std::cout <<  rta << std::endl; 
+                return true;
+            }
+            else {
+                std::vector<std::string> values = vera::split(_line,',');
+                if (values.size() == 2) {
+                    compactVertices = (values[1] == "on");
+                    return true;
+                }
+            }
+            return false;
+        },
+        "compact_vertices[,on|off]", "get or set if models are uploaded with quantized vertex attributes and 16bits indices"));
+
+        _commands.push_back(Command("texture_arrays", [&](const std::string& _line){ 
+            if (_line == "texture_arrays") {
+                std::string rta = textureArrays ? "on" : "off";
+                if (m_texture_arrays_active)
+                    rta += " (" + vera::toString((int)m_texture_arrays.getPackedTotal()) + " textures on " + vera::toString((int)m_texture_arrays.getTotal()) + " arrays)";
+                std::cout <<  rta << std::endl; 
+                return true;
+            }
+            else {
+                std::vector<std::string> values = vera::split(_line,',');
+                if (values.size() == 2) {
+                    textureArrays = (values[1] == "on");
+                    return true;
+                }
+            }
+            return false;
+        },
+        "texture_arrays[,on|off]", "get or set if the scene textures of the same size are packed into arrays for the models (sampled with <name>Array and <name>Layer)"));
+
+        _commands.push_back(Command("shadow_cascades", [&](const std::string& _line){ 
+            if (_line == "shadow_cascades") {
+                std::cout << m_shadows_cascades_total << std::endl; 
+                return true;
+            }
+            else {
+                std::vector<std::string> values = vera::split(_line,',');
+                if (values.size() == 2) {
+                    setShadowCascades(_uniforms, vera::toInt(values[1]));
+                    return true;
+                }
+            }
+            return false;
+        },
+        "shadow_cascades[,<0|2|3|4>]", "get or set the number of cascaded shadow maps of the main light (0 disables them)"));
+
+        _commands.push_back(Command("shadow_cascade", [&](const std::string& _line){ 
+            std::vector<std::string> values = vera::split(_line,',');
+            if (values.size() < 2)
+                return false;
+
+            size_t index = vera::toInt(values[1]);
+            if (index >= SHADOW_CASCADES_MAX)
+                return false;
+
+            ShadowCascade& cascade = m_shadows_cascades[index];
+            if (values.size() == 2) {
+                std::cout << cascade.size << "," << cascade.every << std::endl;
+                return true;
+            }
+
+            cascade.size = std::max(16, vera::toInt(values[2]));
+            if (values.size() > 3)
+                cascade.every = std::max(1, vera::toInt(values[3]));
+            cascade.valid = false;
+            return true;
+        },
+        "shadow_cascade,<index>[,<size>[,<every_n_frames>]]", "get or set the resolution and update frequency of a shadow cascade"));
+
         _commands.push_back(Command("floor_color", [&](const std::string& _line){ 
             std::vector<std::string> values = vera::split(_line,',');
             if (values.size() == 4) {
@@ -317,6 +545,23 @@ void SceneRender::commandsInit(CommandList& _commands, Uniforms& _uniforms) {
             return false;
         },
         "bboxes[,on|off]", "show/hide models bounding boxes"));
+
+        _commands.push_back(Command("raycast", [&](const std::string& _line){
+            std::vector<std::string> values = vera::split(_line,',');
+            if (values.size() == 3) {
+                RaycastHit hit;
+                if (raycast(_uniforms, vera::toFloat(values[1]), vera::toFloat(values[2]), hit))
+                    std::cout << hit.model << ',' << 
+                                hit.position.x << ',' << hit.position.y << ',' << hit.position.z << ',' << 
+                                hit.normal.x << ',' << hit.normal.y << ',' << hit.normal.z << ',' << 
+                                hit.distance << ',' << hit.microseconds << std::endl;
+                else
+                    std::cout << "none" << std::endl;
+                return true;
+            }
+            return false;
+        },
+        "raycast,<x>,<y>", "print model,position,normal,distance,microseconds of the closest surface under a pixel (from the bottom left)"));
         m_commands_loaded = true;
     }
 }
@@ -350,7 +595,13 @@ void SceneRender::uniformsInit(Uniforms& _uniforms) {
                 _shader.setUniformTexture("u_scenePosition", &positionFbo, _shader.textureIndex++ );
         });
 
-        // SSAO data (https://learnopengl.com/Advanced-Lighting/SSAO)
+        // Ambient occlusion computed from u_scenePosition and u_sceneNormal
+        _uniforms.functions["u_sceneSsao"] = UniformFunction("sampler2D", [this](vera::Shader& _shader) {
+            if (m_ssao.getFbo())
+                _shader.setUniformTexture("u_sceneSsao", m_ssao.getFbo(), _shader.textureIndex++ );
+        });
+
+        // SSAO data (https://learnopengl.com/Advanced-Lighting/SSAO) for shaders doing their own
         //
         std::uniform_real_distribution<float> randomFloats(0.0, 1.0); // random floats between [0.0, 1.0]
         std::default_random_engine generator;
@@ -380,6 +631,36 @@ void SceneRender::uniformsInit(Uniforms& _uniforms) {
         _uniforms.functions["u_ssaoNoise"] = UniformFunction("vec3", [this](vera::Shader& _shader) {
             _shader.setUniform("u_ssaoNoise", m_ssaoNoise, 16 );
         });
+
+        // Cascaded shadow maps. Pick the cascade comparing the camera distance with u_lightCascadeSplits
+        //
+        _uniforms.functions["u_lightCascadeSplits"] = UniformFunction("vec4", [this](vera::Shader& _shader) {
+            glm::vec4 splits = glm::vec4(0.0f);
+            for (size_t i = 0; i < m_shadows_cascades_total; i++)
+                splits[i] = m_shadows_cascades[i].split;
+            _shader.setUniform("u_lightCascadeSplits", splits);
+        });
+
+        _uniforms.functions["u_lightCascadeSizes"] = UniformFunction("vec4", [this](vera::Shader& _shader) {
+            glm::vec4 sizes = glm::vec4(0.0f);
+            for (size_t i = 0; i < m_shadows_cascades_total; i++)
+                sizes[i] = float(m_shadows_cascades[i].size);
+            _shader.setUniform("u_lightCascadeSizes", sizes);
+        });
+
+        for (size_t i = 0; i < SHADOW_CASCADES_MAX; i++) {
+            std::string matrix = "u_lightCascadeMatrix" + vera::toString(i);
+            _uniforms.functions[matrix] = UniformFunction("mat4", [this, i, matrix](vera::Shader& _shader) {
+                if (i < m_shadows_cascades_total)
+                    _shader.setUniform(matrix, m_shadows_cascades[i].matrix);
+            });
+
+            std::string shadowMap = "u_lightCascadeShadowMap" + vera::toString(i);
+            _uniforms.functions[shadowMap] = UniformFunction("sampler2D", [this, i, shadowMap](vera::Shader& _shader) {
+                if (i < m_shadows_cascades_total && m_shadows_cascades[i].depth.isAllocated())
+                    _shader.setUniformDepthTexture(shadowMap, &m_shadows_cascades[i].depth, _shader.textureIndex++ );
+            });
+        }
         m_uniforms_loaded = false;
     }
 }
@@ -389,22 +670,29 @@ void SceneRender::addDefine(const std::string& _define, const std::string& _valu
     m_floor.addDefine(_define, _value);
 
     for (size_t i = 0; i < m_devlook_spheres.size(); i++)
-        m_devlook_spheres[i]->getShader()->addDefine(_define, _value);
+        m_devlook_spheres[i]->shader.addDefine(_define, _value);
 
     for (size_t i = 0; i < m_devlook_billboards.size(); i++)
-        m_devlook_billboards[i]->getShader()->addDefine(_define, _value);
+        m_devlook_billboards[i]->shader.addDefine(_define, _value);
 }
 
 void SceneRender::delDefine(const std::string& _define) {
     m_background_shader.delDefine(_define);
     m_floor.delDefine(_define);
+
+    for (size_t i = 0; i < m_devlook_spheres.size(); i++)
+        m_devlook_spheres[i]->shader.delDefine(_define);
+
+    for (size_t i = 0; i < m_devlook_billboards.size(); i++)
+        m_devlook_billboards[i]->shader.delDefine(_define);
 }
 
 void SceneRender::flagChange() { 
     m_origin.bChange = true; 
 }
 bool SceneRender::haveChange() const { 
-    return m_origin.bChange; 
+    // Keep frames coming until the floors on the workers are swapped in
+    return m_origin.bChange || !m_floor_pending.empty(); 
 }
 void SceneRender::unflagChange() {  
     m_origin.bChange = false; 
@@ -429,20 +717,40 @@ void SceneRender::printDefines() {
         std::cout << "." << std::endl;
         std::cout << "| DEVLOOK SPHERE " << i << std::endl;
         std::cout << "+------------- " << std::endl;
-        m_devlook_spheres[i]->getShader()->printDefines();
+        m_devlook_spheres[i]->shader.printDefines();
     }
 
     for (size_t i = 0; i < m_devlook_billboards.size(); i++) {
         std::cout << "." << std::endl;
         std::cout << "| DEVLOOK BILLBOARD " << i << std::endl;
         std::cout << "+------------- " << std::endl;
-        m_devlook_billboards[i]->getShader()->printDefines();
+        m_devlook_billboards[i]->shader.printDefines();
     }
 }
 
 bool SceneRender::loadScene(Uniforms& _uniforms) {
     vera::cleanLabels();
 
+    // Instances are grouped again when the shaders are set
+    clearInstances();
+    m_shadows_casters.clear();
+    m_shadows_caches.clear();
+
+    // Quantized copies of the models, levels of detail use the same layout
+    clearCompact();
+    if (compactVertices)
+        buildCompact(_uniforms);
+
+    // New models get the texture arrays defines on the next update
+    m_texture_arrays.clear();
+    m_texture_arrays_active = false;
+
+    // Simplify dense models in the background
+    buildLods(_uniforms);
+
+    // Index the triangles for raycasts in the background
+    buildRaycast(_uniforms);
+
     // Calculate the total area
     vera::BoundingBox bbox;
     for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
@@ -471,185 +779,804 @@ bool SceneRender::loadScene(Uniforms& _uniforms) {
 }
 
 bool SceneRender::clearScene() {
+    clearInstances();
+    m_programs.clear();
+    clearLods();
+    clearCompact();
+    m_gbuffer.clear();
+    m_ssao.reset();
+    m_shadows_casters.clear();
+    m_shadows_caches.clear();
+    {
+        std::lock_guard<std::mutex> lock(m_raycast_mutex);
+        m_raycast_targets.clear();
+    }
     m_floor.clear();
+    clearFloor();
     m_floor_subd = -1;
     m_floor_height = 0.0;
     m_origin.setPosition(glm::vec3(0.0f, 0.0f, 0.0f));
     return true;
 }
 
-void SceneRender::setShaders(Uniforms& _uniforms, const std::string& _fragmentShader, const std::string& _vertexShader) {
-    // Background
-    m_background = checkBackground(_fragmentShader);
-    if (m_background) {
-        // Specific defines for this buffer
-        m_background_shader.addDefine("BACKGROUND");
-        m_background_shader.setSource(_fragmentShader, vera::getDefaultSrc(vera::VERT_BILLBOARD));
-        m_background_shader.addDefine("GLSLVIEWER", vera::toString(GLSLVIEWER_VERSION_MAJOR) + vera::toString(GLSLVIEWER_VERSION_MINOR) + vera::toString(GLSLVIEWER_VERSION_PATCH) );
-    }
+void SceneRender::updateInstances(Uniforms& _uniforms) {
+    clearInstances();
 
-    bool position_buffer = findId(_fragmentShader, "u_scenePosition;");
-    bool normal_buffer = findId(_fragmentShader, "u_sceneNormal;");
-    m_shadows = findId(_fragmentShader, "u_lightShadowMap;");
-    m_buffers_total = std::max( countSceneBuffers(_vertexShader), 
-                                countSceneBuffers(_fragmentShader) );
+    if (!MeshVbo::supportsInstancing())
+        return;
 
+    // Group models with identical geometry and material
+    std::map<uint64_t, std::vector<vera::Model*> > candidates;
     for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
-        it->second->setShader( _fragmentShader, _vertexShader);
+        uint64_t key = hashString( it->second->mesh.getMaterial().name, hashMesh(it->second->mesh) );
+        candidates[key].push_back(it->second);
+    }
 
-        if (m_shadows)
-            it->second->setBufferShader("shadow", vera::getDefaultSrc(vera::FRAG_ERROR), _vertexShader);
+    for (std::map<uint64_t, std::vector<vera::Model*> >::iterator it = candidates.begin(); it != candidates.end(); ++it) {
+        if (it->second.size() < 2)
+            continue;
 
-        if (position_buffer)
-            it->second->setBufferShader("position", vera::getDefaultSrc(vera::FRAG_POSITION), _vertexShader);
-        
-        if (normal_buffer)
-            it->second->setBufferShader("normal", vera::getDefaultSrc(vera::FRAG_NORMAL), _vertexShader);
+        InstanceGroup* group = new InstanceGroup();
+        group->leader = it->second[0];
+        group->models = it->second;
+        vera::BoundingBox bbox = group->leader->getBoundingBox();
+        group->vbo = new MeshVbo(group->leader->mesh, m_compact_active, &bbox);
+        group->depth = 0.0f;
+        group->active = false;
+        m_instances_groups.push_back(group);
+
+        for (size_t i = 0; i < group->models.size(); i++)
+            m_instances[ group->models[i] ] = group;
+    }
+}
 
-        for (size_t i = 0; i < m_buffers_total; i++) {
-            std::string bufferName = "u_sceneBuffer" + vera::toString(i);
-            it->second->setBufferShader(bufferName, _fragmentShader, _vertexShader);
-            it->second->getBufferShader(bufferName)->delDefine("FLOOR");
-            it->second->getBufferShader(bufferName)->addDefine("SCENE_BUFFER_" + vera::toString(i));
-        }
+void SceneRender::clearInstances() {
+    for (size_t i = 0; i < m_instances_groups.size(); i++) {
+        delete m_instances_groups[i]->vbo;
+        delete m_instances_groups[i];
     }
+    m_instances_groups.clear();
+    m_instances.clear();
+}
 
-    // Floor
-    bool thereIsFloorDefine = checkFloor(_fragmentShader) || checkFloor(_vertexShader);
-    if (thereIsFloorDefine) {
-        if (m_floor.getVbo() == nullptr) {
-            m_floor.setName("FLOOR");
-            m_floor.setGeom( vera::planeMesh(1.0f, 1.0f, 2, 2) );
+// Each level halves the triangles of the previous one. Levels are kept on disk by the hash 
+// of the mesh, so the next time the same model is loaded they don't need to be simplified again
+static void simplifyLods(const vera::Mesh& _mesh, std::vector<vera::Mesh>& _levels) {
+    std::string folder = getCacheFolder("lod");
+    std::string key = hashToString( hashMesh(_mesh) );
+
+    for (size_t l = 1; l < LOD_LEVELS; l++) {
+        const vera::Mesh& src = (l == 1)? _mesh : _levels.back();
+        std::string file = folder.empty()? "" : folder + "/" + key + "_" + vera::toString((int)l) + ".lod";
+
+        vera::Mesh level;
+        if (file.empty() || !loadMeshCache(file, level)) {
+            level = simplifyMesh(src, 0.5f);
+            if (!file.empty() && getTrianglesTotal(level) > 0)
+                saveMeshCache(file, level);
         }
 
-        m_floor.setShader(_fragmentShader, _vertexShader);
+        // Stop when the simplification can't go further
+        size_t triangles = getTrianglesTotal(level);
+        if (triangles == 0 || triangles >= getTrianglesTotal(src) * 0.9f)
+            break;
 
-        if (m_floor_subd == -1)
-            m_floor_subd_target = 0;
+        _levels.push_back(level);
+    }
+}
 
-        if (m_shadows) 
-            m_floor.setBufferShader("shadow", vera::getDefaultSrc(vera::FRAG_ERROR), _vertexShader);
+void SceneRender::buildLods(Uniforms& _uniforms) {
+    clearLods();
 
-        if (position_buffer)
-            m_floor.setBufferShader("position", vera::getDefaultSrc(vera::FRAG_POSITION), _vertexShader);
-        
-        if (normal_buffer)
-            m_floor.setBufferShader("normal", vera::getDefaultSrc(vera::FRAG_NORMAL), _vertexShader);
+    for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
+        const vera::Mesh& mesh = it->second->mesh;
+        if (!mesh.haveIndices() || getTrianglesTotal(mesh) < LOD_MIN_TRIANGLES)
+            continue;
 
-        for (size_t i = 0; i < m_buffers_total; i++) {
-            std::string bufferName = "u_sceneBuffer" + vera::toString(i);
-            m_floor.setBufferShader(bufferName, _fragmentShader, _vertexShader);
-            m_floor.getBufferShader(bufferName)->addDefine("FLOOR");
-            m_floor.getBufferShader(bufferName)->addDefine("SCENE_BUFFER_" + vera::toString(i));
-        }
+        // The job works on its own copy of the mesh and only touches the queue it shares with us
+        std::shared_ptr<LodQueue> queue = m_lods_queue;
+        std::string name = it->first;
+        size_t generation = m_lods_generation;
+        vera::Mesh copy = mesh;
+        std::function<void()> job = [queue, name, generation, copy]() {
+            LodResult result;
+            result.model = name;
+            result.generation = generation;
+            simplifyLods(copy, result.levels);
+
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->done.push_back(result);
+        };
+
+        #if defined(SUPPORT_MULTITHREAD_RECORDING)
+        m_threads.Submit(job);
+        #else
+        job();
+        #endif
     }
+}
 
-    // DevLook
-    int devLookSpheres = countDevLookSpheres(_fragmentShader);
-    if (devLookSpheres != m_devlook_spheres.size()) {
-        m_devlook_spheres.clear();
-
-        for (int i = 0; i < devLookSpheres; i++) {
-            m_devlook_spheres.push_back( new vera::Model("DEVLOOK_SPHERE_" + vera::toString(i), vera::sphereMesh(24)) );
-
-            m_devlook_spheres[i]->setShader(_fragmentShader, vera::getDefaultSrc(vera::VERT_DEVLOOK_SPHERE));
-            m_devlook_spheres[i]->getShader()->addDefine("DEVLOOK_SPHERE_" + vera::toString(i));
-            m_devlook_spheres[i]->getShader()->addDefine("DEVLOOK_Y_OFFSET", 0.8 - i * 0.35);
-        }
+void SceneRender::updateLods(Uniforms& _uniforms) {
+    std::vector<LodResult> done;
+    {
+        std::lock_guard<std::mutex> lock(m_lods_queue->mutex);
+        if (m_lods_queue->done.empty())
+            return;
+        done.swap(m_lods_queue->done);
     }
-    else if (devLookSpheres > 0)
-        for (int i = 0; i < devLookSpheres; i++)
-            m_devlook_spheres[i]->setShader(_fragmentShader, vera::getDefaultSrc(vera::VERT_DEVLOOK_SPHERE));
 
-    int devLookBillboards = countDevLookBillboards(_fragmentShader);
-    if (devLookBillboards != m_devlook_billboards.size()) {
-        m_devlook_billboards.clear();
+    for (size_t i = 0; i < done.size(); i++) {
+        // Results of a previous scene
+        if (done[i].generation != m_lods_generation || done[i].levels.empty())
+            continue;
 
-        for (int i = 0; i < devLookBillboards; i++) {
-            m_devlook_billboards.push_back( new vera::Model("DEVLOOK_BILLBOARD_" + vera::toString(i), vera::planeMesh(1.0f, 1.0f, 2, 2)) );
+        vera::ModelsMap::iterator it = _uniforms.models.find(done[i].model);
+        if (it == _uniforms.models.end())
+            continue;
 
-            m_devlook_billboards[i]->setShader(_fragmentShader, vera::getDefaultSrc(vera::VERT_DEVLOOK_BILLBOARD));
-            m_devlook_billboards[i]->getShader()->addDefine("DEVLOOK_BILLBOARD_" + vera::toString(i));
-            m_devlook_billboards[i]->getShader()->addDefine("DEVLOOK_Y_OFFSET", 0.8 - m_devlook_spheres.size() * 0.35 - i * 0.325);
+        ModelLod& lod = m_lods[it->second];
+        lod.levels.push_back(nullptr);
+        lod.triangles.push_back( getTrianglesTotal(it->second->mesh) );
+        // All levels share the bounds of the model so they decode the same way
+        vera::BoundingBox bbox = it->second->getBoundingBox();
+        for (size_t l = 0; l < done[i].levels.size(); l++) {
+            lod.levels.push_back( new MeshVbo(done[i].levels[l], m_compact_active, &bbox) );
+            lod.triangles.push_back( getTrianglesTotal(done[i].levels[l]) );
         }
     }
-    else if (devLookBillboards > 0)
-        for (int i = 0; i < devLookBillboards; i++)
-            m_devlook_billboards[i]->setShader(_fragmentShader, vera::getDefaultSrc(vera::VERT_DEVLOOK_BILLBOARD));
 
+    // Casters may have changed their geometry
+    invalidateShadows();
 }
 
-void SceneRender::updateBuffers(Uniforms& _uniforms, int _width, int _height) {
-    vera::FboType type = _uniforms.functions["u_sceneDepth"].present ? vera::COLOR_DEPTH_TEXTURES : vera::COLOR_TEXTURE_DEPTH_BUFFER;
-
-    if (!renderFbo.isAllocated() ||
-        renderFbo.getType() != type || 
-        renderFbo.getWidth() != _width || renderFbo.getHeight() != _height )
-        renderFbo.allocate(_width, _height, type);
+void SceneRender::clearLods() {
+    for (std::map<vera::Model*, ModelLod>::iterator it = m_lods.begin(); it != m_lods.end(); ++it)
+        for (size_t l = 0; l < it->second.levels.size(); l++)
+            delete it->second.levels[l];
+    m_lods.clear();
 
-    if (_uniforms.functions["u_sceneNormal"].present && 
-        (   !normalFbo.isAllocated() || 
-            normalFbo.getWidth() != _width || normalFbo.getHeight() != _height ) )
-        normalFbo.allocate(_width, _height, vera::GBUFFER_TEXTURE);
+    // Jobs still running will finish on a generation nobody is waiting for
+    m_lods_generation++;
+    std::lock_guard<std::mutex> lock(m_lods_queue->mutex);
+    m_lods_queue->done.clear();
+}
 
-    
-    if (_uniforms.functions["u_scenePosition"].present && 
-        (   !positionFbo.isAllocated() || 
-            positionFbo.getWidth() != _width || positionFbo.getHeight() != _height ) )
-        positionFbo.allocate(_width, _height, vera::GBUFFER_TEXTURE);
+void SceneRender::buildRaycast(Uniforms& _uniforms) {
+    std::lock_guard<std::mutex> lock(m_raycast_mutex);
 
-    for (size_t i = 0; i < buffersFbo.size(); i++)
-        if ( !buffersFbo[i]->isAllocated() ||
-            buffersFbo[i]->getWidth() != _width || buffersFbo[i]->getHeight() != _height)
-            buffersFbo[i]->allocate(_width, _height, vera::GBUFFER_TEXTURE);
-}
+    // Scenes are loaded again every time a model is added, only new models need a BVH
+    std::map<vera::Model*, RaycastTarget> targets;
+    for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
+        const vera::Mesh& mesh = it->second->mesh;
+        std::map<vera::Model*, RaycastTarget>::iterator found = m_raycast_targets.find(it->second);
+        if (found != m_raycast_targets.end() && found->second.vertices == mesh.getVerticesTotal()) {
+            targets[it->second] = found->second;
+            continue;
+        }
 
-void SceneRender::printBuffers() {
-    for (size_t i = 0; i < buffersFbo.size(); i++)
-        std::cout << "uniform sampler2D u_sceneBuffer" << i << ";" << std::endl;
-}
+        RaycastTarget target;
+        target.bvh = std::make_shared<RaycastBvh>();
+        target.vertices = mesh.getVerticesTotal();
 
-void SceneRender::render(Uniforms& _uniforms) {
-    // Render Background
-    renderBackground(_uniforms);
+        // The job works on its own copy of the mesh and only touches the BVH it shares with us
+        std::shared_ptr<RaycastBvh> bvh = target.bvh;
+        vera::Mesh copy = mesh;
+        std::function<void()> job = [bvh, copy]() { bvh->build(copy); };
 
-    // Begining of DEPTH for 3D 
-    if (m_depth_test)
-        glEnable(GL_DEPTH_TEST);
+        #if defined(SUPPORT_MULTITHREAD_RECORDING)
+        target.ready = m_threads.Submit(job).share();
+        #else
+        job();
+        #endif
 
-    vera::blendMode(m_blend);
+        targets[it->second] = target;
+    }
+    m_raycast_targets.swap(targets);
+}
 
-    if (_uniforms.activeCamera->bChange || m_origin.bChange) {
-        vera::setCamera( _uniforms.activeCamera );
-        vera::applyMatrix( m_origin.getTransformMatrix() );
+bool SceneRender::raycast(Uniforms& _uniforms, float _x, float _y, RaycastHit& _hit) {
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    vera::Camera* camera = _uniforms.activeCamera;
+    if (camera == nullptr)
+        return false;
+
+    // From the near to the far plane, in the space models are placed in (before the origin offset)
+    glm::vec2 ndc = glm::vec2(_x / vera::getWindowWidth(), _y / vera::getWindowHeight()) * 2.0f - 1.0f;
+    glm::mat4 unproject = glm::inverse( camera->getProjectionMatrix() * camera->getViewMatrix() * m_origin.getTransformMatrix() );
+    glm::vec4 near = unproject * glm::vec4(ndc.x, ndc.y, -1.0f, 1.0f);
+    glm::vec4 far = unproject * glm::vec4(ndc.x, ndc.y, 1.0f, 1.0f);
+    glm::vec3 origin = glm::vec3(near) / near.w;
+    glm::vec3 direction = glm::vec3(far) / far.w - origin;
+
+    // Models are walked from the scene, so the ones removed since the last load are never touched.
+    // The targets are copied out, so a reload doesn't wait for the builds this query waits for
+    std::vector< std::pair<vera::Model*, RaycastTarget> > targets;
+    {
+        std::lock_guard<std::mutex> lock(m_raycast_mutex);
+        for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
+            std::map<vera::Model*, RaycastTarget>::iterator target = m_raycast_targets.find(it->second);
+            if (target != m_raycast_targets.end() && target->second.vertices == it->second->mesh.getVerticesTotal())
+                targets.push_back( std::make_pair(it->second, target->second) );
+        }
     }
 
-    TRACK_BEGIN("render:scene:floor")
-    renderFloor(_uniforms );
-    TRACK_END("render:scene:floor")
+    float t = 1.0f;
+    vera::Model* closest = nullptr;
+    glm::vec3 normal;
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (targets[i].second.ready.valid())
+            targets[i].second.ready.wait();
+
+        // The ray goes to the model space instead of the BVH to the world
+        glm::mat4 inverse = glm::inverse( targets[i].first->getTransformMatrix() );
+        glm::vec3 o = glm::vec3( inverse * glm::vec4(origin, 1.0f) );
+        glm::vec3 d = glm::vec3( inverse * glm::vec4(direction, 0.0f) );
+        if (targets[i].second.bvh->intersect(o, d, t, normal))
+            closest = targets[i].first;
+    }
 
-    vera::cullingMode(m_culling);
+    if (closest == nullptr)
+        return false;
 
-    for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
-        TRACK_BEGIN("render:scene:" + it->second->getName() )
+    glm::mat4 world = m_origin.getTransformMatrix() * closest->getTransformMatrix();
+    _hit.model = closest->getName();
+    _hit.position = glm::vec3( m_origin.getTransformMatrix() * glm::vec4(origin + direction * t, 1.0f) );
+    _hit.normal = glm::normalize( glm::transpose(glm::inverse(glm::mat3(world))) * normal );
+    _hit.distance = glm::length(_hit.position - camera->getPosition());
+    _hit.microseconds = std::chrono::duration<float, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+    return true;
+}
 
-        // bind the shader
-        it->second->getShader()->use();
+void SceneRender::updateTextureArrays(Uniforms& _uniforms) {
+    if (!textureArrays && !m_texture_arrays_active)
+        return;
 
-        // Update Uniforms and textures variables to the shader
-        _uniforms.feedTo( it->second->getShader(), true, true );
+    bool repacked = false;
+    if (textureArrays) {
+        repacked = m_texture_arrays.pack(_uniforms.textures, _uniforms.streams) || !m_texture_arrays_active;
+        m_texture_arrays_active = !m_texture_arrays.empty();
+    }
+    else {
+        m_texture_arrays.clear();
+        m_texture_arrays_active = false;
+        repacked = true;
+    }
 
-        // Pass special uniforms
-        it->second->getShader()->setUniform( "u_modelViewProjectionMatrix", vera::getProjectionViewWorldMatrix() * it->second->getTransformMatrix() );
-        it->second->getShader()->setUniform( "u_modelMatrix", m_origin.getTransformMatrix() * it->second->getTransformMatrix() );
-        it->second->getShader()->setUniform( "u_model", m_origin.getPosition() + m_floor.getPosition() );
+    if (!repacked)
+        return;
 
-        for (size_t i = 0; i < buffersFbo.size(); i++)
-            it->second->getShader()->setUniformTexture("u_sceneBuffer" + vera::toString(i), buffersFbo[i], it->second->getShader()->textureIndex++);
+    // Layers and arrays move when textures come and go, so the defines of the models follow them
+    for (size_t i = 0; i < m_texture_arrays_defines.size(); i++) {
+        _uniforms.delDefine(m_texture_arrays_defines[i]);
+        m_floor.delDefine(m_texture_arrays_defines[i]);
+    }
+    m_texture_arrays_defines.clear();
+
+    if (!m_texture_arrays_active)
+        return;
+
+    std::map<std::string, std::string> defines = m_texture_arrays.getDefines();
+    for (std::map<std::string, std::string>::iterator it = defines.begin(); it != defines.end(); ++it) {
+        _uniforms.addDefine(it->first, it->second);
+        m_floor.addDefine(it->first, it->second);
+        m_texture_arrays_defines.push_back(it->first);
+    }
+}
+
+void SceneRender::feedTextures(Uniforms& _uniforms, vera::Shader* _shader, bool _lights, bool _buffers) {
+    _uniforms.feedTo( _shader, _lights, _buffers, !m_texture_arrays_active );
+    if (m_texture_arrays_active)
+        m_texture_arrays.feedTo( _shader, _uniforms.textures );
+}
+
+void SceneRender::buildCompact(Uniforms& _uniforms) {
+    for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
+        vera::BoundingBox bbox = it->second->getBoundingBox();
+        MeshVbo* vbo = new MeshVbo(it->second->mesh, true, &bbox);
+        m_compact[it->second] = vbo;
+
+        // For vertex shaders that work with a_position in model space:
+        //      a_position.xyz * MODEL_VERTEX_COMPACT_SCALE + MODEL_VERTEX_COMPACT_OFFSET
+        // u_modelMatrix and u_modelViewProjectionMatrix already include it
+        const glm::mat4& decode = vbo->getDecodeMatrix();
+        it->second->addDefine("MODEL_VERTEX_COMPACT");
+        it->second->addDefine("MODEL_VERTEX_COMPACT_SCALE", vera::toString(decode[0][0], 6));
+        it->second->addDefine("MODEL_VERTEX_COMPACT_OFFSET", "vec3(" + vera::toString(decode[3][0], 6) + "," + vera::toString(decode[3][1], 6) + "," + vera::toString(decode[3][2], 6) + ")");
+    }
+    m_compact_active = true;
+}
+
+void SceneRender::clearCompact() {
+    for (std::map<vera::Model*, MeshVbo*>::iterator it = m_compact.begin(); it != m_compact.end(); ++it)
+        delete it->second;
+    m_compact.clear();
+    m_compact_active = false;
+}
+
+bool SceneRender::updateCompact(Uniforms& _uniforms) {
+    if (compactVertices == m_compact_active || _uniforms.models.size() == 0)
+        return false;
+
+    if (compactVertices)
+        buildCompact(_uniforms);
+    else {
+        clearCompact();
+        for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
+            it->second->delDefine("MODEL_VERTEX_COMPACT");
+            it->second->delDefine("MODEL_VERTEX_COMPACT_SCALE");
+            it->second->delDefine("MODEL_VERTEX_COMPACT_OFFSET");
+        }
+    }
+
+    // Instances and levels of detail follow the same layout
+    for (size_t i = 0; i < m_instances_groups.size(); i++) {
+        vera::BoundingBox bbox = m_instances_groups[i]->leader->getBoundingBox();
+        delete m_instances_groups[i]->vbo;
+        m_instances_groups[i]->vbo = new MeshVbo(m_instances_groups[i]->leader->mesh, m_compact_active, &bbox);
+    }
+
+    if (m_lods.size() > 0)
+        buildLods(_uniforms);
+
+    invalidateShadows();
+    flagChange();
+    return true;
+}
+
+// Defines a model carries on its own program, from its geometry, material and the ones added to it
+// (Model.addDefine), leaving out its name unless _named
+static std::string getModelDefines(vera::Model* _model, bool _named) {
+    std::stringstream source(_model->getShader()->getDefineSource());
+    std::string line, defines;
+    while (std::getline(source, line))
+        if (_named || line.find("MODEL_NAME_") == std::string::npos)
+            defines += line + "\n";
+    return defines;
+}
+
+// Every DevLook program shares the user fragment shader, told apart by its _prefix<index> define.
+// Programs are kept between reloads and only compiled again when their source or placement change
+static void setDevLookShaders(DevLookVariants& _variants, const std::string& _prefix, const vera::Mesh& _mesh,
+                                const std::string& _fragmentShader, const std::string& _vertexShader, float _offset, float _step) {
+    uint64_t source = hashString(_vertexShader, hashString(_fragmentShader));
+
+    for (size_t i = 0; i < _variants.size(); i++) {
+        float offset = _offset - i * _step;
+        uint64_t hash = hashString(vera::toString(offset), source);
+
+        if (_variants[i] == nullptr) {
+            _variants[i] = std::unique_ptr<DevLookVariant>(new DevLookVariant());
+            _variants[i]->hash = 0;
+        }
+        else if (_variants[i]->hash == hash && _variants[i]->shader.isLoaded())
+            continue;
+
+        // The attributes a vera::Model would declare for this mesh
+        vera::Shader& shader = _variants[i]->shader;
+        if (_mesh.haveColors())
+            shader.addDefine("MODEL_VERTEX_COLOR", "v_color");
+        if (_mesh.haveNormals())
+            shader.addDefine("MODEL_VERTEX_NORMAL", "v_normal");
+        if (_mesh.haveTexCoords())
+            shader.addDefine("MODEL_VERTEX_TEXCOORD", "v_texcoord");
+        if (_mesh.haveTangents())
+            shader.addDefine("MODEL_VERTEX_TANGENT", "v_tangent");
+        shader.addDefine(_prefix + vera::toString(i));
+        shader.addDefine("DEVLOOK_Y_OFFSET", offset);
+        shader.setSource(_fragmentShader, _vertexShader);
+        _variants[i]->hash = hash;
+    }
+}
+
+void SceneRender::setShaders(Uniforms& _uniforms, const std::string& _fragmentShader, const std::string& _vertexShader) {
+    // Background
+    m_background = checkBackground(_fragmentShader);
+    if (m_background) {
+        // Specific defines for this buffer
+        m_background_shader.addDefine("BACKGROUND");
+        m_background_shader.setSource(_fragmentShader, vera::getDefaultSrc(vera::VERT_BILLBOARD));
+        m_background_shader.addDefine("GLSLVIEWER", vera::toString(GLSLVIEWER_VERSION_MAJOR) + vera::toString(GLSLVIEWER_VERSION_MINOR) + vera::toString(GLSLVIEWER_VERSION_PATCH) );
+    }
+
+    // The ambient occlusion works from the position and normal buffers
+    bool ssao = findId(_fragmentShader, "u_sceneSsao;");
+    bool position_buffer = findId(_fragmentShader, "u_scenePosition;") || ssao;
+    bool normal_buffer = findId(_fragmentShader, "u_sceneNormal;") || ssao;
+
+    // Both buffers can be written at once using multiple render targets. 
+    // The separate passes are still compiled as a fallback
+    m_gbuffer_shaders = position_buffer && normal_buffer && GBuffer::supported();
+    // Cascades (u_lightCascadeShadowMap<N>) are drawn on the same shadow pass as the light shadow map
+    m_shadows = findId(_fragmentShader, "u_lightShadowMap;") || findId(_fragmentShader, "u_lightCascadeShadowMap");
+    // Vertex animations move the casters every frame without touching their transforms
+    m_shadows_animated = findId(_vertexShader, "u_time;") || findId(_vertexShader, "u_delta;") || findId(_vertexShader, "u_frame;");
+    invalidateShadows();
+    m_buffers_total = std::max( countSceneBuffers(_vertexShader), 
+                                countSceneBuffers(_fragmentShader) );
+
+    // The programs about to be compiled may get the ids of the previous ones
+    MeshVbo::programsChanged();
+    m_texture_arrays.programsChanged();
+
+    // Turning the depth pre-pass on later compiles its programs from these
+    m_depth_vertex = _vertexShader;
+    m_depth_discard = findId(_fragmentShader, "discard");
+    m_depth_shaders = m_shadows || (depthPrepass && !m_depth_discard);
+
+    // Repeated meshes are drawn instanced when the vertex shader can take a per instance transform.
+    // u_model is a uniform, so shaders reading it would see the position of the first model on all of them
+    updateInstances(_uniforms);
+    std::string instancedVertexShader = "";
+    if (m_instances_groups.size() > 0 && !findId(_fragmentShader, "u_model;") && !findId(_vertexShader, "u_model;"))
+        instancedVertexShader = getInstancedVertexSource(_vertexShader);
+    if (instancedVertexShader.empty())
+        clearInstances();
+    m_depth_instanced_vertex = instancedVertexShader;
+
+    // Models that would compile the same program (same sources and defines) share the one of the first 
+    // of them, so the draw lists sort them into a single run with one use() and one upload of the textures
+    m_programs.clear();
+    std::map<uint64_t, vera::Model*> programs;
+    bool named = _fragmentShader.find("MODEL_NAME_") != std::string::npos || _vertexShader.find("MODEL_NAME_") != std::string::npos;
+
+    for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
+        std::string vertexShader = _vertexShader;
+
+        std::map<vera::Model*, InstanceGroup*>::iterator git = m_instances.find(it->second);
+        if (git != m_instances.end()) {
+            git->second->active = true;
+
+            // Only the first model of the group is compiled, it draws all the others
+            if (git->second->leader != it->second)
+                continue;
+
+            vertexShader = instancedVertexShader;
+        }
+
+        // Besides the sources, the defines of a model come from its attributes, primitive, material and
+        // the ones set on it alone. Its name only matters when the shaders test for it and compact
+        // layouts carry their own decoding
+        const vera::Mesh& mesh = it->second->mesh;
+        std::string defines =   vera::toString((int)mesh.getDrawMode()) +
+                                (mesh.haveColors() ? "c" : "") + (mesh.haveNormals() ? "n" : "") +
+                                (mesh.haveTexCoords() ? "t" : "") + (mesh.haveTangents() ? "g" : "") +
+                                ":" + mesh.getMaterial().name + ":" + getModelDefines(it->second, named);
+        if (named || m_compact_active)
+            defines += ":" + it->second->getName();
+
+        uint64_t signature = hashString(defines, hashString(vertexShader, hashString(_fragmentShader)));
+        std::map<uint64_t, vera::Model*>::iterator pit = programs.find(signature);
+        if (pit != programs.end()) {
+            m_programs[it->second] = pit->second;
+            continue;
+        }
+        programs[signature] = it->second;
+
+        it->second->setShader( _fragmentShader, vertexShader);
+
+        // The depth pre-pass draws with the shadow programs when there are, or with its own ones
+        if (m_shadows)
+            it->second->setBufferShader("shadow", vera::getDefaultSrc(vera::FRAG_ERROR), vertexShader);
+        else if (depthPrepass && !m_depth_discard)
+            it->second->setBufferShader("depth", vera::getDefaultSrc(vera::FRAG_ERROR), vertexShader);
+
+        if (position_buffer)
+            it->second->setBufferShader("position", vera::getDefaultSrc(vera::FRAG_POSITION), vertexShader);
+        
+        if (normal_buffer)
+            it->second->setBufferShader("normal", vera::getDefaultSrc(vera::FRAG_NORMAL), vertexShader);
+
+        if (m_gbuffer_shaders) {
+            it->second->setBufferShader("gbuffer", GBuffer::getFragmentSource(vertexShader), vertexShader);
+            m_gbuffer_shaders = it->second->getBufferShader("gbuffer")->isLoaded();
+        }
+
+        for (size_t i = 0; i < m_buffers_total; i++) {
+            std::string bufferName = "u_sceneBuffer" + vera::toString(i);
+            it->second->setBufferShader(bufferName, _fragmentShader, vertexShader);
+            it->second->getBufferShader(bufferName)->delDefine("FLOOR");
+            it->second->getBufferShader(bufferName)->addDefine("SCENE_BUFFER_" + vera::toString(i));
+        }
+    }
+
+    // Floor
+    bool thereIsFloorDefine = checkFloor(_fragmentShader) || checkFloor(_vertexShader);
+    if (thereIsFloorDefine) {
+        if (m_floor.getVbo() == nullptr) {
+            m_floor.setName("FLOOR");
+            m_floor.setGeom( vera::planeMesh(1.0f, 1.0f, 2, 2) );
+        }
+
+        m_floor.setShader(_fragmentShader, _vertexShader);
+
+        if (m_floor_subd == -1)
+            m_floor_subd_target = 0;
+
+        if (m_shadows) 
+            m_floor.setBufferShader("shadow", vera::getDefaultSrc(vera::FRAG_ERROR), _vertexShader);
+
+        if (position_buffer)
+            m_floor.setBufferShader("position", vera::getDefaultSrc(vera::FRAG_POSITION), _vertexShader);
+        
+        if (normal_buffer)
+            m_floor.setBufferShader("normal", vera::getDefaultSrc(vera::FRAG_NORMAL), _vertexShader);
+
+        if (m_gbuffer_shaders) {
+            m_floor.setBufferShader("gbuffer", GBuffer::getFragmentSource(_vertexShader), _vertexShader);
+            m_gbuffer_shaders = m_floor.getBufferShader("gbuffer")->isLoaded();
+        }
+
+        for (size_t i = 0; i < m_buffers_total; i++) {
+            std::string bufferName = "u_sceneBuffer" + vera::toString(i);
+            m_floor.setBufferShader(bufferName, _fragmentShader, _vertexShader);
+            m_floor.getBufferShader(bufferName)->addDefine("FLOOR");
+            m_floor.getBufferShader(bufferName)->addDefine("SCENE_BUFFER_" + vera::toString(i));
+        }
+    }
+
+    // DevLook
+    size_t devLookSpheres = countDevLookSpheres(_fragmentShader);
+    m_devlook_spheres.resize(devLookSpheres);
+    if (devLookSpheres > 0) {
+        vera::Mesh sphere = vera::sphereMesh(24);
+        if (m_devlook_sphere_vbo == nullptr)
+            m_devlook_sphere_vbo = std::unique_ptr<vera::Vbo>(new vera::Vbo(sphere));
+        setDevLookShaders(m_devlook_spheres, "DEVLOOK_SPHERE_", sphere, _fragmentShader, vera::getDefaultSrc(vera::VERT_DEVLOOK_SPHERE), 0.8f, 0.35f);
+    }
+
+    size_t devLookBillboards = countDevLookBillboards(_fragmentShader);
+    m_devlook_billboards.resize(devLookBillboards);
+    if (devLookBillboards > 0) {
+        vera::Mesh billboard = vera::planeMesh(1.0f, 1.0f, 2, 2);
+        if (m_devlook_billboard_vbo == nullptr)
+            m_devlook_billboard_vbo = std::unique_ptr<vera::Vbo>(new vera::Vbo(billboard));
+        setDevLookShaders(m_devlook_billboards, "DEVLOOK_BILLBOARD_", billboard, _fragmentShader, vera::getDefaultSrc(vera::VERT_DEVLOOK_BILLBOARD), 0.8f - devLookSpheres * 0.35f, 0.325f);
+    }
+}
+
+void SceneRender::updateBuffers(Uniforms& _uniforms, int _width, int _height) {
+    vera::FboType type = _uniforms.functions["u_sceneDepth"].present ? vera::COLOR_DEPTH_TEXTURES : vera::COLOR_TEXTURE_DEPTH_BUFFER;
+
+    if (!renderFbo.isAllocated() ||
+        renderFbo.getType() != type || 
+        renderFbo.getWidth() != _width || renderFbo.getHeight() != _height )
+        renderFbo.allocate(_width, _height, type);
+
+    if (_uniforms.functions["u_sceneNormal"].present && 
+        (   !normalFbo.isAllocated() || 
+            normalFbo.getWidth() != _width || normalFbo.getHeight() != _height ) )
+        normalFbo.allocate(_width, _height, vera::GBUFFER_TEXTURE);
+
+    
+    if (_uniforms.functions["u_scenePosition"].present && 
+        (   !positionFbo.isAllocated() || 
+            positionFbo.getWidth() != _width || positionFbo.getHeight() != _height ) )
+        positionFbo.allocate(_width, _height, vera::GBUFFER_TEXTURE);
+
+    for (size_t i = 0; i < buffersFbo.size(); i++)
+        if ( !buffersFbo[i]->isAllocated() ||
+            buffersFbo[i]->getWidth() != _width || buffersFbo[i]->getHeight() != _height)
+            buffersFbo[i]->allocate(_width, _height, vera::GBUFFER_TEXTURE);
+}
+
+void SceneRender::printBuffers() {
+    for (size_t i = 0; i < buffersFbo.size(); i++)
+        std::cout << "uniform sampler2D u_sceneBuffer" << i << ";" << std::endl;
+}
+
+void SceneRender::cullModels(Uniforms& _uniforms, const glm::mat4& _viewProjection, std::vector<uint8_t>& _visible) {
+    // Models can be moved at any time (commands, python, OSC) so bounds are refreshed on each pass
+    m_bounds.clear();
+    for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it)
+        m_bounds.add( it->second->getBoundingBox(), it->second->getTransformMatrix() );
+
+    if (!frustumCulling) {
+        _visible.assign(_uniforms.models.size(), 1);
+        return;
+    }
+
+    Frustum frustum(_viewProjection);
+    frustum.cull(m_bounds, _visible);
+}
+
+void SceneRender::buildDrawList(Uniforms& _uniforms, const std::string& _buffer, const glm::mat4& _viewProjection, const glm::vec3& _eye, DrawList& _list, size_t _lodBias) {
+    cullModels(_uniforms, _viewProjection, m_visible);
+
+    // bounds are in model space, bring the eye there too
+    glm::vec3 eye = glm::vec3( glm::inverse(m_origin.getTransformMatrix()) * glm::vec4(_eye, 1.0f) );
+
+    for (size_t i = 0; i < m_instances_groups.size(); i++) {
+        m_instances_groups[i]->transforms.clear();
+        m_instances_groups[i]->depth = std::numeric_limits<float>::max();
+    }
+
+    _list.clear();
+    size_t index = 0;
+    for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it, ++index) {
+        if (!m_visible[index])
+            continue;
 
-        it->second->render();
+        glm::vec3 center = glm::vec3(m_bounds.cx[index], m_bounds.cy[index], m_bounds.cz[index]);
+        float depth = glm::dot(center - eye, center - eye);
 
-        TRACK_END("render:scene:" + it->second->getName() )
+        // Instances only contribute their transform to the group draw
+        std::map<vera::Model*, InstanceGroup*>::iterator git = m_instances.find(it->second);
+        if (git != m_instances.end() && git->second->active) {
+            git->second->transforms.push_back( it->second->getTransformMatrix() );
+            git->second->depth = std::min(git->second->depth, depth);
+            continue;
+        }
+
+        DrawItem item;
+        item.model = it->second;
+        item.shader = getProgram(it->second, _buffer);
+        if (item.shader == nullptr)
+            continue;
+
+        item.group = nullptr;
+        item.vbo = (levelOfDetail && !m_lods.empty())? selectLod(it->second, index, _viewProjection, _lodBias) : nullptr;
+        if (item.vbo == nullptr && m_compact_active) {
+            std::map<vera::Model*, MeshVbo*>::iterator cit = m_compact.find(it->second);
+            if (cit != m_compact.end())
+                item.vbo = cit->second;
+        }
+        item.depth = depth;
+        _list.push_back(item);
+    }
+
+    for (size_t i = 0; i < m_instances_groups.size(); i++) {
+        InstanceGroup* group = m_instances_groups[i];
+        if (group->transforms.size() == 0)
+            continue;
+
+        DrawItem item;
+        item.model = group->leader;
+        item.shader = getProgram(group->leader, _buffer);
+        if (item.shader == nullptr)
+            continue;
+
+        item.group = group;
+        item.vbo = nullptr;
+        item.depth = group->depth;
+        _list.push_back(item);
+    }
+
+    if (m_blend == vera::BLEND_NONE || !_buffer.empty()) {
+        // Opaque: group by program (materials are part of its defines), then front-to-back for early-Z
+        std::stable_sort(_list.begin(), _list.end(), [](const DrawItem& _a, const DrawItem& _b) {
+            if (_a.shader != _b.shader)
+                return _a.shader < _b.shader;
+            return _a.depth < _b.depth;
+        });
+    }
+    else {
+        // Blended: back-to-front so transparencies composite correctly
+        std::stable_sort(_list.begin(), _list.end(), [](const DrawItem& _a, const DrawItem& _b) {
+            return _a.depth > _b.depth;
+        });
+    }
+}
+
+vera::Shader* SceneRender::getProgram(vera::Model* _model, const std::string& _buffer) {
+    std::map<vera::Model*, vera::Model*>::iterator it = m_programs.find(_model);
+    if (it != m_programs.end())
+        _model = it->second;
+    return _buffer.empty() ? _model->getShader() : _model->getBufferShader(_buffer);
+}
+
+MeshVbo* SceneRender::selectLod(vera::Model* _model, size_t _index, const glm::mat4& _viewProjection, size_t _bias) const {
+    std::map<vera::Model*, ModelLod>::const_iterator it = m_lods.find(_model);
+    if (it == m_lods.end())
+        return nullptr;
+
+    // Projected radius in pixels of the bounding sphere
+    glm::vec3 center = glm::vec3(m_bounds.cx[_index], m_bounds.cy[_index], m_bounds.cz[_index]);
+    float radius = glm::length(glm::vec3(m_bounds.ex[_index], m_bounds.ey[_index], m_bounds.ez[_index]));
+    float w = (_viewProjection * glm::vec4(center, 1.0f)).w;
+    size_t level = 0;
+
+    // Only when the eye is outside of the sphere
+    if (w > radius) {
+        float scale = glm::length(glm::vec3(_viewProjection[0][1], _viewProjection[1][1], _viewProjection[2][1]));
+        float pixels = radius * scale / w * 0.5f * vera::getWindowHeight();
+
+        // About one triangle every two pixels of the projected disc
+        float budget = 3.1415926f * pixels * pixels * 0.5f;
+        while (level + 1 < it->second.triangles.size() && it->second.triangles[level] > budget)
+            level++;
+    }
+
+    level = std::min(level + _bias, it->second.levels.size() - 1);
+    return it->second.levels[level];
+}
+
+void SceneRender::renderDrawItem(const DrawItem& _item, vera::Shader* _shader, const glm::mat4& _viewProjection) {
+    if (_item.group) {
+        // Per instance transforms go through a_instanceMatrix, the uniforms only hold the shared part
+        _shader->setUniform( "u_modelViewProjectionMatrix", _viewProjection );
+        _shader->setUniform( "u_modelMatrix", m_origin.getTransformMatrix() );
+        _item.group->vbo->setInstances( _item.group->transforms );
+        _item.group->vbo->render( _shader );
+    }
+    else {
+        // Compact positions are brought back to model space together with the transform
+        glm::mat4 model = _item.model->getTransformMatrix();
+        if (_item.vbo)
+            model = model * _item.vbo->getDecodeMatrix();
+
+        _shader->setUniform( "u_modelViewProjectionMatrix", _viewProjection * model );
+        _shader->setUniform( "u_modelMatrix", m_origin.getTransformMatrix() * model );
+        if (_item.vbo)
+            _item.vbo->render( _shader );
+        else
+            _item.model->render( _shader );
+    }
+}
+
+void SceneRender::render(Uniforms& _uniforms) {
+    // Render Background
+    renderBackground(_uniforms);
+
+    // Begining of DEPTH for 3D 
+    if (m_depth_test)
+        glEnable(GL_DEPTH_TEST);
+
+    vera::blendMode(m_blend);
+
+    if (_uniforms.activeCamera->bChange || m_origin.bChange) {
+        vera::setCamera( _uniforms.activeCamera );
+        vera::applyMatrix( m_origin.getTransformMatrix() );
+    }
+
+    TRACK_BEGIN("render:scene:floor")
+    renderFloor(_uniforms );
+    TRACK_END("render:scene:floor")
+
+    vera::cullingMode(m_culling);
+
+    TRACK_BEGIN("render:scene:culling")
+    buildDrawList(_uniforms, "", vera::getProjectionViewWorldMatrix(), _uniforms.activeCamera->getPosition(), m_drawList);
+    TRACK_END("render:scene:culling")
+
+    // Only the nearest surface of each pixel pass the depth test, and nothing is written twice.
+    // That holds for opaque scenes only: translucent models would hide what's behind them and
+    // discarded fragments would leave holes, so it's skipped for blending or discarding materials.
+    // GL_LEQUAL instead of GL_EQUAL tolerates separately compiled programs rounding positions apart
+    bool prepass = depthPrepass && m_depth_test && m_blend == vera::BLEND_NONE && !m_depth_discard && renderDepthPrepass(_uniforms, m_drawList);
+    if (prepass) {
+        glDepthFunc(GL_LEQUAL);
+        glDepthMask(GL_FALSE);
+    }
+
+    vera::Shader* program = nullptr;
+    for (size_t d = 0; d < m_drawList.size(); d++) {
+        vera::Model* model = m_drawList[d].model;
+        TRACK_BEGIN("render:scene:" + model->getName() )
+
+        // Shared uniforms and textures are feed once per program run
+        if (m_drawList[d].shader != program) {
+            program = m_drawList[d].shader;
+
+            // bind the shader
+            program->use();
+
+            // Update Uniforms and textures variables to the shader
+            feedTextures( _uniforms, program, true, true );
+
+            for (size_t i = 0; i < buffersFbo.size(); i++)
+                program->setUniformTexture("u_sceneBuffer" + vera::toString(i), buffersFbo[i], program->textureIndex++);
+        }
+
+        // Pass special uniforms
+        program->setUniform( "u_model", m_origin.getPosition() + m_floor.getPosition() );
+        renderDrawItem( m_drawList[d], program, vera::getProjectionViewWorldMatrix() );
+
+        TRACK_END("render:scene:" + model->getName() )
+    }
+
+    if (prepass) {
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
     }
 
     TRACK_BEGIN("render:scene:devlook")
@@ -666,6 +1593,145 @@ void SceneRender::render(Uniforms& _uniforms) {
         glDisable(GL_CULL_FACE);
 }
 
+void SceneRender::loadDepthShaders(Uniforms& _uniforms) {
+    // Only the models that own their programs, with the same vertex shader they were compiled with
+    for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
+        if (m_programs.find(it->second) != m_programs.end())
+            continue;
+
+        std::string vertexShader = m_depth_vertex;
+        std::map<vera::Model*, InstanceGroup*>::iterator git = m_instances.find(it->second);
+        if (git != m_instances.end()) {
+            if (git->second->leader != it->second)
+                continue;
+            vertexShader = m_depth_instanced_vertex;
+        }
+
+        it->second->setBufferShader("depth", vera::getDefaultSrc(vera::FRAG_ERROR), vertexShader);
+    }
+    m_depth_shaders = true;
+}
+
+bool SceneRender::renderDepthPrepass(Uniforms& _uniforms, const DrawList& _list) {
+    // Same vertex shader as the material (so positions match the main pass) with a trivial fragment
+    std::string buffer = m_shadows ? "shadow" : "depth";
+    if (!m_depth_shaders)
+        loadDepthShaders(_uniforms);
+
+    m_depthList.clear();
+    for (size_t d = 0; d < _list.size(); d++) {
+        DrawItem item = _list[d];
+        item.shader = getProgram(item.model, buffer);
+
+        // A model missing from the depth would disappear on the main pass
+        if (item.shader == nullptr)
+            return false;
+
+        m_depthList.push_back(item);
+    }
+
+    if (m_depthList.size() == 0)
+        return false;
+
+    TRACK_BEGIN("render:scene:depth_prepass")
+
+    // Front-to-back so the pre-pass itself benefits from early-Z
+    std::stable_sort(m_depthList.begin(), m_depthList.end(), [](const DrawItem& _a, const DrawItem& _b) {
+        return _a.depth < _b.depth;
+    });
+
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+    vera::Shader* depthShader = nullptr;
+    for (size_t d = 0; d < m_depthList.size(); d++) {
+        if (m_depthList[d].shader != depthShader) {
+            depthShader = m_depthList[d].shader;
+            depthShader->use();
+            _uniforms.feedTo( depthShader, false );
+        }
+
+        depthShader->setUniform( "u_model", m_origin.getPosition() + m_floor.getPosition() );
+        renderDrawItem( m_depthList[d], depthShader, vera::getProjectionViewWorldMatrix() );
+    }
+
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+    TRACK_END("render:scene:depth_prepass")
+    return true;
+}
+
+bool SceneRender::renderGBuffer(Uniforms& _uniforms) {
+    if (!singlePassGBuffer || !m_gbuffer_shaders)
+        return false;
+
+    std::vector<const vera::Fbo*> targets;
+    targets.push_back(&normalFbo);
+    targets.push_back(&positionFbo);
+    if (!m_gbuffer.attach(targets))
+        return false;
+
+    m_gbuffer.bind();
+
+    // Begining of DEPTH for 3D 
+    if (m_depth_test)
+        glEnable(GL_DEPTH_TEST);
+
+    if (_uniforms.activeCamera->bChange || m_origin.bChange) {
+        vera::setCamera( _uniforms.activeCamera );
+        vera::applyMatrix( m_origin.getTransformMatrix() );
+    }
+
+    vera::Shader* gbufferShader = nullptr;
+    if (m_floor_subd_target >= 0) {
+        gbufferShader = m_floor.getBufferShader("gbuffer");
+        if (gbufferShader != nullptr) {
+            TRACK_BEGIN("render:sceneGBuffer:floor")
+            gbufferShader->use();
+            _uniforms.feedTo( gbufferShader, false );
+            gbufferShader->setUniform("u_modelViewProjectionMatrix", vera::getProjectionViewWorldMatrix() * m_floor.getTransformMatrix());
+            gbufferShader->setUniform("u_model", m_origin.getPosition() + m_floor.getPosition() );
+            gbufferShader->setUniform("u_modelMatrix", m_origin.getTransformMatrix() * m_floor.getTransformMatrix() );
+            m_floor.render(gbufferShader);
+            TRACK_END("render:sceneGBuffer:floor")
+        } 
+    }
+
+    vera::cullingMode(m_culling);
+
+    buildDrawList(_uniforms, "gbuffer", vera::getProjectionViewWorldMatrix(), _uniforms.activeCamera->getPosition(), m_drawList);
+
+    gbufferShader = nullptr;
+    for (size_t d = 0; d < m_drawList.size(); d++) {
+        vera::Model* model = m_drawList[d].model;
+        TRACK_BEGIN("render:sceneGBuffer:" + model->getName() )
+
+        if (m_drawList[d].shader != gbufferShader) {
+            gbufferShader = m_drawList[d].shader;
+
+            // bind the shader
+            gbufferShader->use();
+
+            // Update Uniforms and textures variables to the shader
+            _uniforms.feedTo( gbufferShader, false );
+        }
+
+        // Pass special uniforms
+        gbufferShader->setUniform( "u_model", m_origin.getPosition() + model->getPosition() );
+        renderDrawItem( m_drawList[d], gbufferShader, vera::getProjectionViewWorldMatrix() );
+
+        TRACK_END("render:sceneGBuffer:" + model->getName() )
+    }
+
+    if (m_depth_test)
+        glDisable(GL_DEPTH_TEST);
+
+    if (m_culling != 0)
+        glDisable(GL_CULL_FACE);
+
+    m_gbuffer.unbind();
+    return true;
+}
+
 void SceneRender::renderNormalBuffer(Uniforms& _uniforms) {
     if (!normalFbo.isAllocated())
         return;
@@ -698,25 +1764,28 @@ void SceneRender::renderNormalBuffer(Uniforms& _uniforms) {
 
     vera::cullingMode(m_culling);
 
-    for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
-        normalShader = it->second->getBufferShader("normal");
-        if (normalShader != nullptr) {
-            TRACK_BEGIN("render:sceneNormal:" + it->second->getName() )
+    buildDrawList(_uniforms, "normal", vera::getProjectionViewWorldMatrix(), _uniforms.activeCamera->getPosition(), m_drawList);
+
+    normalShader = nullptr;
+    for (size_t d = 0; d < m_drawList.size(); d++) {
+        vera::Model* model = m_drawList[d].model;
+        TRACK_BEGIN("render:sceneNormal:" + model->getName() )
+
+        if (m_drawList[d].shader != normalShader) {
+            normalShader = m_drawList[d].shader;
 
             // bind the shader
             normalShader->use();
 
             // Update Uniforms and textures variables to the shader
             _uniforms.feedTo( normalShader, false );
+        }
 
-            // Pass special uniforms
-            normalShader->setUniform( "u_modelViewProjectionMatrix", vera::getProjectionViewWorldMatrix() * it->second->getTransformMatrix());
-            normalShader->setUniform( "u_model", m_origin.getPosition() + it->second->getPosition() );
-            normalShader->setUniform( "u_modelMatrix", m_origin.getTransformMatrix() * it->second->getTransformMatrix() );
-            it->second->render(normalShader);
+        // Pass special uniforms
+        normalShader->setUniform( "u_model", m_origin.getPosition() + model->getPosition() );
+        renderDrawItem( m_drawList[d], normalShader, vera::getProjectionViewWorldMatrix() );
 
-            TRACK_END("render:sceneNormal:" + it->second->getName() )
-        }
+        TRACK_END("render:sceneNormal:" + model->getName() )
     }
 
     if (m_depth_test)
@@ -728,6 +1797,15 @@ void SceneRender::renderNormalBuffer(Uniforms& _uniforms) {
     normalFbo.unbind();
 }
 
+void SceneRender::renderSsao(Uniforms& _uniforms) {
+    if (_uniforms.activeCamera == nullptr)
+        return;
+
+    TRACK_BEGIN("render:sceneSsao")
+    m_ssao.render(positionFbo, normalFbo, _uniforms.activeCamera->getViewMatrix(), _uniforms.activeCamera->getProjectionMatrix());
+    TRACK_END("render:sceneSsao")
+}
+
 void SceneRender::renderPositionBuffer(Uniforms& _uniforms) {
     if (!positionFbo.isAllocated())
         return;
@@ -760,25 +1838,28 @@ void SceneRender::renderPositionBuffer(Uniforms& _uniforms) {
 
     vera::cullingMode(m_culling);
 
-    for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
-        positionShader = it->second->getBufferShader("position");
-        if (positionShader != nullptr) {
-            TRACK_BEGIN("render:scenePosition:" + it->second->getName() )
+    buildDrawList(_uniforms, "position", vera::getProjectionViewWorldMatrix(), _uniforms.activeCamera->getPosition(), m_drawList);
+
+    positionShader = nullptr;
+    for (size_t d = 0; d < m_drawList.size(); d++) {
+        vera::Model* model = m_drawList[d].model;
+        TRACK_BEGIN("render:scenePosition:" + model->getName() )
+
+        if (m_drawList[d].shader != positionShader) {
+            positionShader = m_drawList[d].shader;
 
             // bind the shader
             positionShader->use();
 
             // Update Uniforms and textures variables to the shader
             _uniforms.feedTo( positionShader, false );
+        }
 
-            // Pass special uniforms
-            positionShader->setUniform( "u_modelViewProjectionMatrix", vera::getProjectionViewWorldMatrix() *  it->second->getTransformMatrix() );
-            positionShader->setUniform( "u_model", m_origin.getPosition() + it->second->getPosition() );
-            positionShader->setUniform( "u_modelMatrix", m_origin.getTransformMatrix() * it->second->getTransformMatrix() );
-            it->second->render(positionShader);
+        // Pass special uniforms
+        positionShader->setUniform( "u_model", m_origin.getPosition() + model->getPosition() );
+        renderDrawItem( m_drawList[d], positionShader, vera::getProjectionViewWorldMatrix() );
 
-            TRACK_END("render:scenePosition:" + it->second->getName() )
-        }
+        TRACK_END("render:scenePosition:" + model->getName() )
     }
 
     if (m_depth_test)
@@ -828,7 +1909,7 @@ void SceneRender::renderBuffers(Uniforms& _uniforms) {
             if (bufferShader != nullptr) {
                     TRACK_BEGIN("render:"+bufferName+":floor")
                     bufferShader->use();
-                    _uniforms.feedTo( bufferShader, false );
+                    feedTextures( _uniforms, bufferShader, false, true );
                     bufferShader->setUniform( "u_modelViewProjectionMatrix", vera::getProjectionViewWorldMatrix() * m_floor.getTransformMatrix() );
                     bufferShader->setUniform( "u_model", m_origin.getPosition() + m_floor.getPosition() );
                     bufferShader->setUniform( "u_modelMatrix", m_origin.getTransformMatrix() * m_floor.getTransformMatrix() );
@@ -839,26 +1920,28 @@ void SceneRender::renderBuffers(Uniforms& _uniforms) {
 
         vera::cullingMode(m_culling);
 
-        for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
-            bufferShader = it->second->getBufferShader(bufferName);
+        buildDrawList(_uniforms, bufferName, vera::getProjectionViewWorldMatrix(), _uniforms.activeCamera->getPosition(), m_drawList);
 
-            if (bufferShader != nullptr) {
-                TRACK_BEGIN("render:" + bufferName + ":" + it->second->getName())
+        bufferShader = nullptr;
+        for (size_t d = 0; d < m_drawList.size(); d++) {
+            vera::Model* model = m_drawList[d].model;
+            TRACK_BEGIN("render:" + bufferName + ":" + model->getName())
+
+            if (m_drawList[d].shader != bufferShader) {
+                bufferShader = m_drawList[d].shader;
 
                 // bind the shader
                 bufferShader->use();
 
                 // Update Uniforms and textures variables to the shader
-                _uniforms.feedTo( bufferShader, false );
+                feedTextures( _uniforms, bufferShader, false, true );
+            }
 
-                // Pass special uniforms
-                bufferShader->setUniform( "u_modelViewProjectionMatrix", vera::getProjectionViewWorldMatrix() * it->second->getTransformMatrix() );
-                bufferShader->setUniform( "u_model", m_origin.getPosition() + it->second->getPosition() );
-                bufferShader->setUniform( "u_modelMatrix", m_origin.getTransformMatrix() * it->second->getTransformMatrix() );
-                it->second->render(bufferShader);
+            // Pass special uniforms
+            bufferShader->setUniform( "u_model", m_origin.getPosition() + model->getPosition() );
+            renderDrawItem( m_drawList[d], bufferShader, vera::getProjectionViewWorldMatrix() );
 
-                TRACK_END("render:" + bufferName + ":" + it->second->getName())
-            }
+            TRACK_END("render:" + bufferName + ":" + model->getName())
         }
 
         if (m_depth_test)
@@ -871,61 +1954,321 @@ void SceneRender::renderBuffers(Uniforms& _uniforms) {
     }
 }
 
+// Frames a caster needs to stay still before it joins the cached static layer
+#define SHADOW_STILL_FRAMES 30
+
+bool SceneRender::updateShadowCasters(Uniforms& _uniforms) {
+    bool allDynamic = m_shadows_animated && dynamicShadows;
+    bool staticChanged = false;
+    m_shadows_dynamic_total = 0;
+
+    for (vera::ModelsMap::iterator it = _uniforms.models.begin(); it != _uniforms.models.end(); ++it) {
+        glm::mat4 transform = it->second->getTransformMatrix();
+
+        std::map<vera::Model*, ShadowCaster>::iterator cit = m_shadows_casters.find(it->second);
+        if (cit == m_shadows_casters.end()) {
+            ShadowCaster caster = { transform, SHADOW_STILL_FRAMES, allDynamic };
+            m_shadows_casters[it->second] = caster;
+            staticChanged = true;
+            if (allDynamic)
+                m_shadows_dynamic_total++;
+            continue;
+        }
+
+        ShadowCaster& caster = cit->second;
+        if (transform != caster.transform) {
+            caster.transform = transform;
+            caster.stillFrames = 0;
+        }
+        else if (caster.stillFrames < SHADOW_STILL_FRAMES)
+            caster.stillFrames++;
+
+        // Moving in or out of the static layer means it needs to be drawn again
+        bool dynamic = allDynamic || caster.stillFrames < SHADOW_STILL_FRAMES;
+        if (dynamic != caster.dynamic) {
+            caster.dynamic = dynamic;
+            staticChanged = true;
+        }
+
+        if (dynamic)
+            m_shadows_dynamic_total++;
+    }
+
+    return staticChanged;
+}
+
+bool SceneRender::isDynamicCaster(const DrawItem& _item) const {
+    if (_item.group) {
+        for (size_t i = 0; i < _item.group->models.size(); i++) {
+            std::map<vera::Model*, ShadowCaster>::const_iterator cit = m_shadows_casters.find(_item.group->models[i]);
+            if (cit == m_shadows_casters.end() || cit->second.dynamic)
+                return true;
+        }
+        return false;
+    }
+
+    std::map<vera::Model*, ShadowCaster>::const_iterator cit = m_shadows_casters.find(_item.model);
+    return cit == m_shadows_casters.end() || cit->second.dynamic;
+}
+
+void SceneRender::invalidateShadows() {
+    for (std::map<vera::Light*, ShadowCache>::iterator it = m_shadows_caches.begin(); it != m_shadows_caches.end(); ++it)
+        it->second.valid = false;
+}
+
+// Depth FBOs can be copied with glBlitFramebuffer (GL 3.x and GLES 3.0)
+static bool supportsDepthCopy() {
+#if defined(PLATFORM_RPI)
+    return false;
+#else
+    return vera::getVersion() >= 130;
+#endif
+}
+
+static void copyDepth(const vera::Fbo* _src, const vera::Fbo* _dst) {
+#if !defined(PLATFORM_RPI)
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, _src->getId());
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _dst->getId());
+    glBlitFramebuffer(  0, 0, _src->getWidth(), _src->getHeight(), 
+                        0, 0, _dst->getWidth(), _dst->getHeight(), 
+                        GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+#endif
+}
+
+void SceneRender::renderShadowFloor(Uniforms& _uniforms, const glm::mat4& _viewProjection, const glm::mat4& _projection, const glm::mat4& _view) {
+    vera::Shader* shadowShader = m_floor.getBufferShader("shadow");
+    if (m_floor.getVbo() && shadowShader != nullptr) {
+        TRACK_BEGIN("render:scene:shadowmap:floor")
+        shadowShader->use();
+        _uniforms.feedTo( shadowShader, false );
+        shadowShader->setUniform( "u_modelViewProjectionMatrix", _viewProjection * m_floor.getTransformMatrix() );
+        shadowShader->setUniform( "u_projectionMatrix", _projection );
+        shadowShader->setUniform( "u_viewMatrix", _view );
+        shadowShader->setUniform( "u_modelMatrix", m_origin.getTransformMatrix() * m_floor.getTransformMatrix() );
+        shadowShader->setUniform( "u_model", m_origin.getPosition() + m_floor.getPosition() );
+        m_floor.render(shadowShader);
+        TRACK_END("render:scene:shadowmap:floor")
+    }
+}
+
+void SceneRender::renderShadowCasters(Uniforms& _uniforms, const DrawList& _list, const glm::mat4& _viewProjection, const glm::mat4& _projection, const glm::mat4& _view) {
+    vera::Shader* shadowShader = nullptr;
+    for (size_t d = 0; d < _list.size(); d++) {
+        vera::Model* model = _list[d].model;
+        TRACK_BEGIN("render:scene:shadowmap:" + model->getName())
+
+        if (_list[d].shader != shadowShader) {
+            shadowShader = _list[d].shader;
+
+            // bind the shader
+            shadowShader->use();
+
+            // Update Uniforms and textures variables to the shader
+            _uniforms.feedTo( shadowShader, false );
+
+            shadowShader->setUniform( "u_projectionMatrix", _projection );
+            shadowShader->setUniform( "u_viewMatrix", _view );
+        }
+
+        // Pass special uniforms
+        shadowShader->setUniform( "u_model", m_origin.getPosition() + model->getPosition() );
+        renderDrawItem( _list[d], shadowShader, _viewProjection );
+
+        TRACK_END("render:scene:shadowmap:" + model->getName())
+    }
+}
+
+void SceneRender::setShadowCascades(Uniforms& _uniforms, size_t _total) {
+    if (_total < 2)
+        _total = 0;
+    _total = std::min(_total, (size_t)SHADOW_CASCADES_MAX);
+
+    if (_total == m_shadows_cascades_total)
+        return;
+
+    m_shadows_cascades_total = _total;
+    for (size_t i = 0; i < SHADOW_CASCADES_MAX; i++)
+        m_shadows_cascades[i].valid = false;
+
+    if (_total > 0) {
+        _uniforms.addDefine("LIGHT_SHADOWMAP_CASCADES", vera::toString(_total));
+        addDefine("LIGHT_SHADOWMAP_CASCADES", vera::toString(_total));
+    }
+    else {
+        _uniforms.delDefine("LIGHT_SHADOWMAP_CASCADES");
+        delDefine("LIGHT_SHADOWMAP_CASCADES");
+    }
+}
+
+void SceneRender::renderShadowCascades(Uniforms& _uniforms, vera::Light* _light, bool _moved) {
+    vera::Camera* camera = _uniforms.activeCamera;
+    if (camera == nullptr || m_shadows_cascades_total == 0)
+        return;
+
+    TRACK_BEGIN("render:scene:shadowmap:cascades")
+
+    // There is nothing to shadow beyond the scene
+    float cameraNear = camera->getNearClip();
+    float cameraFar = camera->getFarClip();
+    float shadowFar = std::min(cameraFar, glm::length(camera->getPosition()) + m_area * 2.0f);
+    if (shadowFar <= cameraNear)
+        shadowFar = cameraFar;
+
+    float splits[SHADOW_CASCADES_MAX];
+    cascadeSplits(cameraNear, shadowFar, m_shadows_cascades_total, 0.75f, splits);
+
+    // Moves from clip space [-1,1] to texture space [0,1]
+    const glm::mat4 bias = glm::mat4(   0.5f, 0.0f, 0.0f, 0.0f,
+                                        0.0f, 0.5f, 0.0f, 0.0f,
+                                        0.0f, 0.0f, 0.5f, 0.0f,
+                                        0.5f, 0.5f, 0.5f, 1.0f );
+
+    glm::vec3 toLight = glm::normalize(_light->getPosition());
+    glm::mat4 cameraViewProjection = camera->getProjectionViewMatrix();
+    glm::mat4 m = m_origin.getTransformMatrix();
+
+    for (size_t i = 0; i < m_shadows_cascades_total; i++) {
+        ShadowCascade& cascade = m_shadows_cascades[i];
+
+        // Far cascades take turns so they don't all update on the same frame
+        if (cascade.valid && (m_shadows_frame % cascade.every) != (i % cascade.every))
+            continue;
+
+        glm::mat4 projection, view;
+        fitCascade( cameraViewProjection, cameraNear, cameraFar, 
+                    (i == 0)? cameraNear : splits[i-1], splits[i],
+                    toLight, m_area * 2.0f, cascade.size, projection, view);
+
+        if (cascade.valid && !_moved && 
+            cascade.split == splits[i] && cascade.projection == projection && cascade.view == view)
+            continue;
+
+        TRACK_BEGIN("render:scene:shadowmap:cascade" + vera::toString(i))
+        if (!cascade.depth.isAllocated() || cascade.depth.getWidth() != cascade.size)
+            cascade.depth.allocate(cascade.size, cascade.size, vera::DEPTH_TEXTURE);
+
+        glm::mat4 viewProjection = projection * view * m;
+        cascade.depth.bind();
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        renderShadowFloor(_uniforms, viewProjection, projection, view);
+
+        // Each cascade culls against its own frustum
+        glm::vec3 eye = glm::vec3(glm::inverse(view)[3]);
+        buildDrawList(_uniforms, "shadow", viewProjection, eye, m_drawList, 1);
+        renderShadowCasters(_uniforms, m_drawList, viewProjection, projection, view);
+
+        cascade.depth.unbind();
+        TRACK_END("render:scene:shadowmap:cascade" + vera::toString(i))
+
+        cascade.projection = projection;
+        cascade.view = view;
+        cascade.matrix = bias * projection * view;
+        cascade.split = splits[i];
+        cascade.valid = true;
+    }
+
+    TRACK_END("render:scene:shadowmap:cascades")
+}
+
 void SceneRender::renderShadowMap(Uniforms& _uniforms) {
     if (!m_shadows)
         return;
 
     TRACK_BEGIN("render:scene:shadowmap")
-    vera::Shader* shadowShader = nullptr;
+    bool staticChanged = updateShadowCasters(_uniforms);
+
     for (vera::LightsMap::iterator lit = _uniforms.lights.begin(); lit != _uniforms.lights.end(); ++lit) {
-        if (dynamicShadows ||  lit->second->bChange || haveChange() ) {
-            // Temporally move the MVP matrix from the view of the light 
-            glm::mat4 m = m_origin.getTransformMatrix();
-            // glm::mat4 p = lit->second->getProjectionMatrix();
-            // glm::mat4 v = lit->second->getViewMatrix();
-            
-            lit->second->bindShadowMap();
-
-            shadowShader = m_floor.getBufferShader("shadow");
-            if (m_floor.getVbo() && shadowShader != nullptr) {
-                TRACK_BEGIN("render:scene:shadowmap:floor")
-                shadowShader->use();
-                _uniforms.feedTo( shadowShader, false );
-                shadowShader->setUniform( "u_modelViewProjectionMatrix", lit->second->getMVPMatrix( m_origin.getTransformMatrix() * m_floor.getTransformMatrix(), m_area ) );
-                shadowShader->setUniform( "u_projectionMatrix", lit->second->getProjectionMatrix() );
-                shadowShader->setUniform( "u_viewMatrix", lit->second->getViewMatrix() );
-                shadowShader->setUniform( "u_modelMatrix", m_origin.getTransformMatrix() * m_floor.getTransformMatrix() );
-                shadowShader->setUniform( "u_model", m_origin.getPosition() + m_floor.getPosition() );
-                m_floor.render(shadowShader);
-                TRACK_END("render:scene:shadowmap:floor")
+        vera::Light* light = lit->second;
+
+        // Temporally move the MVP matrix from the view of the light 
+        glm::mat4 m = m_origin.getTransformMatrix();
+        glm::mat4 viewProjection = light->getMVPMatrix( m, m_area );
+
+        // Cascades of the main light follow the camera
+        if (lit == _uniforms.lights.begin())
+            renderShadowCascades(_uniforms, light, !cachedShadows || staticChanged || m_shadows_dynamic_total > 0 || light->bChange || haveChange() );
+
+        if (!cachedShadows) {
+            if (dynamicShadows || light->bChange || haveChange() ) {
+                light->bindShadowMap();
+                renderShadowFloor(_uniforms, viewProjection, light->getProjectionMatrix(), light->getViewMatrix());
+
+                // Models outside the light frustum don't cast shadows into this map
+                buildDrawList(_uniforms, "shadow", viewProjection, light->getPosition(), m_drawList, 1);
+                renderShadowCasters(_uniforms, m_drawList, viewProjection, light->getProjectionMatrix(), light->getViewMatrix());
+                light->unbindShadowMap();
             }
+            continue;
+        }
 
-            for (vera::ModelsMap::iterator mit = _uniforms.models.begin(); mit != _uniforms.models.end(); ++mit) {
-                shadowShader = mit->second->getBufferShader("shadow");
-                if (shadowShader != nullptr) {
-                    TRACK_BEGIN("render:scene:shadowmap:" + mit->second->getName())
+        // The static layer only needs to be drawn again when the light, the floor or a static caster moved
+        ShadowCache& cache = m_shadows_caches[light];
+        glm::mat4 floor = m_floor.getTransformMatrix();
+        bool staticDirty =  !cache.valid || staticChanged || light->bChange || haveChange() ||
+                            cache.viewProjection != viewProjection || 
+                            cache.floor != floor || cache.floorSubd != m_floor_subd;
+
+        // Models outside the light frustum don't cast shadows into this map
+        buildDrawList(_uniforms, "shadow", viewProjection, light->getPosition(), m_drawList, 1);
+        m_shadows_static.clear();
+        m_shadows_dynamic.clear();
+        for (size_t d = 0; d < m_drawList.size(); d++) {
+            if (isDynamicCaster(m_drawList[d]))
+                m_shadows_dynamic.push_back(m_drawList[d]);
+            else
+                m_shadows_static.push_back(m_drawList[d]);
+        }
 
-                    // bind the shader
-                    shadowShader->use();
+        // Nothing moved since the last frame, the shadow map is still good
+        if (!staticDirty && m_shadows_dynamic.empty() && !cache.dynamicCasters)
+            continue;
 
-                    // Update Uniforms and textures variables to the shader
-                    _uniforms.feedTo( shadowShader, false );
+        light->bindShadowMap();
+        const vera::Fbo* shadowMap = light->getShadowMap();
 
-                    // Pass special uniforms
-                    shadowShader->setUniform( "u_modelViewProjectionMatrix", lit->second->getMVPMatrix( m_origin.getTransformMatrix() * mit->second->getTransformMatrix(), m_area ) );
-                    shadowShader->setUniform( "u_projectionMatrix", lit->second->getProjectionMatrix() );
-                    shadowShader->setUniform( "u_viewMatrix", lit->second->getViewMatrix() );
-                    shadowShader->setUniform( "u_modelMatrix", m_origin.getTransformMatrix() * mit->second->getTransformMatrix() );
-                    shadowShader->setUniform( "u_model", m_origin.getPosition() + mit->second->getPosition() );
-                    mit->second->render(shadowShader);
+        // Restore the static casters from the cache
+        if (!staticDirty && cache.stored) {
+            TRACK_BEGIN("render:scene:shadowmap:cache")
+            copyDepth(&cache.depth, shadowMap);
+            glBindFramebuffer(GL_FRAMEBUFFER, shadowMap->getId());
+            TRACK_END("render:scene:shadowmap:cache")
+        }
 
-                    TRACK_END("render:scene:shadowmap:" + mit->second->getName())
+        // or draw them and keep a copy for the next frames
+        else {
+            renderShadowFloor(_uniforms, viewProjection, light->getProjectionMatrix(), light->getViewMatrix());
+            renderShadowCasters(_uniforms, m_shadows_static, viewProjection, light->getProjectionMatrix(), light->getViewMatrix());
+
+            cache.stored = supportsDepthCopy();
+            if (cache.stored) {
+                TRACK_BEGIN("render:scene:shadowmap:cache")
+                if (!cache.depth.isAllocated() || 
+                    cache.depth.getWidth() != shadowMap->getWidth() || 
+                    cache.depth.getHeight() != shadowMap->getHeight() ) {
+                    cache.depth.allocate(shadowMap->getWidth(), shadowMap->getHeight(), vera::DEPTH_TEXTURE);
                 }
+
+                copyDepth(shadowMap, &cache.depth);
+                glBindFramebuffer(GL_FRAMEBUFFER, shadowMap->getId());
+                TRACK_END("render:scene:shadowmap:cache")
             }
 
-            lit->second->unbindShadowMap();
+            cache.viewProjection = viewProjection;
+            cache.floor = floor;
+            cache.floorSubd = m_floor_subd;
+            cache.valid = true;
         }
+
+        // Dynamic casters go on top
+        renderShadowCasters(_uniforms, m_shadows_dynamic, viewProjection, light->getProjectionMatrix(), light->getViewMatrix());
+        cache.dynamicCasters = !m_shadows_dynamic.empty();
+
+        light->unbindShadowMap();
     }
+    m_shadows_frame++;
     TRACK_END("shadowmap")
 }
 
@@ -977,21 +2320,95 @@ void SceneRender::renderBackground(Uniforms& _uniforms) {
     }
 }
 
+void SceneRender::updateFloor() {
+    // Collect the floors finished on the workers
+    {
+        std::lock_guard<std::mutex> lock(m_floor_queue->mutex);
+        for (size_t i = 0; i < m_floor_queue->done.size(); i++) {
+            m_floor_meshes[m_floor_queue->done[i].key] = m_floor_queue->done[i].mesh;
+            m_floor_pending.erase(m_floor_queue->done[i].key);
+            useFloor(m_floor_queue->done[i].key);
+        }
+        m_floor_queue->done.clear();
+    }
+
+    if (m_floor_subd_target < 0 || m_floor_subd_target == m_floor_subd)
+        return;
+
+    float area = m_area * 10.0f;
+    FloorKey key(m_floor_subd_target, area, m_floor_height);
+    std::map<FloorKey, vera::Mesh>::iterator it = m_floor_meshes.find(key);
+
+    #if defined(SUPPORT_MULTITHREAD_RECORDING)
+    if (it == m_floor_meshes.end() && m_floor_subd_target > 0) {
+        if (m_floor_pending.find(key) == m_floor_pending.end()) {
+            m_floor_pending.insert(key);
+
+            std::shared_ptr<FloorQueue> queue = m_floor_queue;
+            int subd = m_floor_subd_target;
+            float height = m_floor_height;
+            m_threads.Submit([queue, key, area, subd, height]() {
+                FloorResult result;
+                result.key = key;
+                result.mesh = vera::floorMesh(area, subd, height);
+
+                std::lock_guard<std::mutex> lock(queue->mutex);
+                queue->done.push_back(result);
+            });
+        }
+
+        // Keep drawing the current floor meanwhile, or a flat one if there is none yet
+        if (m_floor_subd != -1)
+            return;
+        key = FloorKey(0, area, m_floor_height);
+        it = m_floor_meshes.find(key);
+    }
+    #endif
+
+    // A flat floor is only two triangles, not worth a round trip to the workers
+    if (it == m_floor_meshes.end())
+        it = m_floor_meshes.insert( std::make_pair(key, vera::floorMesh(area, std::get<0>(key), m_floor_height)) ).first;
+
+    useFloor(key);
+    m_floor.setGeom( it->second );
+    m_floor_subd = std::get<0>(key);
+    m_floor.addDefine("FLOOR_SUBD", vera::toString(m_floor_subd) );
+    m_floor.addDefine("FLOOR_AREA", vera::toString(area) );
+    m_floor.addDefine("FLOOR_HEIGHT", vera::toString(m_floor_height) );
+}
+
+void SceneRender::useFloor(const FloorKey& _key) {
+    std::vector<FloorKey>::iterator it = std::find(m_floor_recent.begin(), m_floor_recent.end(), _key);
+    if (it != m_floor_recent.end())
+        m_floor_recent.erase(it);
+    m_floor_recent.push_back(_key);
+
+    // The one in use is always the last, so it's never dropped
+    while (m_floor_recent.size() > FLOOR_CACHE_MAX) {
+        m_floor_meshes.erase(m_floor_recent.front());
+        m_floor_recent.erase(m_floor_recent.begin());
+    }
+}
+
+void SceneRender::clearFloor() {
+    m_floor_meshes.clear();
+    m_floor_recent.clear();
+    m_floor_pending.clear();
+
+    // Floors still on the workers land on the old queue and are dropped with it
+    m_floor_queue = std::shared_ptr<FloorQueue>(new FloorQueue());
+}
+
 void SceneRender::renderFloor(Uniforms& _uniforms) {
     if (m_floor_subd_target >= 0) {
         //  Floor
-        if (m_floor_subd_target != m_floor_subd) {
-            m_floor.setGeom( vera::floorMesh(m_area * 10.0f, m_floor_subd_target, m_floor_height) );
-            m_floor_subd = m_floor_subd_target;
-            m_floor.addDefine("FLOOR_SUBD", vera::toString(m_floor_subd) );
-            m_floor.addDefine("FLOOR_AREA", vera::toString(m_area * 10.0f) );
-            m_floor.addDefine("FLOOR_HEIGHT", vera::toString(m_floor_height) );
-        }
+        if (m_floor_subd_target != m_floor_subd)
+            updateFloor();
 
         if (m_floor.getVbo()) {
             m_floor.getShader()->use();
 
-            _uniforms.feedTo( m_floor.getShader(), true, true );
+            feedTextures( _uniforms, m_floor.getShader(), true, true );
 
             m_floor.getShader()->setUniform("u_modelViewProjectionMatrix", vera::getProjectionViewWorldMatrix() * m_floor.getTransformMatrix() );
             m_floor.getShader()->setUniform("u_modelMatrix", m_origin.getTransformMatrix() * m_floor.getTransformMatrix() );
@@ -1008,21 +2425,21 @@ void SceneRender::renderFloor(Uniforms& _uniforms) {
 
 void SceneRender::renderDevLook(Uniforms& _uniforms) {
     for (size_t i = 0; i < m_devlook_spheres.size(); i++) {
-        if (m_devlook_spheres[i]->getVbo() == nullptr)
+        if (!m_devlook_spheres[i]->shader.isLoaded())
             continue;
 
-        m_devlook_spheres[i]->getShader()->use();
-        _uniforms.feedTo( m_devlook_spheres[i]->getShader() );
-        m_devlook_spheres[i]->render();
+        m_devlook_spheres[i]->shader.use();
+        _uniforms.feedTo( &m_devlook_spheres[i]->shader );
+        m_devlook_sphere_vbo->render( &m_devlook_spheres[i]->shader );
     }
 
     for (size_t i = 0; i < m_devlook_billboards.size(); i++) {
-        if (m_devlook_billboards[i]->getVbo() == nullptr)
+        if (!m_devlook_billboards[i]->shader.isLoaded())
             continue;
 
-        m_devlook_billboards[i]->getShader()->use();
-        _uniforms.feedTo( m_devlook_billboards[i]->getShader() );
-        m_devlook_billboards[i]->render();
+        m_devlook_billboards[i]->shader.use();
+        _uniforms.feedTo( &m_devlook_billboards[i]->shader );
+        m_devlook_billboard_vbo->render( &m_devlook_billboards[i]->shader );
     }
 }
 
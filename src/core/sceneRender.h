@@ -1,8 +1,23 @@
 #pragma once
 
+#include <set>
+#include <tuple>
 #include <memory>
+#include <mutex>
+#include <future>
+
+#if defined(SUPPORT_MULTITHREAD_RECORDING)
+#include "thread_pool/thread_pool.hpp"
+#endif
+
 #include "uniforms.h"
 #include "tools/command.h"
+#include "tools/frustum.h"
+#include "tools/gBuffer.h"
+#include "tools/meshVbo.h"
+#include "tools/raycast.h"
+#include "tools/ssao.h"
+#include "tools/textureArrays.h"
 
 #include "vera/gl/gl.h"
 #include "vera/gl/vbo.h"
@@ -10,6 +25,113 @@
 #include "vera/gl/textureCube.h"
 #include "vera/types/model.h"
 
+// Models sharing the same mesh and material, drawn with a single instanced call. Each instance gets its
+// own transform through a_instanceMatrix. All of them share the full detail mesh: levels of detail are
+// chosen per model, and an instanced call draws a single one
+struct InstanceGroup {
+    vera::Model*                leader;
+    std::vector<vera::Model*>   models;
+    std::vector<glm::mat4>      transforms;     // visible instances on the current pass
+    MeshVbo*                    vbo;
+    float                       depth;
+    bool                        active;
+};
+
+// One model draw inside a pass, sorted to minimize program and texture switches
+struct DrawItem {
+    vera::Model*    model;
+    vera::Shader*   shader;             // shared by all the models with the same sources and defines
+    InstanceGroup*  group;
+    MeshVbo*        vbo;                // simplified or compact mesh drawn instead of the model, if any
+    float           depth;
+};
+
+typedef std::vector<DrawItem> DrawList;
+
+// Simplified versions of a model, each one with about half the triangles of the previous.
+// Level 0 is the model itself
+struct ModelLod {
+    std::vector<MeshVbo*>   levels;
+    std::vector<size_t>     triangles;
+};
+
+// Levels of detail simplified on worker threads, waiting to be uploaded from the main thread
+struct LodResult {
+    std::string             model;
+    size_t                  generation;
+    std::vector<vera::Mesh> levels;
+};
+
+struct LodQueue {
+    std::mutex              mutex;
+    std::vector<LodResult>  done;
+};
+
+// Floor meshes are cached by subdivision, size and height. Only the last few used are kept
+typedef std::tuple<int, float, float> FloorKey;
+#define FLOOR_CACHE_MAX 4
+
+// Floor meshes built on worker threads, waiting to be uploaded from the main thread
+struct FloorResult {
+    FloorKey                key;
+    vera::Mesh              mesh;
+};
+
+struct FloorQueue {
+    std::mutex              mutex;
+    std::vector<FloorResult> done;
+};
+
+// Model space BVH of a model for raycasts, built on the worker threads
+struct RaycastTarget {
+    std::shared_ptr<RaycastBvh> bvh;
+    std::shared_future<void>    ready;      // not valid when it was built in place
+    size_t                      vertices;
+};
+
+#define LOD_LEVELS          4
+#define LOD_MIN_TRIANGLES   20000
+
+// Motion history of a model used to tell static shadow casters from dynamic ones
+struct ShadowCaster {
+    glm::mat4       transform;
+    int             stillFrames;
+    bool            dynamic;
+};
+
+// Depth of the static casters of a light, restored before drawing the dynamic ones on top
+struct ShadowCache {
+    vera::Fbo       depth;
+    glm::mat4       viewProjection;
+    glm::mat4       floor;
+    int             floorSubd;
+    bool            dynamicCasters;     // the last shadow map have dynamic casters drawn on it
+    bool            stored;             // depth holds a copy of the static layer
+    bool            valid;
+};
+
+// One split of the camera frustum with its own shadow map fitted from the main directional light
+struct ShadowCascade {
+    vera::Fbo       depth;
+    glm::mat4       projection;
+    glm::mat4       view;
+    glm::mat4       matrix;             // biased projection * view to sample depth from world space
+    float           split;              // camera distance where this cascade ends
+    int             size;               // resolution in pixels
+    int             every;              // frames between updates
+    bool            valid;
+};
+
+#define SHADOW_CASCADES_MAX 4
+
+// Program of one DEVLOOK_SPHERE_N or DEVLOOK_BILLBOARD_N, drawn over the geometry all of them share
+struct DevLookVariant {
+    vera::Shader    shader;
+    uint64_t        hash;               // source and placement it was last compiled with
+};
+
+typedef std::vector< std::unique_ptr<DevLookVariant> > DevLookVariants;
+
 class SceneRender {
 public:
 
@@ -35,6 +157,23 @@ public:
 
     float           getArea() const { return m_area; }
 
+    void            setShadowCascades(Uniforms& _uniforms, size_t _total);
+    size_t          getShadowCascades() const { return m_shadows_cascades_total; }
+
+    void            updateLods(Uniforms& _uniforms);
+    // Returns true when the layout changed, the models carry other defines then and
+    // setShaders() has to share their programs out again
+    bool            updateCompact(Uniforms& _uniforms);
+    void            updateTextureArrays(Uniforms& _uniforms);
+    // Textures updated in place keep their id, so their packed copies are only refreshed this way
+    void            repackTextureArrays() { m_texture_arrays.clear(); }
+    void            updateFloor();
+    void            useFloor(const FloorKey& _key);
+    void            clearFloor();
+
+    // _x and _y in pixels from the bottom left corner, like u_mouse
+    bool            raycast(Uniforms& _uniforms, float _x, float _y, RaycastHit& _hit);
+
     void            flagChange();
     void            unflagChange();
     bool            haveChange() const;
@@ -42,6 +181,7 @@ public:
     size_t          getBuffersTotal() const { return m_buffers_total; }
     void            updateBuffers(Uniforms& _uniforms, int _width, int _height);
     void            printBuffers();
+    const vera::Fbo* getSsaoFbo() const { return m_ssao.getFbo(); }
 
     void            render(Uniforms& _uniforms);
     void            renderFloor(Uniforms& _uniforms);
@@ -49,8 +189,10 @@ public:
     void            renderBackground(Uniforms& _uniforms);
     void            renderDebug(Uniforms& _uniforms);
     void            renderShadowMap(Uniforms& _uniforms);
+    bool            renderGBuffer(Uniforms& _uniforms);
     void            renderNormalBuffer(Uniforms& _uniforms);
     void            renderPositionBuffer(Uniforms& _uniforms);
+    void            renderSsao(Uniforms& _uniforms);
     void            renderBuffers(Uniforms& _uniforms);
 
     bool            showGrid;
@@ -64,8 +206,43 @@ public:
     BuffersList     buffersFbo;
 
     bool            dynamicShadows;
+    bool            cachedShadows;
+    bool            frustumCulling;
+    bool            singlePassGBuffer;
+    bool            depthPrepass;
+    bool            levelOfDetail;
+    bool            compactVertices;
+    bool            textureArrays;
 
 protected:
+    void            cullModels(Uniforms& _uniforms, const glm::mat4& _viewProjection, std::vector<uint8_t>& _visible);
+    void            buildDrawList(Uniforms& _uniforms, const std::string& _buffer, const glm::mat4& _viewProjection, const glm::vec3& _eye, DrawList& _list, size_t _lodBias = 0);
+    vera::Shader*   getProgram(vera::Model* _model, const std::string& _buffer);
+    MeshVbo*        selectLod(vera::Model* _model, size_t _index, const glm::mat4& _viewProjection, size_t _bias) const;
+    void            renderDrawItem(const DrawItem& _item, vera::Shader* _shader, const glm::mat4& _viewProjection);
+    void            loadDepthShaders(Uniforms& _uniforms);
+    bool            renderDepthPrepass(Uniforms& _uniforms, const DrawList& _list);
+
+    void            updateInstances(Uniforms& _uniforms);
+    void            clearInstances();
+
+    void            buildLods(Uniforms& _uniforms);
+    void            clearLods();
+
+    void            buildCompact(Uniforms& _uniforms);
+    void            clearCompact();
+
+    void            buildRaycast(Uniforms& _uniforms);
+
+    void            feedTextures(Uniforms& _uniforms, vera::Shader* _shader, bool _lights, bool _buffers);
+
+    bool            updateShadowCasters(Uniforms& _uniforms);
+    bool            isDynamicCaster(const DrawItem& _item) const;
+    void            renderShadowFloor(Uniforms& _uniforms, const glm::mat4& _viewProjection, const glm::mat4& _projection, const glm::mat4& _view);
+    void            renderShadowCasters(Uniforms& _uniforms, const DrawList& _list, const glm::mat4& _viewProjection, const glm::mat4& _projection, const glm::mat4& _view);
+    void            renderShadowCascades(Uniforms& _uniforms, vera::Light* _light, bool _moved);
+    void            invalidateShadows();
+
     vera::Node                  m_origin;
     float                       m_area;
 
@@ -73,12 +250,66 @@ protected:
     vera::BlendMode             m_blend;
     vera::CullingMode           m_culling;
     bool                        m_depth_test;
+
+    // Normal and position buffers on one pass
+    GBuffer                     m_gbuffer;
+    bool                        m_gbuffer_shaders;
+
+    // Culling
+    BoundsList                  m_bounds;
+    std::vector<uint8_t>        m_visible;
+    DrawList                    m_drawList;
+    DrawList                    m_depthList;
+
+    // Models drawn with the programs of another model compiled from the same sources and defines
+    std::map<vera::Model*, vera::Model*>    m_programs;
+
+    // Depth pre-pass programs, compiled the first time it's on
+    std::string                 m_depth_vertex;
+    std::string                 m_depth_instanced_vertex;
+    bool                        m_depth_shaders;
+    bool                        m_depth_discard;    // the materials may discard, where the depth only pass can't tell
+
+    // Instancing
+    std::vector<InstanceGroup*>             m_instances_groups;
+    std::map<vera::Model*, InstanceGroup*>  m_instances;
     
+    // Level of detail
+    std::map<vera::Model*, ModelLod>        m_lods;
+    std::shared_ptr<LodQueue>               m_lods_queue;
+    size_t                                  m_lods_generation;
+
+    // Compact vertex formats
+    std::map<vera::Model*, MeshVbo*>        m_compact;
+    bool                                    m_compact_active;
+
+    // Material textures packed by size
+    TextureArrays                           m_texture_arrays;
+    std::vector<std::string>                m_texture_arrays_defines;
+    bool                                    m_texture_arrays_active;
+
+    // Raycasts, queried from the console thread too
+    std::map<vera::Model*, RaycastTarget>   m_raycast_targets;
+    std::mutex                              m_raycast_mutex;
+
     // Light
     std::unique_ptr<vera::Vbo>  m_lightUI_vbo;
     vera::Shader                m_lightUI_shader;
     bool                        m_shadows;
 
+    // Shadows cache
+    std::map<vera::Model*, ShadowCaster>    m_shadows_casters;
+    std::map<vera::Light*, ShadowCache>     m_shadows_caches;
+    DrawList                                m_shadows_static;
+    DrawList                                m_shadows_dynamic;
+    size_t                                  m_shadows_dynamic_total;
+    bool                                    m_shadows_animated;
+
+    // Shadows cascades
+    ShadowCascade               m_shadows_cascades[SHADOW_CASCADES_MAX];
+    size_t                      m_shadows_cascades_total;
+    size_t                      m_shadows_frame;
+
     // Background
     vera::Shader                m_background_shader;
     bool                        m_background;
@@ -92,20 +323,33 @@ protected:
     float                       m_floor_height;
     int                         m_floor_subd_target;
     int                         m_floor_subd;
+    std::map<FloorKey, vera::Mesh>  m_floor_meshes;
+    std::vector<FloorKey>           m_floor_recent;     // keys of m_floor_meshes, the last used at the back
+    std::set<FloorKey>              m_floor_pending;
+    std::shared_ptr<FloorQueue>     m_floor_queue;
 
     // DevLook
-    std::vector<vera::Model*>   m_devlook_spheres;
-    std::vector<vera::Model*>   m_devlook_billboards;
+    std::unique_ptr<vera::Vbo>  m_devlook_sphere_vbo;
+    std::unique_ptr<vera::Vbo>  m_devlook_billboard_vbo;
+    DevLookVariants             m_devlook_spheres;
+    DevLookVariants             m_devlook_billboards;
 
     // UI Grid
     std::unique_ptr<vera::Vbo>  m_grid_vbo;
     std::unique_ptr<vera::Vbo>  m_axis_vbo;
 
+    // Ambient occlusion
     glm::vec3                   m_ssaoSamples[64];
     glm::vec3                   m_ssaoNoise[16];
+    Ssao                        m_ssao;
 
     size_t                      m_buffers_total;
 
     bool                        m_commands_loaded;
     bool                        m_uniforms_loaded;
+
+    // Last, so it joins its workers before the rest goes away
+    #if defined(SUPPORT_MULTITHREAD_RECORDING)
+    thread_pool::ThreadPool     m_threads;
+    #endif
 };
@@ -0,0 +1,53 @@
+#include "cache.h"
+
+#include <cstdlib>
+#include <sys/stat.h>
+
+#if defined(PLATFORM_WINDOWS)
+#include <direct.h>
+#endif
+
+static bool makeFolder(const std::string& _path) {
+    struct stat st;
+    if (stat(_path.c_str(), &st) == 0)
+        return (st.st_mode & S_IFDIR) != 0;
+
+#if defined(PLATFORM_WINDOWS)
+    return _mkdir(_path.c_str()) == 0;
+#else
+    return mkdir(_path.c_str(), 0755) == 0;
+#endif
+}
+
+std::string getCacheFolder(const std::string& _name) {
+    std::string root = "";
+
+#if defined(PLATFORM_WINDOWS)
+    const char* local = std::getenv("LOCALAPPDATA");
+    if (local)
+        root = local;
+#else
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    const char* home = std::getenv("HOME");
+    if (xdg && xdg[0] != '\0')
+        root = xdg;
+    else if (home) {
+        root = std::string(home) + "/.cache";
+        if (!makeFolder(root))
+            return "";
+    }
+#endif
+
+    if (root.empty())
+        return "";
+
+    std::string folder = root + "/glslViewer";
+    if (!makeFolder(folder))
+        return "";
+
+    folder += "/" + _name;
+    if (!makeFolder(folder))
+        return "";
+
+    return folder;
+}
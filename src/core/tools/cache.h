@@ -0,0 +1,8 @@
+#pragma once
+
+#include <string>
+
+// Folder to keep generated data between sessions ( $XDG_CACHE_HOME/glslViewer/<_name>, 
+// ~/.cache/glslViewer/<_name> or %LOCALAPPDATA%/glslViewer/<_name> ). It's created if needed.
+// Returns an empty string when there is no place to write it
+std::string getCacheFolder(const std::string& _name);
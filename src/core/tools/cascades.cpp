@@ -0,0 +1,59 @@
+#include "cascades.h"
+
+#include <cmath>
+
+#include "glm/gtc/matrix_transform.hpp"
+
+void cascadeSplits(float _near, float _far, size_t _total, float _lambda, float* _splits) {
+    for (size_t i = 1; i <= _total; i++) {
+        float p = float(i) / float(_total);
+        float logarithmic = _near * std::pow(_far / _near, p);
+        float uniform = _near + (_far - _near) * p;
+        _splits[i-1] = _lambda * logarithmic + (1.0f - _lambda) * uniform;
+    }
+}
+
+void fitCascade(const glm::mat4& _cameraViewProjection, float _cameraNear, float _cameraFar, 
+                float _sliceNear, float _sliceFar, const glm::vec3& _toLight, float _extrusion, int _resolution,
+                glm::mat4& _projection, glm::mat4& _view) {
+
+    // Corners of the camera frustum in world space
+    glm::mat4 inv = glm::inverse(_cameraViewProjection);
+    glm::vec3 corners[8];
+    for (int i = 0; i < 4; i++) {
+        float x = (i & 1)? 1.0f : -1.0f;
+        float y = (i & 2)? 1.0f : -1.0f;
+        glm::vec4 n = inv * glm::vec4(x, y, -1.0f, 1.0f);
+        glm::vec4 f = inv * glm::vec4(x, y,  1.0f, 1.0f);
+        glm::vec3 nearCorner = glm::vec3(n) / n.w;
+        glm::vec3 farCorner = glm::vec3(f) / f.w;
+
+        // Depth grows linearly along the rays that go from the near to the far corners
+        float range = _cameraFar - _cameraNear;
+        corners[i]      = nearCorner + (farCorner - nearCorner) * ((_sliceNear - _cameraNear) / range);
+        corners[i + 4]  = nearCorner + (farCorner - nearCorner) * ((_sliceFar - _cameraNear) / range);
+    }
+
+    // Bounding sphere of the slice. Its size doesn't change when the camera rotates
+    glm::vec3 center = glm::vec3(0.0f);
+    for (int i = 0; i < 8; i++)
+        center += corners[i];
+    center /= 8.0f;
+
+    float radius = 0.0f;
+    for (int i = 0; i < 8; i++)
+        radius = std::max(radius, glm::length(corners[i] - center));
+    radius = std::ceil(radius * 16.0f) / 16.0f;
+
+    glm::vec3 up = (std::fabs(_toLight.y) > 0.99f)? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    _view = glm::lookAt(center + _toLight * (radius + _extrusion), center, up);
+    _projection = glm::ortho(-radius, radius, -radius, radius, 0.0f, 2.0f * radius + _extrusion);
+
+    // Snap the origin to the texel grid
+    glm::vec4 origin = _projection * _view * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    float texels = float(_resolution) * 0.5f;
+    glm::vec2 offset = glm::vec2(   std::round(origin.x * texels) - origin.x * texels, 
+                                    std::round(origin.y * texels) - origin.y * texels ) / texels;
+    _projection[3][0] += offset.x;
+    _projection[3][1] += offset.y;
+}
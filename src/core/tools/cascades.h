@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+
+#include "glm/glm.hpp"
+
+// Far distances of _total consecutive slices of the camera range [_near, _far] blending 
+// logarithmic and uniform distributions by _lambda (Zhang et al. 2006, practical split scheme)
+void    cascadeSplits(float _near, float _far, size_t _total, float _lambda, float* _splits);
+
+// Orthographic projection and view looking from _toLight that wraps the slice [_sliceNear, _sliceFar] 
+// of the camera frustum. Casters up to _extrusion units in front of the slice are included. The fit 
+// is a bounding sphere snapped to the texel grid so it doesn't shimmer while the camera moves
+void    fitCascade( const glm::mat4& _cameraViewProjection, float _cameraNear, float _cameraFar, 
+                    float _sliceNear, float _sliceFar, const glm::vec3& _toLight, float _extrusion, int _resolution,
+                    glm::mat4& _projection, glm::mat4& _view);
@@ -0,0 +1,95 @@
+#include "frustum.h"
+
+#include <cmath>
+
+void BoundsList::clear() {
+    cx.clear(); cy.clear(); cz.clear();
+    ex.clear(); ey.clear(); ez.clear();
+}
+
+void BoundsList::add(const vera::BoundingBox& _bbox, const glm::mat4& _transform) {
+    // Empty boxes (no vertices) are never culled
+    if (_bbox.min.x > _bbox.max.x || _bbox.min.y > _bbox.max.y || _bbox.min.z > _bbox.max.z) {
+        cx.push_back(0.0f); cy.push_back(0.0f); cz.push_back(0.0f);
+        ex.push_back(1e30f); ey.push_back(1e30f); ez.push_back(1e30f);
+        return;
+    }
+
+    glm::vec3 center = (_bbox.min + _bbox.max) * 0.5f;
+    glm::vec3 extents = (_bbox.max - _bbox.min) * 0.5f;
+
+    // Transform the box keeping it axis aligned (Arvo, Graphics Gems 1990)
+    glm::vec3 c = glm::vec3(_transform * glm::vec4(center, 1.0f));
+    glm::vec3 e = glm::vec3(0.0f);
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            e[i] += std::fabs(_transform[j][i]) * extents[j];
+
+    cx.push_back(c.x); cy.push_back(c.y); cz.push_back(c.z);
+    ex.push_back(e.x); ey.push_back(e.y); ez.push_back(e.z);
+}
+
+Frustum::Frustum() {
+    for (int i = 0; i < 6; i++)
+        planes[i] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+Frustum::Frustum(const glm::mat4& _viewProjection) {
+    set(_viewProjection);
+}
+
+void Frustum::set(const glm::mat4& _viewProjection) {
+    // Gribb & Hartmann plane extraction (glm matrices are column major)
+    glm::vec4 row0 = glm::vec4(_viewProjection[0][0], _viewProjection[1][0], _viewProjection[2][0], _viewProjection[3][0]);
+    glm::vec4 row1 = glm::vec4(_viewProjection[0][1], _viewProjection[1][1], _viewProjection[2][1], _viewProjection[3][1]);
+    glm::vec4 row2 = glm::vec4(_viewProjection[0][2], _viewProjection[1][2], _viewProjection[2][2], _viewProjection[3][2]);
+    glm::vec4 row3 = glm::vec4(_viewProjection[0][3], _viewProjection[1][3], _viewProjection[2][3], _viewProjection[3][3]);
+
+    planes[0] = row3 + row0;    // left
+    planes[1] = row3 - row0;    // right
+    planes[2] = row3 + row1;    // bottom
+    planes[3] = row3 - row1;    // top
+    planes[4] = row3 + row2;    // near
+    planes[5] = row3 - row2;    // far
+
+    for (int i = 0; i < 6; i++) {
+        float l = glm::length(glm::vec3(planes[i]));
+        if (l > 0.0f)
+            planes[i] /= l;
+    }
+}
+
+void Frustum::cull(const BoundsList& _bounds, std::vector<uint8_t>& _visible) const {
+    const size_t total = _bounds.size();
+    _visible.assign(total, 1);
+
+    const float* cx = _bounds.cx.data();
+    const float* cy = _bounds.cy.data();
+    const float* cz = _bounds.cz.data();
+    const float* ex = _bounds.ex.data();
+    const float* ey = _bounds.ey.data();
+    const float* ez = _bounds.ez.data();
+    uint8_t* visible = _visible.data();
+
+    // One plane at a time over the whole array. No branches on the inner loop
+    for (int p = 0; p < 6; p++) {
+        const float nx = planes[p].x, ny = planes[p].y, nz = planes[p].z, nw = planes[p].w;
+        const float ax = std::fabs(nx), ay = std::fabs(ny), az = std::fabs(nz);
+
+        for (size_t i = 0; i < total; i++) {
+            float d = nx * cx[i] + ny * cy[i] + nz * cz[i] + nw;
+            float r = ax * ex[i] + ay * ey[i] + az * ez[i];
+            visible[i] &= (uint8_t)(d + r >= 0.0f);
+        }
+    }
+}
+
+bool Frustum::inside(const glm::vec3& _center, const glm::vec3& _extents) const {
+    for (int p = 0; p < 6; p++) {
+        float d = glm::dot(glm::vec3(planes[p]), _center) + planes[p].w;
+        float r = glm::dot(glm::abs(glm::vec3(planes[p])), _extents);
+        if (d + r < 0.0f)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "glm/glm.hpp"
+#include "vera/types/boundingBox.h"
+
+// World-space axis aligned bounds packed as structure-of-arrays
+// so the culling loop can be vectorized by the compiler
+struct BoundsList {
+    void    clear();
+    void    add(const vera::BoundingBox& _bbox, const glm::mat4& _transform);
+    size_t  size() const { return cx.size(); }
+
+    std::vector<float>  cx, cy, cz;     // centers
+    std::vector<float>  ex, ey, ez;     // half extents
+};
+
+class Frustum {
+public:
+    Frustum();
+    Frustum(const glm::mat4& _viewProjection);
+
+    // Extract the six clipping planes of a (projection * view * world) matrix
+    void        set(const glm::mat4& _viewProjection);
+
+    // Fill _visible with 1 for the bounds that intersect the frustum and 0 for the ones that don't
+    void        cull(const BoundsList& _bounds, std::vector<uint8_t>& _visible) const;
+
+    bool        inside(const glm::vec3& _center, const glm::vec3& _extents) const;
+
+    glm::vec4   planes[6];
+};
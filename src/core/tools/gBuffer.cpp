@@ -0,0 +1,159 @@
+#include "gBuffer.h"
+
+#include <regex>
+#include <iostream>
+
+#include "vera/window.h"
+
+GBuffer::GBuffer() : m_id(0), m_depth(0), m_previous(0), m_width(0), m_height(0) {
+}
+
+GBuffer::~GBuffer() {
+    clear();
+}
+
+bool GBuffer::supported() {
+#if defined(PLATFORM_RPI)
+    return false;
+#else
+    return vera::getVersion() >= 130;
+#endif
+}
+
+std::string GBuffer::getFragmentSource(const std::string& _vertexSource) {
+    int version = 100;
+    bool es = false;
+
+    std::smatch match;
+    std::regex reVersion(R"(^\s*#version\s+(\d+)(\s+es)?)");
+    if (std::regex_search(_vertexSource, match, reVersion)) {
+        version = std::stoi(match[1]);
+        es = match[2].matched;
+    }
+
+    bool outputs = es ? version >= 300 : version >= 130;
+
+    std::string src = "";
+    if (version > 100)
+        src += "#version " + std::to_string(version) + (es ? " es" : "") + "\n";
+
+    if (outputs && !es && version < 330)
+        src += "#extension GL_ARB_explicit_attrib_location : enable\n";
+
+    src +=  "#ifdef GL_ES\n"
+            "precision highp float;\n"
+            "#endif\n\n";
+
+    std::string varying = outputs ? "in" : "varying";
+    src +=  varying + " vec4 v_position;\n"
+            "#ifdef MODEL_VERTEX_NORMAL\n" + 
+            varying + " vec3 v_normal;\n"
+            "#endif\n\n";
+
+    if (outputs)
+        src +=  "layout(location = 0) out vec4 normalOut;\n"
+                "layout(location = 1) out vec4 positionOut;\n\n";
+    else
+        src +=  "#define normalOut gl_FragData[0]\n"
+                "#define positionOut gl_FragData[1]\n\n";
+
+    src +=  "void main(void) {\n"
+            "    vec3 normal = vec3(0.0, 0.0, 1.0);\n"
+            "    #ifdef MODEL_VERTEX_NORMAL\n"
+            "    normal = normalize(v_normal);\n"
+            "    #endif\n"
+            "    normalOut = vec4(normal, 1.0);\n"
+            "    positionOut = vec4(v_position.xyz, 1.0);\n"
+            "}\n";
+
+    return src;
+}
+
+bool GBuffer::attach(const std::vector<const vera::Fbo*>& _targets) {
+    if (!supported() || _targets.size() == 0)
+        return false;
+
+#if defined(PLATFORM_RPI)
+    return false;
+#else
+    std::vector<GLuint> textures;
+    for (size_t i = 0; i < _targets.size(); i++) {
+        if (!_targets[i]->isAllocated() || 
+            _targets[i]->getWidth() != _targets[0]->getWidth() || 
+            _targets[i]->getHeight() != _targets[0]->getHeight())
+            return false;
+        textures.push_back( _targets[i]->getTextureId() );
+    }
+
+    // Nothing changed since last time
+    if (m_id != 0 && textures == m_textures && 
+        m_width == _targets[0]->getWidth() && m_height == _targets[0]->getHeight())
+        return true;
+
+    clear();
+    m_width = _targets[0]->getWidth();
+    m_height = _targets[0]->getHeight();
+    m_textures = textures;
+
+    GLint previous = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+
+    glGenFramebuffers(1, &m_id);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_id);
+
+    std::vector<GLenum> buffers;
+    for (size_t i = 0; i < m_textures.size(); i++) {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, m_textures[i], 0);
+        buffers.push_back(GL_COLOR_ATTACHMENT0 + i);
+    }
+    glDrawBuffers(buffers.size(), buffers.data());
+
+    glGenRenderbuffers(1, &m_depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, m_depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, m_width, m_height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, previous);
+
+    if (!complete) {
+        std::cerr << "GBuffer: framebuffer with " << m_textures.size() << " render targets is not complete" << std::endl;
+        clear();
+        return false;
+    }
+
+    return true;
+#endif
+}
+
+void GBuffer::bind() {
+#if !defined(PLATFORM_RPI)
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &m_previous);
+    glGetIntegerv(GL_VIEWPORT, m_viewport);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_id);
+    glViewport(0, 0, m_width, m_height);
+
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+#endif
+}
+
+void GBuffer::unbind() {
+#if !defined(PLATFORM_RPI)
+    glBindFramebuffer(GL_FRAMEBUFFER, m_previous);
+    glViewport(m_viewport[0], m_viewport[1], m_viewport[2], m_viewport[3]);
+#endif
+}
+
+void GBuffer::clear() {
+    if (m_depth)
+        glDeleteRenderbuffers(1, &m_depth);
+    if (m_id)
+        glDeleteFramebuffers(1, &m_id);
+
+    m_id = m_depth = 0;
+    m_textures.clear();
+    m_width = m_height = 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include "vera/gl/gl.h"
+#include "vera/gl/fbo.h"
+
+// Framebuffer that writes into the color textures of several vera::Fbo at once (multiple render 
+// targets) so one geometry pass can fill all of them. Consumers keep reading the original FBOs
+class GBuffer {
+public:
+    GBuffer();
+    virtual ~GBuffer();
+
+    // Multiple render targets need GL 3.x or GLES 3.0
+    static bool supported();
+
+    // Fragment shader that writes the normal on the first target and the position on the second
+    // using the same GLSL version and varyings as _vertexSource 
+    static std::string getFragmentSource(const std::string& _vertexSource);
+
+    bool    attach(const std::vector<const vera::Fbo*>& _targets);
+    bool    isAllocated() const { return m_id != 0; }
+
+    void    bind();
+    void    unbind();
+
+    void    clear();
+
+protected:
+    std::vector<GLuint> m_textures;
+    GLuint              m_id;
+    GLuint              m_depth;
+    GLint               m_previous;
+    GLint               m_viewport[4];
+    int                 m_width;
+    int                 m_height;
+};
@@ -0,0 +1,45 @@
+#include "hash.h"
+
+#include <cstdio>
+
+uint64_t hashBytes(const void* _data, size_t _size, uint64_t _seed) {
+    const unsigned char* bytes = (const unsigned char*)_data;
+    uint64_t hash = _seed;
+    for (size_t i = 0; i < _size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t hashString(const std::string& _str, uint64_t _seed) {
+    return hashBytes(_str.data(), _str.size(), _seed);
+}
+
+template<typename T>
+uint64_t hashVector(const std::vector<T>& _vector, uint64_t _seed) {
+    uint64_t size = _vector.size();
+    uint64_t hash = hashBytes(&size, sizeof(size), _seed);
+    if (size > 0)
+        hash = hashBytes(_vector.data(), _vector.size() * sizeof(T), hash);
+    return hash;
+}
+
+uint64_t hashMesh(const vera::Mesh& _mesh) {
+    uint64_t hash = 14695981039346656037ULL;
+    int drawMode = (int)_mesh.getDrawMode();
+    hash = hashBytes(&drawMode, sizeof(drawMode), hash);
+    hash = hashVector(_mesh.getVertices(), hash);
+    hash = hashVector(_mesh.getColors(), hash);
+    hash = hashVector(_mesh.getNormals(), hash);
+    hash = hashVector(_mesh.getTexCoords(), hash);
+    hash = hashVector(_mesh.getTangents(), hash);
+    hash = hashVector(_mesh.getIndices(), hash);
+    return hash;
+}
+
+std::string hashToString(uint64_t _hash) {
+    char str[17];
+    std::snprintf(str, sizeof(str), "%016llx", (unsigned long long)_hash);
+    return std::string(str);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "vera/types/mesh.h"
+
+// FNV-1a 64bits
+uint64_t    hashBytes(const void* _data, size_t _size, uint64_t _seed = 14695981039346656037ULL);
+uint64_t    hashString(const std::string& _str, uint64_t _seed = 14695981039346656037ULL);
+
+// Hash of the geometry (vertices, colors, normals, texcoords, tangents and indices) of a mesh
+uint64_t    hashMesh(const vera::Mesh& _mesh);
+
+std::string hashToString(uint64_t _hash);
@@ -0,0 +1,385 @@
+#include "histogram.h"
+
+#include <thread>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+#include "text.h"
+
+#include "vera/window.h"
+#include "vera/ops/draw.h"
+#include "vera/shaders/defaultShaders.h"
+
+Histogram::Histogram() :
+    downsample(4),
+    m_bins_fbo(0), m_bins_texture(0), m_points_width(0), m_points_height(0),
+    m_pbo_index(0), m_pbo_width(0), m_pbo_height(0),
+    m_gpu(false), m_loaded(false), m_pending(false) {
+    m_pbos[0] = m_pbos[1] = 0;
+    for (size_t i = 0; i < 256; i++)
+        m_values[i] = glm::vec4(0.0f);
+}
+
+Histogram::~Histogram() {
+    clear();
+}
+
+bool Histogram::supportsGpu() {
+#if defined(PLATFORM_RPI) || defined(__EMSCRIPTEN__) || !defined(GL_RGBA32F)
+    return false;
+#else
+    // Additive blending on 32bits float targets and texelFetch() on the vertex stage
+    bool es = false;
+    int version = getGlslVersion(&es);
+    return !es && version >= 130 && vera::getVersion() >= 130;
+#endif
+}
+
+bool Histogram::supportsPixelBuffers() {
+#if defined(PLATFORM_RPI) || defined(__EMSCRIPTEN__) || !defined(GL_PIXEL_PACK_BUFFER) || !defined(GL_MAP_READ_BIT)
+    return false;
+#else
+    return vera::getVersion() >= 130;
+#endif
+}
+
+void Histogram::clear() {
+#if defined(GL_RGBA32F)
+    if (m_bins_fbo)
+        glDeleteFramebuffers(1, &m_bins_fbo);
+    if (m_bins_texture)
+        glDeleteTextures(1, &m_bins_texture);
+#endif
+    m_bins_fbo = 0;
+    m_bins_texture = 0;
+
+#if defined(GL_PIXEL_PACK_BUFFER) && defined(GL_MAP_READ_BIT)
+    if (m_pbos[0])
+        glDeleteBuffers(2, m_pbos);
+#endif
+    m_pbos[0] = m_pbos[1] = 0;
+    m_pending = false;
+    m_points_width = m_points_height = 0;
+    m_pbo_width = m_pbo_height = 0;
+}
+
+bool Histogram::update(const vera::Fbo* _src) {
+    if (_src == nullptr || !_src->isAllocated())
+        return false;
+
+    if (!m_loaded) {
+        m_loaded = true;
+        m_gpu = supportsGpu();
+
+        if (m_gpu) {
+            std::string vert = getGlslHeader(true);
+            std::string frag = getGlslHeader(false);
+
+            // Each point is one pixel and one channel (on z), landing on the bin of its value
+            std::string scatterVert = vert +
+                "ATTRIBUTE vec4 a_position;\n"
+                "VARYING vec4 v_mask;\n"
+                "uniform sampler2D u_source;\n"
+                "uniform float u_downsample;\n"
+                "void main(void) {\n"
+                "    vec3 color = texelFetch(u_source, ivec2(a_position.xy * u_downsample), 0).rgb;\n"
+                "    float channel = a_position.z;\n"
+                "    float bin = 0.0;\n"
+                "    if (channel < 3.0)\n"
+                "        bin = floor(clamp(color[int(channel)], 0.0, 1.0) * 255.0 + 0.5);\n"
+                "    else\n"
+                "        bin = floor(clamp(dot(color, vec3(0.299, 0.587, 0.114)), 0.0, 1.0) * 255.0);\n"
+                "    v_mask = vec4(equal(vec4(channel), vec4(0.0, 1.0, 2.0, 3.0)));\n"
+                "    gl_Position = vec4((bin + 0.5) / 128.0 - 1.0, 0.0, 0.0, 1.0);\n"
+                "    gl_PointSize = 1.0;\n"
+                "}\n";
+
+            std::string scatterFrag = frag +
+                "VARYING vec4 v_mask;\n"
+                "void main(void) {\n"
+                "    fragColor = v_mask;\n"
+                "}\n";
+
+            std::string normalizeFrag = frag +
+                "uniform sampler2D u_bins;\n"
+                "void main(void) {\n"
+                "    vec2 highest = vec2(1.0);\n"
+                "    for (int i = 0; i < 256; i++) {\n"
+                "        vec4 bin = texelFetch(u_bins, ivec2(i, 0), 0);\n"
+                "        highest = max(highest, vec2(max(bin.r, max(bin.g, bin.b)), bin.a));\n"
+                "    }\n"
+                "    vec4 bin = texelFetch(u_bins, ivec2(gl_FragCoord.x, 0), 0);\n"
+                "    fragColor = bin / highest.xxxy;\n"
+                "}\n";
+
+            m_gpu = m_scatter_shader.setSource(scatterFrag, scatterVert) &&
+                    m_normalize_shader.setSource(normalizeFrag, vera::getDefaultSrc(vera::VERT_BILLBOARD));
+
+            if (!m_gpu)
+                std::cerr << "Histogram: couldn't compile the scatter shaders, counting on the CPU" << std::endl;
+        }
+
+        // Also kept to fall back on when the float bins can't be rendered to.
+        // Takes one pixel every downsample, without blending them into values that are not there
+        {
+            std::string frag = getGlslHeader(false) +
+                "uniform sampler2D u_source;\n"
+                "uniform vec2 u_sourceResolution;\n"
+                "uniform float u_downsample;\n"
+                "void main(void) {\n"
+                "    vec2 texel = floor(gl_FragCoord.xy) * u_downsample + 0.5;\n"
+                "    fragColor = TEXTURE(u_source, texel / u_sourceResolution);\n"
+                "}\n";
+            m_downsample_shader.setSource(frag, vera::getDefaultSrc(vera::VERT_BILLBOARD));
+        }
+    }
+
+    return m_gpu ? updateGpu(_src) : updateCpu(_src);
+}
+
+bool Histogram::updateGpu(const vera::Fbo* _src) {
+#if defined(GL_RGBA32F)
+    int ds = std::max(1, downsample);
+    int width = std::max(1, _src->getWidth() / ds);
+    int height = std::max(1, _src->getHeight() / ds);
+
+    GLint previous = 0;
+    GLint viewport[4];
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    // Counts go over what half floats can hold, so the bins are 32bits
+    if (m_bins_fbo == 0) {
+        glGenTextures(1, &m_bins_texture);
+        glBindTexture(GL_TEXTURE_2D, m_bins_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 256, 1, 0, GL_RGBA, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glGenFramebuffers(1, &m_bins_fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, m_bins_fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_bins_texture, 0);
+        bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        glBindFramebuffer(GL_FRAMEBUFFER, previous);
+
+        if (!complete) {
+            std::cerr << "Histogram: float bins framebuffer is not complete, counting on the CPU" << std::endl;
+            clear();
+            m_gpu = false;
+            return false;
+        }
+
+        m_normalized.allocate(256, 1, vera::COLOR_FLOAT_TEXTURE);
+    }
+
+    // One point per sampled pixel and channel, rebuilt only when the size changes
+    if (m_points_width != width || m_points_height != height) {
+        vera::Mesh points;
+        points.setDrawMode(vera::POINTS);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                for (int c = 0; c < 4; c++)
+                    points.addVertex(glm::vec3(x, y, c));
+        m_points.load(points);
+        m_points_width = width;
+        m_points_height = height;
+    }
+
+    GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    GLboolean blend = glIsEnabled(GL_BLEND);
+    glDisable(GL_DEPTH_TEST);
+    #if defined(GL_PROGRAM_POINT_SIZE)
+    glEnable(GL_PROGRAM_POINT_SIZE);
+    #endif
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_bins_fbo);
+    glViewport(0, 0, 256, 1);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    m_scatter_shader.use();
+    m_scatter_shader.textureIndex = 0;
+    m_scatter_shader.setUniform("u_downsample", float(ds));
+    m_scatter_shader.setUniformTexture("u_source", _src, m_scatter_shader.textureIndex++);
+    m_points.render(&m_scatter_shader);
+    glDisable(GL_BLEND);
+    glBindFramebuffer(GL_FRAMEBUFFER, previous);
+
+    m_normalized.bind();
+    glViewport(0, 0, 256, 1);
+    m_normalize_shader.use();
+    m_normalize_shader.textureIndex = 0;
+    m_normalize_shader.setUniformTexture("u_bins", m_bins_texture, m_normalize_shader.textureIndex++);
+    vera::getBillboard()->render(&m_normalize_shader);
+    m_normalized.unbind();
+
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (depthTest) glEnable(GL_DEPTH_TEST);
+    if (blend) glEnable(GL_BLEND);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Histogram::updateCpu(const vera::Fbo* _src) {
+    int ds = std::max(1, downsample);
+    int width = std::max(1, _src->getWidth() / ds);
+    int height = std::max(1, _src->getHeight() / ds);
+
+    if (!m_small.isAllocated() || m_small.getWidth() != width || m_small.getHeight() != height)
+        m_small.allocate(width, height, vera::COLOR_TEXTURE);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    GLboolean blend = glIsEnabled(GL_BLEND);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+
+    m_small.bind();
+    glViewport(0, 0, width, height);
+    m_downsample_shader.use();
+    m_downsample_shader.textureIndex = 0;
+    m_downsample_shader.setUniform("u_downsample", float(ds));
+    m_downsample_shader.setUniform("u_sourceResolution", float(_src->getWidth()), float(_src->getHeight()));
+    m_downsample_shader.setUniformTexture("u_source", _src, m_downsample_shader.textureIndex++);
+    vera::getBillboard()->render(&m_downsample_shader);
+
+    bool ready = false;
+
+#if defined(GL_PIXEL_PACK_BUFFER) && defined(GL_MAP_READ_BIT)
+    if (supportsPixelBuffers()) {
+        size_t bytes = size_t(width) * height * 4;
+        if (m_pbos[0] == 0 || m_pbo_width != width || m_pbo_height != height) {
+            if (m_pbos[0] == 0)
+                glGenBuffers(2, m_pbos);
+            for (size_t i = 0; i < 2; i++) {
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbos[i]);
+                glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+            }
+            m_pbo_width = width;
+            m_pbo_height = height;
+            m_pending = false;
+        }
+
+        // Start copying this frame while mapping the one started on the last call,
+        // which by now is done without having to wait for it
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbos[m_pbo_index]);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+        if (m_pending) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbos[1 - m_pbo_index]);
+            const uint8_t* pixels = (const uint8_t*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+            if (pixels) {
+                count(pixels, width, height);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                ready = true;
+            }
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        m_pbo_index = 1 - m_pbo_index;
+        m_pending = true;
+    }
+    else
+#endif
+    {
+        m_pixels.resize(size_t(width) * height * 4);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, m_pixels.data());
+        count(m_pixels.data(), width, height);
+        ready = true;
+    }
+
+    m_small.unbind();
+
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (depthTest) glEnable(GL_DEPTH_TEST);
+    if (blend) glEnable(GL_BLEND);
+
+    return ready;
+}
+
+// Rows are split between threads, each one counting on its own bins. Pixels are read as whole
+// RGBA words and counted two at a time on two sets of bins, so consecutive increments of the same
+// bin don't wait on each other. Luma is 8bits fixed point (77, 150, 29 adds to 256)
+static void countRows(const uint8_t* _pixels, size_t _from, size_t _to, uint32_t* _bins) {
+    uint32_t* a = _bins;
+    uint32_t* b = _bins + 256 * 4;
+
+    size_t i = _from;
+    for (; i + 1 < _to; i += 2) {
+        uint32_t p0, p1;
+        std::memcpy(&p0, _pixels + i * 4, 4);
+        std::memcpy(&p1, _pixels + i * 4 + 4, 4);
+
+        uint32_t r0 = p0 & 0xff, g0 = (p0 >> 8) & 0xff, b0 = (p0 >> 16) & 0xff;
+        uint32_t r1 = p1 & 0xff, g1 = (p1 >> 8) & 0xff, b1 = (p1 >> 16) & 0xff;
+
+        a[r0]++; a[256 + g0]++; a[512 + b0]++; a[768 + ((77 * r0 + 150 * g0 + 29 * b0) >> 8)]++;
+        b[r1]++; b[256 + g1]++; b[512 + b1]++; b[768 + ((77 * r1 + 150 * g1 + 29 * b1) >> 8)]++;
+    }
+
+    for (; i < _to; i++) {
+        const uint8_t* p = _pixels + i * 4;
+        a[p[0]]++; a[256 + p[1]]++; a[512 + p[2]]++; a[768 + ((77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8)]++;
+    }
+}
+
+void Histogram::count(const uint8_t* _pixels, int _width, int _height) {
+    size_t total = size_t(_width) * _height;
+    const size_t binsSize = 256 * 4 * 2;
+
+#if defined(SUPPORT_MULTITHREAD_RECORDING)
+    // Spawning threads only pays off for large enough images
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max((size_t)1, std::min(threads, total / 65536));
+#else
+    size_t threads = 1;
+#endif
+
+    std::vector<uint32_t> bins(binsSize * threads, 0);
+    size_t step = (total + threads - 1) / threads;
+
+#if defined(SUPPORT_MULTITHREAD_RECORDING)
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++) {
+        size_t from = std::min(total, t * step);
+        size_t to = std::min(total, from + step);
+        workers.push_back( std::thread(countRows, _pixels, from, to, &bins[t * binsSize]) );
+    }
+#endif
+
+    countRows(_pixels, 0, std::min(total, step), &bins[0]);
+
+#if defined(SUPPORT_MULTITHREAD_RECORDING)
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+#endif
+
+    // Merge
+    uint32_t merged[256 * 4] = { 0 };
+    for (size_t t = 0; t < threads * 2; t++) {
+        const uint32_t* src = &bins[t * 256 * 4];
+        for (size_t i = 0; i < 256 * 4; i++)
+            merged[i] += src[i];
+    }
+
+    uint32_t highestRgb = 1;
+    uint32_t highestLuma = 1;
+    for (size_t i = 0; i < 256; i++) {
+        highestRgb = std::max(highestRgb, std::max(merged[i], std::max(merged[256 + i], merged[512 + i])));
+        highestLuma = std::max(highestLuma, merged[768 + i]);
+    }
+
+    for (size_t i = 0; i < 256; i++)
+        m_values[i] = glm::vec4(float(merged[i]) / highestRgb,
+                                float(merged[256 + i]) / highestRgb,
+                                float(merged[512 + i]) / highestRgb,
+                                float(merged[768 + i]) / highestLuma);
+}
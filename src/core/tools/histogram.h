@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "vera/gl/gl.h"
+#include "vera/gl/fbo.h"
+#include "vera/gl/shader.h"
+
+#include "meshVbo.h"
+
+#include "glm/glm.hpp"
+
+// 256 bins of the red, green, blue and luma values of a framebuffer, one pixel out of every
+// downsample x downsample. Red, green and blue are normalized by the largest of their counts and
+// luma (in alpha) by its own.
+//
+// On desktop GL 3 the pixels are scattered as points into a 256x1 float target with additive
+// blending and normalized on the GPU, so nothing is read back. Otherwise a downsampled copy is
+// read through two pixel buffers (when available, one frame late and without stalling) and
+// counted on several threads, each one on its own integer bins
+class Histogram {
+public:
+    Histogram();
+    virtual ~Histogram();
+
+    static bool supportsGpu();
+    static bool supportsPixelBuffers();
+
+    // True when new values are ready: on getFbo() when isGpu(), on getValues() otherwise
+    bool        update(const vera::Fbo* _src);
+    bool        isPending() const { return m_pending; }
+    void        clear();
+
+    bool        isGpu() const { return m_gpu; }
+    const vera::Fbo* getFbo() const { return &m_normalized; }
+    const glm::vec4* getValues() const { return m_values; }
+
+    int         downsample;
+
+protected:
+    bool        updateGpu(const vera::Fbo* _src);
+    bool        updateCpu(const vera::Fbo* _src);
+    void        count(const uint8_t* _pixels, int _width, int _height);
+
+    // GPU
+    GLuint          m_bins_fbo;
+    GLuint          m_bins_texture;
+    vera::Fbo       m_normalized;
+    vera::Shader    m_scatter_shader;
+    vera::Shader    m_normalize_shader;
+    MeshVbo         m_points;
+    int             m_points_width;
+    int             m_points_height;
+
+    // CPU
+    vera::Fbo       m_small;
+    vera::Shader    m_downsample_shader;
+    GLuint          m_pbos[2];
+    size_t          m_pbo_index;
+    int             m_pbo_width;
+    int             m_pbo_height;
+    std::vector<uint8_t> m_pixels;
+    glm::vec4       m_values[256];
+
+    bool            m_gpu;
+    bool            m_loaded;
+    bool            m_pending;
+};
@@ -0,0 +1,71 @@
+#include "history.h"
+
+#include <vector>
+
+#include "text.h"
+
+#include "vera/ops/draw.h"
+#include "vera/shaders/defaultShaders.h"
+
+History::History() : m_texture(nullptr), m_head(HISTORY_SIZE - 1) {
+}
+
+History::~History() {
+    if (m_texture)
+        delete m_texture;
+}
+
+void History::push(const glm::vec4& _value) {
+    if (m_texture == nullptr) {
+        std::vector<glm::vec4> empty(HISTORY_SIZE, glm::vec4(0.0f));
+        m_texture = new vera::Texture();
+        m_texture->load(HISTORY_SIZE, 1, 4, 32, &empty[0], vera::NEAREST, vera::CLAMP);
+    }
+
+    m_head = (m_head + 1) % HISTORY_SIZE;
+
+    glBindTexture(GL_TEXTURE_2D, m_texture->getTextureId());
+    glTexSubImage2D(GL_TEXTURE_2D, 0, m_head, 0, 1, 1, GL_RGBA, GL_FLOAT, &_value[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+const vera::Fbo* History::unroll(size_t _channel) {
+    if (m_texture == nullptr)
+        return nullptr;
+
+    if (!m_unroll_shader.isLoaded()) {
+        std::string frag = getGlslHeader(false) +
+            "uniform sampler2D u_history;\n"
+            "uniform float u_historyHead;\n"
+            "uniform vec4 u_channel;\n"
+            "void main(void) {\n"
+            "    float x = mod(floor(gl_FragCoord.x) + u_historyHead + 1.0, " + std::to_string(HISTORY_SIZE) + ".0);\n"
+            "    vec4 value = TEXTURE(u_history, vec2((x + 0.5) / " + std::to_string(HISTORY_SIZE) + ".0, 0.5));\n"
+            "    fragColor = vec4(dot(value, u_channel), 0.0, 0.0, 1.0);\n"
+            "}\n";
+        m_unroll_shader.setSource(frag, vera::getDefaultSrc(vera::VERT_BILLBOARD));
+        m_unrolled.allocate(HISTORY_SIZE, 1, vera::COLOR_FLOAT_TEXTURE);
+    }
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLboolean blend = glIsEnabled(GL_BLEND);
+    glDisable(GL_BLEND);
+
+    glm::vec4 channel(0.0f);
+    channel[_channel % 4] = 1.0f;
+
+    m_unrolled.bind();
+    glViewport(0, 0, HISTORY_SIZE, 1);
+    m_unroll_shader.use();
+    m_unroll_shader.textureIndex = 0;
+    m_unroll_shader.setUniform("u_historyHead", float(m_head));
+    m_unroll_shader.setUniform("u_channel", channel);
+    m_unroll_shader.setUniformTexture("u_history", m_texture, m_unroll_shader.textureIndex++);
+    vera::getBillboard()->render(&m_unroll_shader);
+    m_unrolled.unbind();
+
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (blend) glEnable(GL_BLEND);
+    return &m_unrolled;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "vera/gl/gl.h"
+#include "vera/gl/fbo.h"
+#include "vera/gl/shader.h"
+#include "vera/gl/texture.h"
+
+#include "glm/glm.hpp"
+
+#define HISTORY_SIZE 256
+
+// Last HISTORY_SIZE values on a HISTORY_SIZE x 1 float texture used as a ring buffer. The texture
+// is allocated once and each push writes a single texel at the head, nothing else moves. The value
+// pushed _n frames ago is at texel mod(head - _n, HISTORY_SIZE)
+class History {
+public:
+    History();
+    virtual ~History();
+
+    void        push(const glm::vec4& _value);
+
+    // Copy of one channel with the oldest value on the left and the newest on the right, for
+    // shaders that don't know about the head (like the plots)
+    const vera::Fbo* unroll(size_t _channel);
+
+    const vera::Texture* getTexture() const { return m_texture; }
+    int         getHead() const { return m_head; }
+
+protected:
+    vera::Texture*  m_texture;
+    vera::Fbo       m_unrolled;
+    vera::Shader    m_unroll_shader;
+    int             m_head;
+};
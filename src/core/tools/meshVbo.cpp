@@ -0,0 +1,439 @@
+#include "meshVbo.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+#include "vera/window.h"
+
+static size_t s_programsGeneration = 0;
+
+MeshVbo::MeshVbo() :
+    m_locationsGeneration(0), m_decode(1.0f),
+    m_vertexBuffer(0), m_indexBuffer(0), m_instanceBuffer(0),
+    m_drawMode(GL_TRIANGLES), m_indexType(GL_UNSIGNED_INT), m_stride(0),
+    m_verticesTotal(0), m_indicesTotal(0), m_instancesTotal(0), m_instancesCapacity(0), m_bytesTotal(0),
+    m_compact(false), m_uploaded(false), m_instancesChanged(false) {
+}
+
+MeshVbo::MeshVbo(const vera::Mesh& _mesh, bool _compact, const vera::BoundingBox* _bounds) : MeshVbo() {
+    load(_mesh, _compact, _bounds);
+}
+
+MeshVbo::~MeshVbo() {
+    clear();
+}
+
+bool MeshVbo::supportsInstancing() {
+#if defined(PLATFORM_RPI)
+    return false;
+#else
+    // glDrawElementsInstanced and glVertexAttribDivisor are core on GL 3.x and GLES 3.0
+    return vera::getVersion() >= 130;
+#endif
+}
+
+void MeshVbo::programsChanged() {
+    s_programsGeneration++;
+}
+
+// IEEE 754 half float, values too small for it are flushed to zero
+static GLushort toHalf(float _value) {
+    uint32_t bits;
+    std::memcpy(&bits, &_value, sizeof(bits));
+
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = int32_t((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x007fffff;
+
+    if (exponent <= 0)
+        return GLushort(sign);
+    if (exponent >= 31)
+        return GLushort(sign | 0x7c00);
+    return GLushort(sign | (exponent << 10) | (mantissa >> 13));
+}
+
+template<typename T>
+static void quantize(GLubyte*& _dst, const float* _values, size_t _total, float _max) {
+    for (size_t i = 0; i < _total; i++) {
+        T q = T( std::floor(glm::clamp(_values[i], -1.0f, 1.0f) * _max + 0.5f) );
+        std::memcpy(_dst, &q, sizeof(T));
+        _dst += sizeof(T);
+    }
+}
+
+void MeshVbo::load(const vera::Mesh& _mesh, bool _compact, const vera::BoundingBox* _bounds) {
+    clear();
+
+    switch (_mesh.getDrawMode()) {
+        case vera::POINTS:          m_drawMode = GL_POINTS; break;
+        case vera::LINES:           m_drawMode = GL_LINES; break;
+        case vera::LINE_STRIP:      m_drawMode = GL_LINE_STRIP; break;
+        case vera::LINE_LOOP:       m_drawMode = GL_LINE_LOOP; break;
+        case vera::TRIANGLE_STRIP:  m_drawMode = GL_TRIANGLE_STRIP; break;
+        case vera::TRIANGLE_FAN:    m_drawMode = GL_TRIANGLE_FAN; break;
+        default:                    m_drawMode = GL_TRIANGLES; break;
+    }
+
+    m_verticesTotal = _mesh.getVertices().size();
+    m_compact = _compact;
+
+    bool haveColors = _mesh.haveColors() && _mesh.getColors().size() == (size_t)m_verticesTotal;
+    bool haveNormals = _mesh.haveNormals() && _mesh.getNormals().size() == (size_t)m_verticesTotal;
+    bool haveTexCoords = _mesh.haveTexCoords() && _mesh.getTexCoords().size() == (size_t)m_verticesTotal;
+    bool haveTangents = _mesh.haveTangents() && _mesh.getTangents().size() == (size_t)m_verticesTotal;
+
+    // Half float attributes are core on GL 3.x and GLES 3.0
+    bool halfTexCoords = false;
+#if defined(GL_HALF_FLOAT) && !defined(PLATFORM_RPI)
+    halfTexCoords = m_compact && vera::getVersion() >= 130;
+#endif
+
+    // Positions are stored in [-1,1] relative to the center of the bounds. A uniform scale keeps 
+    // the decode matrix from skewing the normals of shaders that transform them by u_modelMatrix
+    glm::vec3 center = glm::vec3(0.0f);
+    float scale = 1.0f;
+    if (m_compact) {
+        vera::BoundingBox bbox;
+        if (_bounds)
+            bbox = *_bounds;
+        else {
+            bbox.min = glm::vec3(std::numeric_limits<float>::max());
+            bbox.max = glm::vec3(-std::numeric_limits<float>::max());
+            for (GLsizei i = 0; i < m_verticesTotal; i++) {
+                bbox.min = glm::min(bbox.min, _mesh.getVertices()[i]);
+                bbox.max = glm::max(bbox.max, _mesh.getVertices()[i]);
+            }
+        }
+
+        center = (bbox.min + bbox.max) * 0.5f;
+        glm::vec3 extent = (bbox.max - bbox.min) * 0.5f;
+        scale = std::max(extent.x, std::max(extent.y, extent.z));
+        if (!(scale > 0.0f))
+            scale = 1.0f;
+    }
+    m_decode = glm::mat4(   scale, 0.0f, 0.0f, 0.0f,
+                            0.0f, scale, 0.0f, 0.0f,
+                            0.0f, 0.0f, scale, 0.0f,
+                            center.x, center.y, center.z, 1.0f );
+
+    // Layout
+    size_t offset = 0;
+    if (m_compact) {
+        // Every attribute stays 4 bytes aligned
+        m_attributes.push_back( {"a_position", 3, GL_SHORT, GL_TRUE, offset} );
+        offset += sizeof(GLshort) * 4;
+
+        if (haveColors) {
+            m_attributes.push_back( {"a_color", 4, GL_UNSIGNED_BYTE, GL_TRUE, offset} );
+            offset += sizeof(GLubyte) * 4;
+        }
+
+        if (haveNormals) {
+            m_attributes.push_back( {"a_normal", 3, GL_BYTE, GL_TRUE, offset} );
+            offset += sizeof(GLbyte) * 4;
+        }
+
+        if (haveTexCoords) {
+#if defined(GL_HALF_FLOAT)
+            if (halfTexCoords) {
+                m_attributes.push_back( {"a_texcoord", 2, GL_HALF_FLOAT, GL_FALSE, offset} );
+                offset += sizeof(GLushort) * 2;
+            }
+            else
+#endif
+            {
+                m_attributes.push_back( {"a_texcoord", 2, GL_FLOAT, GL_FALSE, offset} );
+                offset += sizeof(glm::vec2);
+            }
+        }
+
+        if (haveTangents) {
+            m_attributes.push_back( {"a_tangent", 4, GL_BYTE, GL_TRUE, offset} );
+            offset += sizeof(GLbyte) * 4;
+        }
+    }
+    else {
+        m_attributes.push_back( {"a_position", 3, GL_FLOAT, GL_FALSE, offset} );
+        offset += sizeof(glm::vec3);
+
+        if (haveColors) {
+            m_attributes.push_back( {"a_color", 4, GL_FLOAT, GL_FALSE, offset} );
+            offset += sizeof(glm::vec4);
+        }
+
+        if (haveNormals) {
+            m_attributes.push_back( {"a_normal", 3, GL_FLOAT, GL_FALSE, offset} );
+            offset += sizeof(glm::vec3);
+        }
+
+        if (haveTexCoords) {
+            m_attributes.push_back( {"a_texcoord", 2, GL_FLOAT, GL_FALSE, offset} );
+            offset += sizeof(glm::vec2);
+        }
+
+        if (haveTangents) {
+            m_attributes.push_back( {"a_tangent", 4, GL_FLOAT, GL_FALSE, offset} );
+            offset += sizeof(glm::vec4);
+        }
+    }
+
+    m_stride = offset;
+
+    // Interleave
+    m_vertexData.resize(m_stride * m_verticesTotal);
+    GLubyte* dst = m_vertexData.data();
+    for (GLsizei i = 0; i < m_verticesTotal; i++) {
+        if (m_compact) {
+            glm::vec4 p = glm::vec4( (_mesh.getVertices()[i] - center) / scale, 0.0f );
+            quantize<GLshort>(dst, &p[0], 4, 32767.0f);
+
+            if (haveColors) {
+                const glm::vec4& c = _mesh.getColors()[i];
+                for (int j = 0; j < 4; j++)
+                    *dst++ = GLubyte( std::floor(glm::clamp(c[j], 0.0f, 1.0f) * 255.0f + 0.5f) );
+            }
+
+            if (haveNormals) {
+                glm::vec4 n = glm::vec4( _mesh.getNormals()[i], 0.0f );
+                float l = glm::length(n);
+                if (l > 0.0f)
+                    n /= l;
+                quantize<GLbyte>(dst, &n[0], 4, 127.0f);
+            }
+
+            if (haveTexCoords) {
+                const glm::vec2& t = _mesh.getTexCoords()[i];
+                if (halfTexCoords) {
+                    GLushort h[2] = { toHalf(t.x), toHalf(t.y) };
+                    std::memcpy(dst, h, sizeof(h));
+                    dst += sizeof(h);
+                }
+                else {
+                    std::memcpy(dst, &t, sizeof(glm::vec2));
+                    dst += sizeof(glm::vec2);
+                }
+            }
+
+            if (haveTangents) {
+                glm::vec4 t = _mesh.getTangents()[i];
+                glm::vec3 xyz = glm::vec3(t);
+                float l = glm::length(xyz);
+                if (l > 0.0f)
+                    xyz /= l;
+                t = glm::vec4(xyz, (t.w < 0.0f)? -1.0f : 1.0f);
+                quantize<GLbyte>(dst, &t[0], 4, 127.0f);
+            }
+            continue;
+        }
+
+        std::memcpy(dst, &_mesh.getVertices()[i], sizeof(glm::vec3));
+        dst += sizeof(glm::vec3);
+
+        if (haveColors) {
+            std::memcpy(dst, &_mesh.getColors()[i], sizeof(glm::vec4));
+            dst += sizeof(glm::vec4);
+        }
+
+        if (haveNormals) {
+            std::memcpy(dst, &_mesh.getNormals()[i], sizeof(glm::vec3));
+            dst += sizeof(glm::vec3);
+        }
+
+        if (haveTexCoords) {
+            std::memcpy(dst, &_mesh.getTexCoords()[i], sizeof(glm::vec2));
+            dst += sizeof(glm::vec2);
+        }
+
+        if (haveTangents) {
+            std::memcpy(dst, &_mesh.getTangents()[i], sizeof(glm::vec4));
+            dst += sizeof(glm::vec4);
+        }
+    }
+
+    if (_mesh.haveIndices()) {
+        const std::vector<vera::INDEX_TYPE>& indices = _mesh.getIndices();
+        m_indicesTotal = indices.size();
+
+        if (m_compact && m_verticesTotal <= 65536) {
+            m_indexType = GL_UNSIGNED_SHORT;
+            m_indexData.resize(m_indicesTotal * sizeof(GLushort));
+            GLushort* idx = (GLushort*)m_indexData.data();
+            for (size_t i = 0; i < indices.size(); i++)
+                idx[i] = GLushort(indices[i]);
+        }
+        else {
+            m_indexType = GL_UNSIGNED_INT;
+            m_indexData.resize(m_indicesTotal * sizeof(GLuint));
+            GLuint* idx = (GLuint*)m_indexData.data();
+            for (size_t i = 0; i < indices.size(); i++)
+                idx[i] = GLuint(indices[i]);
+        }
+    }
+
+    m_bytesTotal = m_vertexData.size() + m_indexData.size();
+}
+
+void MeshVbo::setInstances(const std::vector<glm::mat4>& _transforms) {
+    m_instanceData = _transforms;
+
+    // Compact positions are decoded as part of each instance transform
+    if (m_compact)
+        for (size_t i = 0; i < m_instanceData.size(); i++)
+            m_instanceData[i] = m_instanceData[i] * m_decode;
+
+    m_instancesTotal = _transforms.size();
+    m_instancesChanged = true;
+}
+
+void MeshVbo::upload() {
+    if (m_vertexBuffer == 0)
+        glGenBuffers(1, &m_vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, m_vertexData.size(), m_vertexData.data(), GL_STATIC_DRAW);
+
+    if (m_indicesTotal > 0) {
+        if (m_indexBuffer == 0)
+            glGenBuffers(1, &m_indexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_indexData.size(), m_indexData.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Data lives on the GPU now
+    m_vertexData.clear();
+    m_vertexData.shrink_to_fit();
+    m_indexData.clear();
+    m_indexData.shrink_to_fit();
+
+    m_uploaded = true;
+}
+
+void MeshVbo::render(vera::Shader* _shader) {
+    if (m_verticesTotal == 0)
+        return;
+
+    if (!m_uploaded)
+        upload();
+
+    const std::vector<GLint>& locations = getLocations(_shader->getProgram());
+    std::vector<GLint> enabled;
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+    for (size_t i = 0; i < m_attributes.size(); i++) {
+        GLint location = locations[i];
+        if (location < 0)
+            continue;
+
+        glEnableVertexAttribArray(location);
+        glVertexAttribPointer(location, m_attributes[i].size, m_attributes[i].type, m_attributes[i].normalized, m_stride, (void*)m_attributes[i].offset);
+        enabled.push_back(location);
+    }
+
+    GLint instanceLocation = -1;
+#if !defined(PLATFORM_RPI)
+    if (m_instancesTotal > 0 && supportsInstancing()) {
+        instanceLocation = locations[m_attributes.size()];
+
+        if (instanceLocation >= 0) {
+            if (m_instanceBuffer == 0)
+                glGenBuffers(1, &m_instanceBuffer);
+            glBindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+
+            if (m_instancesChanged) {
+                // Grow only when needed, otherwise update in place
+                size_t size = m_instanceData.size() * sizeof(glm::mat4);
+                if (m_instanceData.size() > m_instancesCapacity) {
+                    glBufferData(GL_ARRAY_BUFFER, size, m_instanceData.data(), GL_DYNAMIC_DRAW);
+                    m_instancesCapacity = m_instanceData.size();
+                }
+                else
+                    glBufferSubData(GL_ARRAY_BUFFER, 0, size, m_instanceData.data());
+                m_instancesChanged = false;
+            }
+
+            // a mat4 attribute takes four consecutive locations
+            for (GLint c = 0; c < 4; c++) {
+                glEnableVertexAttribArray(instanceLocation + c);
+                glVertexAttribPointer(instanceLocation + c, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(sizeof(glm::vec4) * c));
+                glVertexAttribDivisor(instanceLocation + c, 1);
+            }
+        }
+    }
+#endif
+
+    if (m_indicesTotal > 0)
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+
+#if !defined(PLATFORM_RPI)
+    if (instanceLocation >= 0) {
+        if (m_indicesTotal > 0)
+            glDrawElementsInstanced(m_drawMode, m_indicesTotal, m_indexType, 0, m_instancesTotal);
+        else
+            glDrawArraysInstanced(m_drawMode, 0, m_verticesTotal, m_instancesTotal);
+
+        for (GLint c = 0; c < 4; c++) {
+            glVertexAttribDivisor(instanceLocation + c, 0);
+            glDisableVertexAttribArray(instanceLocation + c);
+        }
+    }
+    else
+#endif
+    {
+        if (m_indicesTotal > 0)
+            glDrawElements(m_drawMode, m_indicesTotal, m_indexType, 0);
+        else
+            glDrawArrays(m_drawMode, 0, m_verticesTotal);
+    }
+
+    for (size_t i = 0; i < enabled.size(); i++)
+        glDisableVertexAttribArray(enabled[i]);
+
+    if (m_indicesTotal > 0)
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+const std::vector<GLint>& MeshVbo::getLocations(GLuint _program) {
+    if (m_locationsGeneration != s_programsGeneration) {
+        m_locations.clear();
+        m_locationsGeneration = s_programsGeneration;
+    }
+
+    std::map<GLuint, std::vector<GLint> >::iterator it = m_locations.find(_program);
+    if (it != m_locations.end())
+        return it->second;
+
+    std::vector<GLint>& locations = m_locations[_program];
+    locations.resize(m_attributes.size() + 1);
+    for (size_t i = 0; i < m_attributes.size(); i++)
+        locations[i] = glGetAttribLocation(_program, m_attributes[i].name.c_str());
+    locations[m_attributes.size()] = glGetAttribLocation(_program, "a_instanceMatrix");
+    return locations;
+}
+
+void MeshVbo::clear() {
+    if (m_vertexBuffer)
+        glDeleteBuffers(1, &m_vertexBuffer);
+    if (m_indexBuffer)
+        glDeleteBuffers(1, &m_indexBuffer);
+    if (m_instanceBuffer)
+        glDeleteBuffers(1, &m_instanceBuffer);
+
+    m_vertexBuffer = m_indexBuffer = m_instanceBuffer = 0;
+    m_attributes.clear();
+    m_locations.clear();
+    m_vertexData.clear();
+    m_indexData.clear();
+    m_instanceData.clear();
+    m_stride = m_verticesTotal = m_indicesTotal = m_instancesTotal = 0;
+    m_instancesCapacity = m_bytesTotal = 0;
+    m_indexType = GL_UNSIGNED_INT;
+    m_decode = glm::mat4(1.0f);
+    m_compact = false;
+    m_uploaded = false;
+    m_instancesChanged = false;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <string>
+
+#include "vera/gl/gl.h"
+#include "vera/gl/shader.h"
+#include "vera/types/mesh.h"
+#include "vera/types/boundingBox.h"
+
+#include "glm/glm.hpp"
+
+// Interleaved VBO built from a vera::Mesh that binds its attributes by name (a_position,
+// a_color, a_normal, a_texcoord, a_tangent) on the shader it renders with. When instances
+// transforms are set it draws all of them in one call feeding a_instanceMatrix per instance.
+//
+// The compact layout quantizes positions to snorm16 inside _bounds (the mesh bounds by default),
+// normals and tangents to snorm8, texcoords to half floats and colors to unorm8, and uses 16bits
+// indices when they fit. All of them are expanded by the vertex fetch, except positions which
+// have to be brought back to model space multiplying them by getDecodeMatrix()
+class MeshVbo {
+public:
+    MeshVbo();
+    MeshVbo(const vera::Mesh& _mesh, bool _compact = false, const vera::BoundingBox* _bounds = nullptr);
+    virtual ~MeshVbo();
+
+    void    load(const vera::Mesh& _mesh, bool _compact = false, const vera::BoundingBox* _bounds = nullptr);
+    void    setInstances(const std::vector<glm::mat4>& _transforms);
+    void    render(vera::Shader* _shader);
+    void    clear();
+
+    size_t  getVerticesTotal() const { return m_verticesTotal; }
+    size_t  getIndicesTotal() const { return m_indicesTotal; }
+    size_t  getInstancesTotal() const { return m_instancesTotal; }
+    size_t  getBytesTotal() const { return m_bytesTotal; }
+
+    bool    isCompact() const { return m_compact; }
+    const glm::mat4& getDecodeMatrix() const { return m_decode; }
+
+    static bool supportsInstancing();
+
+    // Attribute locations are kept per program. Call it after compiling programs again, their ids can be reused
+    static void programsChanged();
+
+protected:
+    struct Attribute {
+        std::string name;
+        GLint       size;
+        GLenum      type;
+        GLboolean   normalized;
+        size_t      offset;
+    };
+
+    void                    upload();
+    const std::vector<GLint>& getLocations(GLuint _program);
+
+    std::vector<Attribute>  m_attributes;
+    std::map<GLuint, std::vector<GLint> > m_locations;     // of m_attributes and a_instanceMatrix, by program
+    size_t                  m_locationsGeneration;
+    std::vector<GLubyte>    m_vertexData;
+    std::vector<GLubyte>    m_indexData;
+    std::vector<glm::mat4>  m_instanceData;
+    glm::mat4               m_decode;
+
+    GLuint                  m_vertexBuffer;
+    GLuint                  m_indexBuffer;
+    GLuint                  m_instanceBuffer;
+
+    GLenum                  m_drawMode;
+    GLenum                  m_indexType;
+    GLsizei                 m_stride;
+    GLsizei                 m_verticesTotal;
+    GLsizei                 m_indicesTotal;
+    GLsizei                 m_instancesTotal;
+    size_t                  m_instancesCapacity;
+    size_t                  m_bytesTotal;
+
+    bool                    m_compact;
+    bool                    m_uploaded;
+    bool                    m_instancesChanged;
+};
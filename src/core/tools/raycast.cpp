@@ -0,0 +1,272 @@
+#include "raycast.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#define RAYCAST_BINS        12
+#define RAYCAST_LEAF_MIN    4
+#define RAYCAST_LEAF_MAX    16
+#define RAYCAST_STACK       64
+
+static float surfaceArea(const glm::vec3& _min, const glm::vec3& _max) {
+    glm::vec3 e = glm::max(_max - _min, glm::vec3(0.0f));
+    return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+RaycastBvh::RaycastBvh() {
+}
+
+void RaycastBvh::build(const vera::Mesh& _mesh) {
+    m_nodes.clear();
+    m_triangles.clear();
+
+    if (_mesh.getDrawMode() != vera::TRIANGLES)
+        return;
+
+    const std::vector<glm::vec3>& vertices = _mesh.getVertices();
+    const std::vector<glm::vec3>& normals = _mesh.getNormals();
+    bool indexed = _mesh.haveIndices();
+    size_t total = indexed ? _mesh.getIndices().size() / 3 : vertices.size() / 3;
+    bool smooth = _mesh.haveNormals() && normals.size() == vertices.size();
+    if (total == 0)
+        return;
+
+    std::vector<Triangle> triangles(total);
+    std::vector<glm::vec3> centroids(total), mins(total), maxs(total);
+    for (size_t i = 0; i < total; i++) {
+        size_t a = 3 * i, b = 3 * i + 1, c = 3 * i + 2;
+        if (indexed) {
+            a = _mesh.getIndices()[a];
+            b = _mesh.getIndices()[b];
+            c = _mesh.getIndices()[c];
+        }
+
+        Triangle& tri = triangles[i];
+        tri.v0 = vertices[a];
+        tri.e1 = vertices[b] - vertices[a];
+        tri.e2 = vertices[c] - vertices[a];
+        if (smooth) {
+            tri.n0 = normals[a];
+            tri.n1 = normals[b];
+            tri.n2 = normals[c];
+        }
+        else {
+            glm::vec3 n = glm::cross(tri.e1, tri.e2);
+            float l = glm::length(n);
+            tri.n0 = tri.n1 = tri.n2 = l > 0.0f ? n / l : glm::vec3(0.0f, 1.0f, 0.0f);
+        }
+
+        mins[i] = glm::min(vertices[a], glm::min(vertices[b], vertices[c]));
+        maxs[i] = glm::max(vertices[a], glm::max(vertices[b], vertices[c]));
+        centroids[i] = (vertices[a] + vertices[b] + vertices[c]) / 3.0f;
+    }
+
+    std::vector<uint32_t> indices(total);
+    for (size_t i = 0; i < total; i++)
+        indices[i] = (uint32_t)i;
+
+    m_nodes.reserve(2 * total);
+    Node root;
+    root.start = 0;
+    root.count = (uint32_t)total;
+    m_nodes.push_back(root);
+
+    // Iterative, so deep hierarchies don't overflow the call stack
+    std::vector<uint32_t> stack(1, 0);
+    while (!stack.empty()) {
+        uint32_t node = stack.back();
+        stack.pop_back();
+
+        subdivide(node, indices, centroids, mins, maxs);
+        if (m_nodes[node].count == 0) {
+            stack.push_back(m_nodes[node].start);
+            stack.push_back(m_nodes[node].start + 1);
+        }
+    }
+
+    // Leaves point to consecutive triangles
+    m_triangles.resize(total);
+    for (size_t i = 0; i < total; i++)
+        m_triangles[i] = triangles[indices[i]];
+}
+
+void RaycastBvh::subdivide(uint32_t _node, std::vector<uint32_t>& _indices, const std::vector<glm::vec3>& _centroids, const std::vector<glm::vec3>& _mins, const std::vector<glm::vec3>& _maxs) {
+    uint32_t start = m_nodes[_node].start;
+    uint32_t count = m_nodes[_node].count;
+
+    glm::vec3 nmin(std::numeric_limits<float>::max()), nmax(-std::numeric_limits<float>::max());
+    glm::vec3 cmin = nmin, cmax = nmax;
+    for (uint32_t i = start; i < start + count; i++) {
+        nmin = glm::min(nmin, _mins[_indices[i]]);
+        nmax = glm::max(nmax, _maxs[_indices[i]]);
+        cmin = glm::min(cmin, _centroids[_indices[i]]);
+        cmax = glm::max(cmax, _centroids[_indices[i]]);
+    }
+    m_nodes[_node].min = nmin;
+    m_nodes[_node].max = nmax;
+
+    if (count <= RAYCAST_LEAF_MIN)
+        return;
+
+    // Bin the centroids on each axis and keep the cheapest plane between bins
+    int bestAxis = -1;
+    int bestSplit = 0;
+    float bestCost = count * surfaceArea(nmin, nmax);
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = cmax[axis] - cmin[axis];
+        if (extent <= 0.0f)
+            continue;
+
+        uint32_t    binCount[RAYCAST_BINS] = { 0 };
+        glm::vec3   binMin[RAYCAST_BINS], binMax[RAYCAST_BINS];
+        for (int b = 0; b < RAYCAST_BINS; b++) {
+            binMin[b] = glm::vec3(std::numeric_limits<float>::max());
+            binMax[b] = glm::vec3(-std::numeric_limits<float>::max());
+        }
+
+        float scale = RAYCAST_BINS / extent;
+        for (uint32_t i = start; i < start + count; i++) {
+            uint32_t t = _indices[i];
+            int b = std::min(RAYCAST_BINS - 1, (int)((_centroids[t][axis] - cmin[axis]) * scale));
+            binCount[b]++;
+            binMin[b] = glm::min(binMin[b], _mins[t]);
+            binMax[b] = glm::max(binMax[b], _maxs[t]);
+        }
+
+        // Areas and counts of everything left of each plane, then sweep from the right
+        float       leftArea[RAYCAST_BINS - 1];
+        uint32_t    leftCount[RAYCAST_BINS - 1];
+        glm::vec3   lmin(std::numeric_limits<float>::max()), lmax(-std::numeric_limits<float>::max());
+        uint32_t    lcount = 0;
+        for (int b = 0; b < RAYCAST_BINS - 1; b++) {
+            lcount += binCount[b];
+            lmin = glm::min(lmin, binMin[b]);
+            lmax = glm::max(lmax, binMax[b]);
+            leftCount[b] = lcount;
+            leftArea[b] = surfaceArea(lmin, lmax);
+        }
+
+        glm::vec3   rmin(std::numeric_limits<float>::max()), rmax(-std::numeric_limits<float>::max());
+        uint32_t    rcount = 0;
+        for (int b = RAYCAST_BINS - 1; b > 0; b--) {
+            rcount += binCount[b];
+            rmin = glm::min(rmin, binMin[b]);
+            rmax = glm::max(rmax, binMax[b]);
+            if (leftCount[b - 1] == 0 || rcount == 0)
+                continue;
+
+            float cost = leftCount[b - 1] * leftArea[b - 1] + rcount * surfaceArea(rmin, rmax);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    // Not worth splitting, unless the leaf would get too big to walk
+    if (bestAxis == -1) {
+        if (count <= RAYCAST_LEAF_MAX)
+            return;
+
+        // Equal centroids or no cheaper plane: halve along the longest axis of the centroids
+        glm::vec3 extent = cmax - cmin;
+        bestAxis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+        std::nth_element(_indices.begin() + start, _indices.begin() + start + count / 2, _indices.begin() + start + count,
+                        [&](uint32_t _a, uint32_t _b) { return _centroids[_a][bestAxis] < _centroids[_b][bestAxis]; });
+        bestSplit = -1;
+    }
+
+    uint32_t middle = start + count / 2;
+    if (bestSplit >= 0) {
+        float scale = RAYCAST_BINS / (cmax[bestAxis] - cmin[bestAxis]);
+        uint32_t* first = &_indices[start];
+        uint32_t* last = first + count;
+        uint32_t* mid = std::partition(first, last, [&](uint32_t _t) {
+            return std::min(RAYCAST_BINS - 1, (int)((_centroids[_t][bestAxis] - cmin[bestAxis]) * scale)) < bestSplit;
+        });
+        middle = start + (uint32_t)(mid - first);
+    }
+
+    uint32_t left = (uint32_t)m_nodes.size();
+    Node child;
+    child.start = start;
+    child.count = middle - start;
+    m_nodes.push_back(child);
+    child.start = middle;
+    child.count = start + count - middle;
+    m_nodes.push_back(child);
+
+    m_nodes[_node].start = left;
+    m_nodes[_node].count = 0;
+}
+
+bool RaycastBvh::intersect(const glm::vec3& _origin, const glm::vec3& _direction, float& _t, glm::vec3& _normal) const {
+    if (m_nodes.empty())
+        return false;
+
+    glm::vec3 inv = glm::vec3(1.0f) / _direction;
+    bool hit = false;
+
+    // Unbalanced trees can go deeper than usual, the stack grows with them
+    std::vector<uint32_t> stack;
+    stack.reserve(RAYCAST_STACK);
+    stack.push_back(0);
+    while (!stack.empty()) {
+        const Node& node = m_nodes[stack.back()];
+        stack.pop_back();
+
+        // Slabs
+        glm::vec3 t0 = (node.min - _origin) * inv;
+        glm::vec3 t1 = (node.max - _origin) * inv;
+        glm::vec3 tmin = glm::min(t0, t1);
+        glm::vec3 tmax = glm::max(t0, t1);
+        float enter = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.0f));
+        float exit = std::min(std::min(tmax.x, tmax.y), std::min(tmax.z, _t));
+        if (enter > exit)
+            continue;
+
+        if (node.count == 0) {
+            // Both children go on the stack, the one closer along the ray on top
+            uint32_t nearer = node.start, farther = node.start + 1;
+            const Node& a = m_nodes[nearer];
+            const Node& b = m_nodes[farther];
+            if (glm::dot((a.min + a.max) - (b.min + b.max), _direction) > 0.0f)
+                std::swap(nearer, farther);
+            stack.push_back(farther);
+            stack.push_back(nearer);
+            continue;
+        }
+
+        // Möller–Trumbore
+        for (uint32_t i = node.start; i < node.start + node.count; i++) {
+            const Triangle& tri = m_triangles[i];
+            glm::vec3 p = glm::cross(_direction, tri.e2);
+            float det = glm::dot(tri.e1, p);
+            if (std::fabs(det) < 1e-12f)
+                continue;
+
+            float invDet = 1.0f / det;
+            glm::vec3 s = _origin - tri.v0;
+            float u = glm::dot(s, p) * invDet;
+            if (u < 0.0f || u > 1.0f)
+                continue;
+
+            glm::vec3 q = glm::cross(s, tri.e1);
+            float v = glm::dot(_direction, q) * invDet;
+            if (v < 0.0f || u + v > 1.0f)
+                continue;
+
+            float t = glm::dot(tri.e2, q) * invDet;
+            if (t <= 0.0f || t >= _t)
+                continue;
+
+            _t = t;
+            _normal = tri.n0 * (1.0f - u - v) + tri.n1 * u + tri.n2 * v;
+            hit = true;
+        }
+    }
+
+    return hit;
+}
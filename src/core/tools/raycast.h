@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "vera/types/mesh.h"
+
+#include "glm/glm.hpp"
+
+// Closest surface hit by a ray, in world space
+struct RaycastHit {
+    std::string     model;
+    glm::vec3       position;
+    glm::vec3       normal;
+    float           distance;       // from the camera
+    float           microseconds;   // spent on the query
+};
+
+// Bounding volume hierarchy over the triangles of a mesh, in model space, split with a binned
+// surface area heuristic. Transforms are applied to the ray instead, so moving a model never
+// needs a rebuild
+class RaycastBvh {
+public:
+    RaycastBvh();
+
+    void        build(const vera::Mesh& _mesh);
+    bool        empty() const { return m_nodes.empty(); }
+
+    // _direction doesn't need to be normalized, _t is measured in its units and only hits closer
+    // than its value on entry are reported
+    bool        intersect(const glm::vec3& _origin, const glm::vec3& _direction, float& _t, glm::vec3& _normal) const;
+
+    size_t      getTrianglesTotal() const { return m_triangles.size(); }
+
+protected:
+    struct Node {
+        glm::vec3   min;
+        uint32_t    start;          // first triangle of a leaf, or left child (right is next to it)
+        glm::vec3   max;
+        uint32_t    count;          // 0 for inner nodes
+    };
+
+    struct Triangle {
+        glm::vec3   v0, e1, e2;     // first vertex and the edges to the other two
+        glm::vec3   n0, n1, n2;     // vertex normals, or the face one on all three
+    };
+
+    void        subdivide(uint32_t _node, std::vector<uint32_t>& _indices, const std::vector<glm::vec3>& _centroids, const std::vector<glm::vec3>& _mins, const std::vector<glm::vec3>& _maxs);
+
+    std::vector<Node>       m_nodes;
+    std::vector<Triangle>   m_triangles;
+};
@@ -0,0 +1,134 @@
+#include "sdf.h"
+
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+
+#if defined(SUPPORT_ZSTD)
+#include <zstd.h>
+#endif
+
+#include "vera/ops/image.h"
+
+void toSdfLayers(   vera::BVH* _acc, uint32_t _resolution, std::vector<vera::Image>& _layers, 
+                    const std::function<void(float)>& _progress) {
+    _layers.resize(_resolution);
+
+    std::atomic<uint32_t> next(0);
+    std::atomic<uint32_t> done(0);
+    auto work = [&](bool _report) {
+        for (uint32_t z = next++; z < _resolution; z = next++) {
+            _layers[z] = vera::toSdfLayer(_acc, _resolution, z);
+            done++;
+
+            if (_report && _progress)
+                _progress( float(done) / float(_resolution) );
+        }
+    };
+
+#if defined(SUPPORT_MULTITHREAD_RECORDING)
+    uint32_t total = std::max(1u, std::thread::hardware_concurrency());
+    total = std::min(total, _resolution);
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < total; i++)
+        workers.push_back( std::thread(work, false) );
+
+    // This thread takes slices too, and reports the progress
+    work(true);
+
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+#else
+    work(true);
+#endif
+
+    if (_progress)
+        _progress(1.0f);
+}
+
+static const uint32_t SDF_CACHE_MAGIC = 0x46445347;    // "GSDF"
+static const uint32_t SDF_CACHE_VERSION = 1;
+static const uint32_t SDF_CACHE_ZSTD = 1;
+
+bool saveSdfCache(const std::string& _filename, const vera::Image& _sprite, uint32_t _voxels) {
+    if (!_sprite.isAllocated())
+        return false;
+
+    const char* data = (const char*)_sprite.getData();
+    size_t bytes = size_t(_sprite.getWidth()) * _sprite.getHeight() * _sprite.getChannels() * sizeof(float);
+    uint32_t flags = 0;
+
+#if defined(SUPPORT_ZSTD)
+    std::vector<char> compressed( ZSTD_compressBound(bytes) );
+    size_t size = ZSTD_compress(compressed.data(), compressed.size(), data, bytes, 3);
+    if (!ZSTD_isError(size)) {
+        compressed.resize(size);
+        data = compressed.data();
+        bytes = size;
+        flags |= SDF_CACHE_ZSTD;
+    }
+#endif
+
+    std::ofstream out(_filename, std::ios::binary);
+    if (!out.is_open())
+        return false;
+
+    uint32_t header[8] = {  SDF_CACHE_MAGIC, SDF_CACHE_VERSION, flags, _voxels, 
+                            (uint32_t)_sprite.getWidth(), (uint32_t)_sprite.getHeight(), (uint32_t)_sprite.getChannels(), 
+                            (uint32_t)bytes };
+    out.write((const char*)header, sizeof(header));
+    out.write(data, bytes);
+
+    return out.good();
+}
+
+bool loadSdfCache(const std::string& _filename, vera::Image& _sprite, uint32_t& _voxels) {
+    std::ifstream in(_filename, std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    uint32_t header[8];
+    in.read((char*)header, sizeof(header));
+    if (!in.good() || header[0] != SDF_CACHE_MAGIC || header[1] != SDF_CACHE_VERSION)
+        return false;
+
+    uint32_t flags = header[2];
+    uint32_t width = header[4];
+    uint32_t height = header[5];
+    uint32_t channels = header[6];
+    size_t bytes = size_t(width) * height * channels * sizeof(float);
+
+    vera::Image sprite;
+    if (!sprite.allocate(width, height, channels))
+        return false;
+
+    if (flags & SDF_CACHE_ZSTD) {
+#if defined(SUPPORT_ZSTD)
+        std::vector<char> compressed( header[7] );
+        in.read(compressed.data(), compressed.size());
+        if (!in.good())
+            return false;
+
+        size_t size = ZSTD_decompress(sprite.getData(), bytes, compressed.data(), compressed.size());
+        if (ZSTD_isError(size) || size != bytes)
+            return false;
+#else
+        // Written by a build with zstd, this one can't read it
+        return false;
+#endif
+    }
+    else {
+        if (header[7] != bytes)
+            return false;
+
+        in.read((char*)sprite.getData(), bytes);
+        if (!in.good())
+            return false;
+    }
+
+    _sprite = sprite;
+    _voxels = header[3];
+    return true;
+}
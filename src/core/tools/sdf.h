@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+#include "vera/types/bvh.h"
+#include "vera/types/image.h"
+
+// Fills _layers with the _resolution Z slices of the distance field of _acc (see vera::toSdfLayer).
+// Worker threads take the next pending slice as soon as they are free, so slices that cross the 
+// surface and take longer don't hold the rest back. All of them share the BVH, which is only read.
+// _progress is called from the calling thread with the fraction of slices done
+void toSdfLayers(   vera::BVH* _acc, uint32_t _resolution, std::vector<vera::Image>& _layers, 
+                    const std::function<void(float)>& _progress = nullptr);
+
+// Sprite packed distance field kept on disk between sessions, with the voxels per side it packs.
+// The floats follow a fixed 32 bytes header, so the file can be mapped as it is, unless it's built
+// with SUPPORT_ZSTD, in which case they are compressed
+bool saveSdfCache(const std::string& _filename, const vera::Image& _sprite, uint32_t _voxels);
+bool loadSdfCache(const std::string& _filename, vera::Image& _sprite, uint32_t& _voxels);
@@ -0,0 +1,329 @@
+#include "sdfFlood.h"
+
+#include <cmath>
+#include <iostream>
+#include <algorithm>
+
+#include "meshVbo.h"
+#include "text.h"
+
+#include "vera/window.h"
+#include "vera/shaders/defaultShaders.h"
+#include "vera/gl/gl.h"
+#include "vera/ops/draw.h"
+
+namespace {
+
+// Voxel <-> sprite texel conversions shared by the passes
+const std::string spriteFunctions =
+    "uniform float u_voxels;\n"
+    "uniform float u_columns;\n\n"
+    "vec3 toVoxel(vec2 _fragCoord) {\n"
+    "    vec2 texel = floor(_fragCoord);\n"
+    "    vec2 tile = floor(texel / u_voxels);\n"
+    "    return vec3(texel - tile * u_voxels, tile.y * u_columns + tile.x);\n"
+    "}\n\n"
+    "vec2 toUv(vec3 _voxel) {\n"
+    "    vec2 tile = vec2(mod(_voxel.z, u_columns), floor(_voxel.z / u_columns));\n"
+    "    return (tile * u_voxels + _voxel.xy + 0.5) / (u_voxels * u_columns);\n"
+    "}\n\n";
+
+}
+
+SdfFlood::SdfFlood() : m_resolution(0), m_columns(0), m_loaded(false) {
+}
+
+SdfFlood::~SdfFlood() {
+}
+
+bool SdfFlood::supported() {
+#if defined(PLATFORM_RPI)
+    return false;
+#else
+    return vera::getVersion() >= 130;
+#endif
+}
+
+// Side of the square sprite that holds _resolution slices of _resolution^2 voxels
+static uint64_t spriteWidth(uint32_t _resolution) {
+    uint64_t columns = (uint64_t)std::ceil( std::sqrt( (float)_resolution ) );
+    return columns * _resolution;
+}
+
+uint32_t SdfFlood::getMaxResolution() {
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+
+    uint32_t resolution = 2;
+    while (true) {
+        uint32_t next = resolution * 2;
+        uint64_t width = spriteWidth(next);
+        if (width > (uint64_t)maxSize || 4ull * width * width * 4ull * sizeof(float) > SDF_FLOOD_MEMORY_MAX)
+            break;
+        resolution = next;
+    }
+    return resolution;
+}
+
+bool SdfFlood::loadShaders() {
+    std::string vert = getGlslHeader(true);
+    std::string frag = getGlslHeader(false);
+    std::string billboard = vera::getDefaultSrc(vera::VERT_BILLBOARD);
+
+    // Each surface point lands on the voxel it falls in, on the tile of its slice
+    std::string seedVert = vert +
+        "ATTRIBUTE vec4 a_position;\n"
+        "VARYING vec3 v_seed;\n" +
+        spriteFunctions +
+        "void main(void) {\n"
+        "    v_seed = a_position.xyz;\n"
+        "    vec3 voxel = clamp(floor(a_position.xyz * u_voxels), 0.0, u_voxels - 1.0);\n"
+        "    vec2 tile = vec2(mod(voxel.z, u_columns), floor(voxel.z / u_columns));\n"
+        "    vec2 texel = tile * u_voxels + voxel.xy + 0.5;\n"
+        "    gl_Position = vec4(texel / (u_voxels * u_columns) * 2.0 - 1.0, 0.0, 1.0);\n"
+        "    gl_PointSize = 1.0;\n"
+        "}\n";
+
+    std::string seedFrag = frag +
+        "VARYING vec3 v_seed;\n"
+        "void main(void) {\n"
+        "    fragColor = vec4(v_seed, 1.0);\n"
+        "}\n";
+
+    // Only the surface between the voxel centers of the slice and the end of the volume is
+    // kept, each fragment is one crossing of the ray going towards +Z
+    std::string parityVert = vert +
+        "ATTRIBUTE vec4 a_position;\n"
+        "uniform float u_depth;\n"
+        "void main(void) {\n"
+        "    float z = (a_position.z - u_depth) / (2.0 - u_depth) * 2.0 - 1.0;\n"
+        "    gl_Position = vec4(a_position.xy * 2.0 - 1.0, z, 1.0);\n"
+        "}\n";
+
+    std::string parityFrag = frag +
+        "void main(void) {\n"
+        "    fragColor = vec4(1.0);\n"
+        "}\n";
+
+    std::string jumpFrag = frag +
+        "uniform sampler2D u_seeds;\n"
+        "uniform float u_step;\n" +
+        spriteFunctions +
+        "void main(void) {\n"
+        "    vec3 voxel = toVoxel(gl_FragCoord.xy);\n"
+        "    if (voxel.z >= u_voxels) {\n"
+        "        fragColor = vec4(0.0);\n"
+        "        return;\n"
+        "    }\n"
+        "    vec3 center = (voxel + 0.5) / u_voxels;\n"
+        "    vec4 best = vec4(0.0);\n"
+        "    float bestDist = 1e10;\n"
+        "    for (int k = -1; k <= 1; k++)\n"
+        "    for (int j = -1; j <= 1; j++)\n"
+        "    for (int i = -1; i <= 1; i++) {\n"
+        "        vec3 n = voxel + vec3(float(i), float(j), float(k)) * u_step;\n"
+        "        if (any(lessThan(n, vec3(0.0))) || any(greaterThanEqual(n, vec3(u_voxels))))\n"
+        "            continue;\n"
+        "        vec4 seed = TEXTURE(u_seeds, toUv(n));\n"
+        "        if (seed.w > 0.0) {\n"
+        "            float dist = distance(seed.xyz, center);\n"
+        "            if (dist < bestDist) {\n"
+        "                bestDist = dist;\n"
+        "                best = seed;\n"
+        "            }\n"
+        "        }\n"
+        "    }\n"
+        "    fragColor = best;\n"
+        "}\n";
+
+    std::string resolveFrag = frag +
+        "uniform sampler2D u_seeds;\n"
+        "uniform sampler2D u_parity;\n"
+        "uniform float u_size;\n" +
+        spriteFunctions +
+        "void main(void) {\n"
+        "    vec3 voxel = toVoxel(gl_FragCoord.xy);\n"
+        "    if (voxel.z >= u_voxels) {\n"
+        "        fragColor = vec4(0.0);\n"
+        "        return;\n"
+        "    }\n"
+        "    vec2 uv = toUv(voxel);\n"
+        "    vec4 seed = TEXTURE(u_seeds, uv);\n"
+        "    float dist = (seed.w > 0.0)? distance(seed.xyz, (voxel + 0.5) / u_voxels) * u_size : u_size;\n"
+        "    float crossings = floor(TEXTURE(u_parity, uv).r + 0.5);\n"
+        "    if (mod(crossings, 2.0) > 0.5)\n"
+        "        dist = -dist;\n"
+        "    fragColor = vec4(dist, dist, dist, 1.0);\n"
+        "}\n";
+
+    m_loaded =  m_seed_shader.setSource(seedFrag, seedVert) &&
+                m_parity_shader.setSource(parityFrag, parityVert) &&
+                m_jump_shader.setSource(jumpFrag, billboard) &&
+                m_resolve_shader.setSource(resolveFrag, billboard);
+
+    if (!m_loaded)
+        std::cerr << "SdfFlood: couldn't compile the jump flooding shaders" << std::endl;
+
+    return m_loaded;
+}
+
+bool SdfFlood::compute(const vera::Mesh& _mesh, const glm::vec3& _min, float _size, uint32_t _resolution) {
+    if (!supported() || _resolution == 0 || _size <= 0.0f || _mesh.getDrawMode() != vera::TRIANGLES)
+        return false;
+
+    if (!m_loaded && !loadShaders())
+        return false;
+
+    if (_resolution > getMaxResolution())
+        return false;
+
+    m_resolution = _resolution;
+    m_columns = (int)std::ceil( std::sqrt( (float)_resolution ) );
+    int width = (int)spriteWidth(_resolution);
+
+    vera::Fbo* targets[4] = { &m_seeds[0], &m_seeds[1], &m_parity, &m_result };
+    for (size_t i = 0; i < 4; i++)
+        if (!targets[i]->isAllocated() || targets[i]->getWidth() != width)
+            targets[i]->allocate(width, width, vera::COLOR_FLOAT_TEXTURE);
+
+    // Surface in volume space, where the cube goes from 0 to 1
+    const std::vector<glm::vec3>& vertices = _mesh.getVertices();
+    std::vector<glm::vec3> volume(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++)
+        volume[i] = (vertices[i] - _min) / _size;
+
+    std::vector<vera::INDEX_TYPE> indices = _mesh.getIndices();
+    if (indices.size() == 0) {
+        indices.resize(volume.size());
+        for (size_t i = 0; i < indices.size(); i++)
+            indices[i] = i;
+    }
+
+    vera::Mesh surface;
+    surface.addVertices(volume);
+    surface.addIndices(indices.data(), indices.size());
+
+    // Points on a barycentric grid at half a voxel apart, so every voxel the surface goes
+    // through gets at least one (flat triangles along Z don't rasterize, points always do)
+    vera::Mesh points;
+    points.setDrawMode(vera::POINTS);
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        const glm::vec3& a = volume[ indices[i] ];
+        const glm::vec3& b = volume[ indices[i+1] ];
+        const glm::vec3& c = volume[ indices[i+2] ];
+
+        float edge = std::max( glm::length(b - a), std::max( glm::length(c - a), glm::length(c - b) ) );
+        int n = std::max(1, (int)std::ceil(edge * _resolution * 2.0f));
+        for (int u = 0; u <= n; u++)
+            for (int v = 0; v <= n - u; v++)
+                points.addVertex( a + (b - a) * (float(u) / n) + (c - a) * (float(v) / n) );
+    }
+
+    MeshVbo surfaceVbo(surface);
+    MeshVbo pointsVbo(points);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    GLboolean cullFace = glIsEnabled(GL_CULL_FACE);
+    GLboolean blend = glIsEnabled(GL_BLEND);
+
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_BLEND);
+    #if defined(GL_PROGRAM_POINT_SIZE)
+    glEnable(GL_PROGRAM_POINT_SIZE);
+    #endif
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+
+    // 1. Seed the voxels touched by the surface with the position of the surface point
+    m_seeds[0].bind();
+    glViewport(0, 0, width, width);
+    glClear(GL_COLOR_BUFFER_BIT);
+    m_seed_shader.use();
+    m_seed_shader.setUniform("u_voxels", float(_resolution));
+    m_seed_shader.setUniform("u_columns", float(m_columns));
+    pointsVbo.render(&m_seed_shader);
+    m_seeds[0].unbind();
+
+    // 2. Count the surface crossings in front of each slice, adding one per fragment
+    m_parity.bind();
+    glViewport(0, 0, width, width);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    m_parity_shader.use();
+    for (uint32_t z = 0; z < _resolution; z++) {
+        glViewport((z % m_columns) * _resolution, (z / m_columns) * _resolution, _resolution, _resolution);
+        m_parity_shader.setUniform("u_depth", (z + 0.5f) / float(_resolution));
+        surfaceVbo.render(&m_parity_shader);
+    }
+    glDisable(GL_BLEND);
+    m_parity.unbind();
+
+    // 3. Jump flooding halving the step down to one voxel, plus an extra pass of one
+    //    that fixes most of the remaining errors (JFA+1)
+    std::vector<uint32_t> steps;
+    for (uint32_t step = _resolution / 2; step >= 1; step /= 2)
+        steps.push_back(step);
+    steps.push_back(1);
+
+    size_t src = 0;
+    for (size_t i = 0; i < steps.size(); i++) {
+        size_t dst = 1 - src;
+        m_seeds[dst].bind();
+        glViewport(0, 0, width, width);
+        m_jump_shader.use();
+        m_jump_shader.textureIndex = 0;
+        m_jump_shader.setUniform("u_voxels", float(_resolution));
+        m_jump_shader.setUniform("u_columns", float(m_columns));
+        m_jump_shader.setUniform("u_step", float(steps[i]));
+        m_jump_shader.setUniformTexture("u_seeds", &m_seeds[src], m_jump_shader.textureIndex++);
+        vera::getBillboard()->render(&m_jump_shader);
+        m_seeds[dst].unbind();
+        src = dst;
+    }
+
+    // 4. Distance to the closest seed, negative inside
+    m_result.bind();
+    glViewport(0, 0, width, width);
+    m_resolve_shader.use();
+    m_resolve_shader.textureIndex = 0;
+    m_resolve_shader.setUniform("u_voxels", float(_resolution));
+    m_resolve_shader.setUniform("u_columns", float(m_columns));
+    m_resolve_shader.setUniform("u_size", _size);
+    m_resolve_shader.setUniformTexture("u_seeds", &m_seeds[src], m_resolve_shader.textureIndex++);
+    m_resolve_shader.setUniformTexture("u_parity", &m_parity, m_resolve_shader.textureIndex++);
+    vera::getBillboard()->render(&m_resolve_shader);
+    m_result.unbind();
+
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (depthTest) glEnable(GL_DEPTH_TEST);
+    if (cullFace) glEnable(GL_CULL_FACE);
+    if (blend) glEnable(GL_BLEND);
+
+    return true;
+}
+
+bool SdfFlood::readback(std::vector<float>& _distances) {
+    if (m_resolution == 0 || !m_result.isAllocated())
+        return false;
+
+    int width = m_result.getWidth();
+    std::vector<float> pixels(width * width * 4);
+    m_result.bind();
+    glReadPixels(0, 0, width, width, GL_RGBA, GL_FLOAT, pixels.data());
+    m_result.unbind();
+
+    size_t n = m_resolution;
+    _distances.resize(n * n * n);
+    for (size_t z = 0; z < n; z++) {
+        size_t tx = (z % m_columns) * n;
+        size_t ty = (z / m_columns) * n;
+        for (size_t y = 0; y < n; y++)
+            for (size_t x = 0; x < n; x++)
+                _distances[(z * n + y) * n + x] = pixels[((ty + y) * width + tx + x) * 4];
+    }
+
+    return true;
+}
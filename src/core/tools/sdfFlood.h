@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "vera/gl/fbo.h"
+#include "vera/gl/shader.h"
+#include "vera/types/mesh.h"
+
+#include "glm/glm.hpp"
+
+// Memory the four RGBA32F sprites of a flood can take together
+#define SDF_FLOOD_MEMORY_MAX (2048ull * 1024ull * 1024ull)
+
+// Signed distance field of a mesh computed on the GPU with a 3D jump flooding. The _resolution^3
+// volume is packed as a square sprite of Z slices (left to right, bottom to top, like
+// vera::packSprite). Points sampled over the surface seed the voxels they fall in, the flooding
+// spreads the closest seed to every voxel and the sign comes from the parity of the surface
+// crossings on a ray from each voxel center towards +Z (so meshes should be closed).
+// The result never leaves the GPU: the red channel of getFbo() holds the distance in model units,
+// negative inside
+class SdfFlood {
+public:
+    SdfFlood();
+    virtual ~SdfFlood();
+
+    static bool supported();
+
+    // Largest power of two resolution whose sprites fit in GL_MAX_TEXTURE_SIZE and SDF_FLOOD_MEMORY_MAX
+    static uint32_t getMaxResolution();
+
+    // _min and _size are the corner and side of the cube, in model space, the volume spans
+    bool        compute(const vera::Mesh& _mesh, const glm::vec3& _min, float _size, uint32_t _resolution);
+
+    // Copy the distances back in x, y, z order. Only meant to compare against the CPU path
+    bool        readback(std::vector<float>& _distances);
+
+    const vera::Fbo* getFbo() const { return &m_result; }
+    uint32_t    getResolution() const { return m_resolution; }
+    int         getWidth() const { return m_result.getWidth(); }
+
+protected:
+    bool        loadShaders();
+
+    vera::Fbo       m_seeds[2];
+    vera::Fbo       m_parity;
+    vera::Fbo       m_result;
+
+    vera::Shader    m_seed_shader;
+    vera::Shader    m_parity_shader;
+    vera::Shader    m_jump_shader;
+    vera::Shader    m_resolve_shader;
+
+    uint32_t        m_resolution;
+    int             m_columns;
+    bool            m_loaded;
+};
@@ -0,0 +1,532 @@
+#include "simplify.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+
+namespace {
+
+// Symmetric 4x4 matrix stored as its upper triangle
+struct Quadric {
+    double m[10];
+
+    Quadric() { std::memset(m, 0, sizeof(m)); }
+
+    // Quadric of the plane ax + by + cz + d = 0
+    Quadric(double a, double b, double c, double d) {
+        m[0] = a*a; m[1] = a*b; m[2] = a*c; m[3] = a*d;
+                    m[4] = b*b; m[5] = b*c; m[6] = b*d;
+                                m[7] = c*c; m[8] = c*d;
+                                            m[9] = d*d;
+    }
+
+    double det( int a11, int a12, int a13,
+                int a21, int a22, int a23,
+                int a31, int a32, int a33) const {
+        return  m[a11]*m[a22]*m[a33] + m[a13]*m[a21]*m[a32] + m[a12]*m[a23]*m[a31]
+              - m[a13]*m[a22]*m[a31] - m[a11]*m[a23]*m[a32] - m[a12]*m[a21]*m[a33];
+    }
+
+    Quadric operator+(const Quadric& _q) const {
+        Quadric r;
+        for (int i = 0; i < 10; i++)
+            r.m[i] = m[i] + _q.m[i];
+        return r;
+    }
+
+    double error(double x, double y, double z) const {
+        return      m[0]*x*x + 2.0*m[1]*x*y + 2.0*m[2]*x*z + 2.0*m[3]*x
+                +   m[4]*y*y + 2.0*m[5]*y*z + 2.0*m[6]*y
+                +   m[7]*z*z + 2.0*m[8]*z
+                +   m[9];
+    }
+};
+
+struct Triangle {
+    size_t      v[3];
+    double      err[4];
+    glm::vec3   n;
+    bool        deleted;
+    bool        dirty;
+};
+
+struct Vertex {
+    glm::vec3   p;
+    Quadric     q;
+    size_t      src;        // index on the original mesh for the other attributes
+    size_t      tstart;
+    size_t      tcount;
+    bool        border;
+};
+
+struct Ref {
+    size_t      tid;
+    size_t      tvertex;
+};
+
+class Simplifier {
+public:
+    std::vector<Triangle>   triangles;
+    std::vector<Vertex>     vertices;
+    std::vector<Ref>        refs;
+
+    void run(size_t _target, double _agressiveness) {
+        for (size_t i = 0; i < triangles.size(); i++)
+            triangles[i].deleted = false;
+
+        size_t deletedTriangles = 0;
+        size_t total = triangles.size();
+        std::vector<int> deleted0, deleted1;
+
+        for (int iteration = 0; iteration < 100; iteration++) {
+            if (total - deletedTriangles <= _target)
+                break;
+
+            // Compact and update the references from time to time
+            if (iteration % 5 == 0)
+                update(iteration);
+
+            for (size_t i = 0; i < triangles.size(); i++)
+                triangles[i].dirty = false;
+
+            // Collapse edges with an error under a threshold that grows with each iteration
+            double threshold = 0.000000001 * std::pow(double(iteration + 3), _agressiveness);
+
+            for (size_t i = 0; i < triangles.size(); i++) {
+                Triangle& t = triangles[i];
+                if (t.err[3] > threshold || t.deleted || t.dirty)
+                    continue;
+
+                for (int j = 0; j < 3; j++) {
+                    if (t.err[j] > threshold)
+                        continue;
+
+                    size_t i0 = t.v[j];
+                    size_t i1 = t.v[(j + 1) % 3];
+                    Vertex& v0 = vertices[i0];
+                    Vertex& v1 = vertices[i1];
+
+                    if (v0.border != v1.border)
+                        continue;
+
+                    glm::vec3 p;
+                    error(i0, i1, p);
+
+                    deleted0.resize(v0.tcount);
+                    deleted1.resize(v1.tcount);
+                    if (flipped(p, i1, v0, deleted0) || flipped(p, i0, v1, deleted1))
+                        continue;
+
+                    v0.p = p;
+                    v0.q = v1.q + v0.q;
+
+                    size_t tstart = refs.size();
+                    updateTriangles(i0, v0, deleted0, deletedTriangles);
+                    updateTriangles(i0, v1, deleted1, deletedTriangles);
+
+                    size_t tcount = refs.size() - tstart;
+                    if (tcount <= v0.tcount) {
+                        // Reuse the space of the previous references
+                        if (tcount)
+                            std::memcpy(&refs[v0.tstart], &refs[tstart], tcount * sizeof(Ref));
+                    }
+                    else
+                        v0.tstart = tstart;
+
+                    v0.tcount = tcount;
+                    break;
+                }
+
+                if (total - deletedTriangles <= _target)
+                    break;
+            }
+        }
+
+        compact();
+    }
+
+protected:
+    double error(size_t _id0, size_t _id1, glm::vec3& _result) {
+        Quadric q = vertices[_id0].q + vertices[_id1].q;
+        bool border = vertices[_id0].border && vertices[_id1].border;
+        double det = q.det(0, 1, 2, 1, 4, 5, 2, 5, 7);
+
+        if (det != 0.0 && !border) {
+            // Optimal position solving the quadric
+            _result.x = float(-1.0 / det * q.det(1, 2, 3, 4, 5, 6, 5, 7, 8));
+            _result.y = float( 1.0 / det * q.det(0, 2, 3, 1, 5, 6, 2, 7, 8));
+            _result.z = float(-1.0 / det * q.det(0, 1, 3, 1, 4, 6, 2, 5, 8));
+            return q.error(_result.x, _result.y, _result.z);
+        }
+
+        // Otherwise pick the best of the two ends and the middle
+        glm::vec3 p1 = vertices[_id0].p;
+        glm::vec3 p2 = vertices[_id1].p;
+        glm::vec3 p3 = (p1 + p2) * 0.5f;
+        double e1 = q.error(p1.x, p1.y, p1.z);
+        double e2 = q.error(p2.x, p2.y, p2.z);
+        double e3 = q.error(p3.x, p3.y, p3.z);
+        double e = std::min(e1, std::min(e2, e3));
+        if (e == e1) _result = p1;
+        else if (e == e2) _result = p2;
+        else _result = p3;
+        return e;
+    }
+
+    // Check if moving a vertex to _p would flip (or degenerate) any of its triangles
+    bool flipped(const glm::vec3& _p, size_t _i1, const Vertex& _v0, std::vector<int>& _deleted) {
+        for (size_t k = 0; k < _v0.tcount; k++) {
+            const Ref& r = refs[_v0.tstart + k];
+            const Triangle& t = triangles[r.tid];
+            if (t.deleted)
+                continue;
+
+            size_t id1 = t.v[(r.tvertex + 1) % 3];
+            size_t id2 = t.v[(r.tvertex + 2) % 3];
+
+            // This triangle collapses with the edge
+            if (id1 == _i1 || id2 == _i1) {
+                _deleted[k] = 1;
+                continue;
+            }
+
+            glm::vec3 d1 = vertices[id1].p - _p;
+            glm::vec3 d2 = vertices[id2].p - _p;
+            float l1 = glm::length(d1);
+            float l2 = glm::length(d2);
+            if (l1 == 0.0f || l2 == 0.0f)
+                return true;
+            d1 /= l1;
+            d2 /= l2;
+
+            if (std::fabs(glm::dot(d1, d2)) > 0.999f)
+                return true;
+
+            glm::vec3 n = glm::normalize(glm::cross(d1, d2));
+            _deleted[k] = 0;
+            if (glm::dot(n, t.n) < 0.2f)
+                return true;
+        }
+        return false;
+    }
+
+    void updateTriangles(size_t _i0, const Vertex& _v, const std::vector<int>& _deleted, size_t& _deletedTriangles) {
+        glm::vec3 p;
+        for (size_t k = 0; k < _v.tcount; k++) {
+            Ref r = refs[_v.tstart + k];
+            Triangle& t = triangles[r.tid];
+            if (t.deleted)
+                continue;
+
+            if (_deleted[k]) {
+                t.deleted = true;
+                _deletedTriangles++;
+                continue;
+            }
+
+            t.v[r.tvertex] = _i0;
+            t.dirty = true;
+            t.err[0] = error(t.v[0], t.v[1], p);
+            t.err[1] = error(t.v[1], t.v[2], p);
+            t.err[2] = error(t.v[2], t.v[0], p);
+            t.err[3] = std::min(t.err[0], std::min(t.err[1], t.err[2]));
+            refs.push_back(r);
+        }
+    }
+
+    void update(int _iteration) {
+        // Drop deleted triangles
+        if (_iteration > 0) {
+            size_t dst = 0;
+            for (size_t i = 0; i < triangles.size(); i++)
+                if (!triangles[i].deleted)
+                    triangles[dst++] = triangles[i];
+            triangles.resize(dst);
+        }
+
+        // Triangles that each vertex belongs to
+        for (size_t i = 0; i < vertices.size(); i++) {
+            vertices[i].tstart = 0;
+            vertices[i].tcount = 0;
+        }
+
+        for (size_t i = 0; i < triangles.size(); i++)
+            for (int j = 0; j < 3; j++)
+                vertices[triangles[i].v[j]].tcount++;
+
+        size_t tstart = 0;
+        for (size_t i = 0; i < vertices.size(); i++) {
+            vertices[i].tstart = tstart;
+            tstart += vertices[i].tcount;
+            vertices[i].tcount = 0;
+        }
+
+        refs.resize(triangles.size() * 3);
+        for (size_t i = 0; i < triangles.size(); i++) {
+            for (int j = 0; j < 3; j++) {
+                Vertex& v = vertices[triangles[i].v[j]];
+                refs[v.tstart + v.tcount].tid = i;
+                refs[v.tstart + v.tcount].tvertex = j;
+                v.tcount++;
+            }
+        }
+
+        if (_iteration > 0)
+            return;
+
+        // Edges used by only one triangle are borders
+        std::vector<size_t> vcount, vids;
+        for (size_t i = 0; i < vertices.size(); i++)
+            vertices[i].border = false;
+
+        for (size_t i = 0; i < vertices.size(); i++) {
+            const Vertex& v = vertices[i];
+            vcount.clear();
+            vids.clear();
+            for (size_t k = 0; k < v.tcount; k++) {
+                const Triangle& t = triangles[refs[v.tstart + k].tid];
+                for (int j = 0; j < 3; j++) {
+                    size_t id = t.v[j];
+                    size_t ofs = 0;
+                    while (ofs < vcount.size() && vids[ofs] != id)
+                        ofs++;
+
+                    if (ofs == vcount.size()) {
+                        vcount.push_back(1);
+                        vids.push_back(id);
+                    }
+                    else
+                        vcount[ofs]++;
+                }
+            }
+
+            for (size_t j = 0; j < vcount.size(); j++)
+                if (vcount[j] == 1)
+                    vertices[vids[j]].border = true;
+        }
+
+        // Quadrics of the planes around each vertex
+        for (size_t i = 0; i < vertices.size(); i++)
+            vertices[i].q = Quadric();
+
+        for (size_t i = 0; i < triangles.size(); i++) {
+            Triangle& t = triangles[i];
+            glm::vec3 p0 = vertices[t.v[0]].p;
+            glm::vec3 n = glm::cross(vertices[t.v[1]].p - p0, vertices[t.v[2]].p - p0);
+            float l = glm::length(n);
+            t.n = (l > 0.0f) ? n / l : glm::vec3(0.0f);
+
+            Quadric q(t.n.x, t.n.y, t.n.z, -glm::dot(t.n, p0));
+            for (int j = 0; j < 3; j++)
+                vertices[t.v[j]].q = vertices[t.v[j]].q + q;
+        }
+
+        glm::vec3 p;
+        for (size_t i = 0; i < triangles.size(); i++) {
+            Triangle& t = triangles[i];
+            for (int j = 0; j < 3; j++)
+                t.err[j] = error(t.v[j], t.v[(j + 1) % 3], p);
+            t.err[3] = std::min(t.err[0], std::min(t.err[1], t.err[2]));
+        }
+    }
+
+    void compact() {
+        for (size_t i = 0; i < vertices.size(); i++)
+            vertices[i].tcount = 0;
+
+        size_t dst = 0;
+        for (size_t i = 0; i < triangles.size(); i++) {
+            if (triangles[i].deleted)
+                continue;
+
+            triangles[dst++] = triangles[i];
+            for (int j = 0; j < 3; j++)
+                vertices[triangles[i].v[j]].tcount = 1;
+        }
+        triangles.resize(dst);
+
+        // Drop unused vertices
+        dst = 0;
+        for (size_t i = 0; i < vertices.size(); i++) {
+            if (vertices[i].tcount == 0)
+                continue;
+
+            vertices[i].tstart = dst;
+            vertices[dst].p = vertices[i].p;
+            vertices[dst].src = vertices[i].src;
+            dst++;
+        }
+
+        for (size_t i = 0; i < triangles.size(); i++)
+            for (int j = 0; j < 3; j++)
+                triangles[i].v[j] = vertices[triangles[i].v[j]].tstart;
+
+        vertices.resize(dst);
+    }
+};
+
+}
+
+size_t getTrianglesTotal(const vera::Mesh& _mesh) {
+    if (_mesh.getDrawMode() != vera::TRIANGLES)
+        return 0;
+
+    if (_mesh.haveIndices())
+        return _mesh.getIndices().size() / 3;
+
+    return _mesh.getVertices().size() / 3;
+}
+
+vera::Mesh simplifyMesh(const vera::Mesh& _mesh, float _ratio) {
+    vera::Mesh mesh;
+
+    // Only indexed triangles share vertices between faces
+    if (_mesh.getDrawMode() != vera::TRIANGLES || !_mesh.haveIndices())
+        return mesh;
+
+    const std::vector<glm::vec3>& srcVertices = _mesh.getVertices();
+    const std::vector<vera::INDEX_TYPE>& srcIndices = _mesh.getIndices();
+
+    Simplifier simplifier;
+    simplifier.vertices.resize(srcVertices.size());
+    for (size_t i = 0; i < srcVertices.size(); i++) {
+        simplifier.vertices[i].p = srcVertices[i];
+        simplifier.vertices[i].src = i;
+    }
+
+    simplifier.triangles.resize(srcIndices.size() / 3);
+    for (size_t i = 0; i < simplifier.triangles.size(); i++)
+        for (int j = 0; j < 3; j++)
+            simplifier.triangles[i].v[j] = srcIndices[i * 3 + j];
+
+    size_t target = size_t(simplifier.triangles.size() * _ratio);
+    simplifier.run(target, 7.0);
+
+    bool haveColors = _mesh.haveColors() && _mesh.getColors().size() == srcVertices.size();
+    bool haveNormals = _mesh.haveNormals() && _mesh.getNormals().size() == srcVertices.size();
+    bool haveTexCoords = _mesh.haveTexCoords() && _mesh.getTexCoords().size() == srcVertices.size();
+    bool haveTangents = _mesh.haveTangents() && _mesh.getTangents().size() == srcVertices.size();
+
+    mesh.setDrawMode(vera::TRIANGLES);
+    for (size_t i = 0; i < simplifier.vertices.size(); i++) {
+        size_t src = simplifier.vertices[i].src;
+        mesh.addVertex( simplifier.vertices[i].p );
+        if (haveColors)
+            mesh.addColor( _mesh.getColors()[src] );
+        if (haveNormals)
+            mesh.addNormal( _mesh.getNormals()[src] );
+        if (haveTexCoords)
+            mesh.addTexCoord( _mesh.getTexCoords()[src] );
+        if (haveTangents)
+            mesh.addTangent( _mesh.getTangents()[src] );
+    }
+
+    for (size_t i = 0; i < simplifier.triangles.size(); i++)
+        mesh.addTriangleIndices(vera::INDEX_TYPE(simplifier.triangles[i].v[0]),
+                                vera::INDEX_TYPE(simplifier.triangles[i].v[1]),
+                                vera::INDEX_TYPE(simplifier.triangles[i].v[2]) );
+
+    return mesh;
+}
+
+// Binary layout: magic, version, flags, vertices total, indices total, then each attribute array
+static const uint32_t MESH_CACHE_MAGIC = 0x44434d47;   // "GMCD"
+static const uint32_t MESH_CACHE_VERSION = 1;
+
+enum MeshCacheFlags {
+    MESH_CACHE_COLORS       = 1 << 0,
+    MESH_CACHE_NORMALS      = 1 << 1,
+    MESH_CACHE_TEXCOORDS    = 1 << 2,
+    MESH_CACHE_TANGENTS     = 1 << 3
+};
+
+template<typename T>
+static void writeArray(std::ofstream& _out, const std::vector<T>& _array) {
+    if (_array.size() > 0)
+        _out.write((const char*)_array.data(), _array.size() * sizeof(T));
+}
+
+template<typename T>
+static bool readArray(std::ifstream& _in, std::vector<T>& _array, size_t _total) {
+    _array.resize(_total);
+    if (_total > 0)
+        _in.read((char*)_array.data(), _total * sizeof(T));
+    return _in.good();
+}
+
+bool saveMeshCache(const std::string& _filename, const vera::Mesh& _mesh) {
+    std::ofstream out(_filename, std::ios::binary);
+    if (!out.is_open())
+        return false;
+
+    uint32_t vertices = _mesh.getVertices().size();
+    uint32_t flags = 0;
+    if (_mesh.haveColors() && _mesh.getColors().size() == vertices)         flags |= MESH_CACHE_COLORS;
+    if (_mesh.haveNormals() && _mesh.getNormals().size() == vertices)       flags |= MESH_CACHE_NORMALS;
+    if (_mesh.haveTexCoords() && _mesh.getTexCoords().size() == vertices)   flags |= MESH_CACHE_TEXCOORDS;
+    if (_mesh.haveTangents() && _mesh.getTangents().size() == vertices)     flags |= MESH_CACHE_TANGENTS;
+
+    std::vector<uint32_t> indices(_mesh.getIndices().begin(), _mesh.getIndices().end());
+    uint32_t header[5] = { MESH_CACHE_MAGIC, MESH_CACHE_VERSION, flags, vertices, (uint32_t)indices.size() };
+    out.write((const char*)header, sizeof(header));
+
+    writeArray(out, _mesh.getVertices());
+    if (flags & MESH_CACHE_COLORS)      writeArray(out, _mesh.getColors());
+    if (flags & MESH_CACHE_NORMALS)     writeArray(out, _mesh.getNormals());
+    if (flags & MESH_CACHE_TEXCOORDS)   writeArray(out, _mesh.getTexCoords());
+    if (flags & MESH_CACHE_TANGENTS)    writeArray(out, _mesh.getTangents());
+    writeArray(out, indices);
+
+    return out.good();
+}
+
+bool loadMeshCache(const std::string& _filename, vera::Mesh& _mesh) {
+    std::ifstream in(_filename, std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    uint32_t header[5];
+    in.read((char*)header, sizeof(header));
+    if (!in.good() || header[0] != MESH_CACHE_MAGIC || header[1] != MESH_CACHE_VERSION)
+        return false;
+
+    uint32_t flags = header[2];
+    size_t vertices = header[3];
+    size_t indicesTotal = header[4];
+
+    std::vector<glm::vec3> positions, normals;
+    std::vector<glm::vec4> colors, tangents;
+    std::vector<glm::vec2> texcoords;
+    std::vector<uint32_t> indices;
+
+    if (!readArray(in, positions, vertices))
+        return false;
+    if ((flags & MESH_CACHE_COLORS) && !readArray(in, colors, vertices))
+        return false;
+    if ((flags & MESH_CACHE_NORMALS) && !readArray(in, normals, vertices))
+        return false;
+    if ((flags & MESH_CACHE_TEXCOORDS) && !readArray(in, texcoords, vertices))
+        return false;
+    if ((flags & MESH_CACHE_TANGENTS) && !readArray(in, tangents, vertices))
+        return false;
+    if (!readArray(in, indices, indicesTotal))
+        return false;
+
+    _mesh.clear();
+    _mesh.setDrawMode(vera::TRIANGLES);
+    for (size_t i = 0; i < vertices; i++) {
+        _mesh.addVertex(positions[i]);
+        if (colors.size())      _mesh.addColor(colors[i]);
+        if (normals.size())     _mesh.addNormal(normals[i]);
+        if (texcoords.size())   _mesh.addTexCoord(texcoords[i]);
+        if (tangents.size())    _mesh.addTangent(tangents[i]);
+    }
+
+    for (size_t i = 0; i + 2 < indices.size(); i += 3)
+        _mesh.addTriangleIndices(vera::INDEX_TYPE(indices[i]), vera::INDEX_TYPE(indices[i+1]), vera::INDEX_TYPE(indices[i+2]));
+
+    return true;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+#include "vera/types/mesh.h"
+
+// Quadric error metric edge collapse (Garland & Heckbert 1997) using per iteration thresholds
+// instead of a priority queue (Forstmann's Fast Quadric Mesh Simplification). Reduces an indexed
+// triangle mesh to about _ratio of its triangles keeping colors, normals, texcoords and tangents
+// of the surviving vertices. Open borders (and so UV seams) are preserved
+vera::Mesh  simplifyMesh(const vera::Mesh& _mesh, float _ratio);
+
+size_t      getTrianglesTotal(const vera::Mesh& _mesh);
+
+// Raw binary copy of a mesh to skip simplifying it again on the next session
+bool        saveMeshCache(const std::string& _filename, const vera::Mesh& _mesh);
+bool        loadMeshCache(const std::string& _filename, vera::Mesh& _mesh);
@@ -0,0 +1,273 @@
+#include "ssao.h"
+
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#include "text.h"
+
+#include "vera/ops/draw.h"
+#include "vera/shaders/defaultShaders.h"
+
+// Temporal weight of the new frame, about the last 10 frames are averaged
+#define SSAO_TEMPORAL_BLEND 0.1f
+
+Ssao::Ssao() :
+    radius(0.5f), halfResolution(true), temporal(false),
+    m_samples(16), m_kernel_samples(0),
+    m_history_index(0), m_history_valid(false), m_frame(0),
+    m_result(nullptr), m_loaded(false) {
+}
+
+Ssao::~Ssao() {
+}
+
+void Ssao::setSamples(int _samples) {
+    m_samples = std::max(1, std::min(_samples, SSAO_SAMPLES_MAX));
+}
+
+void Ssao::clear() {
+    m_kernel.clear();
+    m_noise.clear();
+    m_kernel_samples = 0;
+    m_history_valid = false;
+    m_result = nullptr;
+}
+
+// Same distribution as the u_ssaoSamples/u_ssaoNoise uniforms (https://learnopengl.com/Advanced-Lighting/SSAO)
+// but for any number of samples
+void Ssao::loadKernel() {
+    std::uniform_real_distribution<float> randomFloats(0.0, 1.0);
+    std::default_random_engine generator;
+
+    std::vector<glm::vec3> kernel(m_samples);
+    for (int i = 0; i < m_samples; i++) {
+        glm::vec3 sample(   randomFloats(generator) * 2.0 - 1.0,
+                            randomFloats(generator) * 2.0 - 1.0,
+                            randomFloats(generator) );
+
+        // More samples close to the center
+        float scale = (float)i / (float)m_samples;
+        sample = glm::normalize(sample) * glm::mix(0.1f, 1.0f, scale * scale);
+        kernel[i] = sample;
+    }
+
+    std::vector<glm::vec3> noise(16);
+    for (size_t i = 0; i < noise.size(); i++)
+        noise[i] = glm::vec3(   randomFloats(generator) * 2.0 - 1.0,
+                                randomFloats(generator) * 2.0 - 1.0,
+                                0.0f );
+
+    m_kernel.clear();
+    m_kernel.load(m_samples, 1, 3, 32, &kernel[0], vera::NEAREST, vera::CLAMP);
+    m_noise.clear();
+    m_noise.load(4, 4, 3, 32, &noise[0], vera::NEAREST, vera::REPEAT);
+}
+
+bool Ssao::loadShaders() {
+    std::string samples = std::to_string(m_samples);
+
+    std::string ao = getGlslHeader(false) +
+        "#define SSAO_SAMPLES " + samples + "\n"
+        "uniform sampler2D u_position;\n"
+        "uniform sampler2D u_normal;\n"
+        "uniform sampler2D u_kernel;\n"
+        "uniform sampler2D u_noise;\n"
+        "uniform mat4 u_view;\n"
+        "uniform mat4 u_projection;\n"
+        "uniform vec2 u_resolution;\n"
+        "uniform float u_radius;\n"
+        "uniform float u_rotation;\n"
+        "void main(void) {\n"
+        "    vec2 uv = gl_FragCoord.xy / u_resolution;\n"
+        "    vec3 normal = TEXTURE(u_normal, uv).xyz;\n"
+        "    if (dot(normal, normal) < 0.25) {\n"
+        "        fragColor = vec4(1.0, 0.0, 0.0, 1.0);\n"
+        "        return;\n"
+        "    }\n"
+        "    vec3 P = (u_view * vec4(TEXTURE(u_position, uv).xyz, 1.0)).xyz;\n"
+        "    vec3 N = normalize((u_view * vec4(normal, 0.0)).xyz);\n"
+        "    vec2 noise = TEXTURE(u_noise, gl_FragCoord.xy / 4.0).xy;\n"
+        "    float c = cos(u_rotation);\n"
+        "    float s = sin(u_rotation);\n"
+        "    vec3 random = vec3(noise.x * c - noise.y * s, noise.x * s + noise.y * c, 0.0);\n"
+        "    vec3 T = normalize(random - N * dot(random, N));\n"
+        "    mat3 TBN = mat3(T, cross(N, T), N);\n"
+        "    float occlusion = 0.0;\n"
+        "    for (int i = 0; i < SSAO_SAMPLES; i++) {\n"
+        "        vec3 S = P + TBN * TEXTURE(u_kernel, vec2((float(i) + 0.5) / float(SSAO_SAMPLES), 0.5)).xyz * u_radius;\n"
+        "        vec4 clip = u_projection * vec4(S, 1.0);\n"
+        "        vec2 suv = clip.xy / clip.w * 0.5 + 0.5;\n"
+        "        float depth = (u_view * vec4(TEXTURE(u_position, suv).xyz, 1.0)).z;\n"
+        "        float range = smoothstep(0.0, 1.0, u_radius / abs(P.z - depth));\n"
+        "        occlusion += (depth >= S.z + 0.025 ? 1.0 : 0.0) * range;\n"
+        "    }\n"
+        "    fragColor = vec4(1.0 - occlusion / float(SSAO_SAMPLES), -P.z, 0.0, 1.0);\n"
+        "}\n";
+
+    // Bilinear weights of the 4 closest half resolution texels, pushed down when their depth differ
+    std::string upsample = getGlslHeader(false) +
+        "uniform sampler2D u_ao;\n"
+        "uniform sampler2D u_position;\n"
+        "uniform mat4 u_view;\n"
+        "uniform vec2 u_resolution;\n"
+        "uniform vec2 u_aoResolution;\n"
+        "void main(void) {\n"
+        "    vec2 uv = gl_FragCoord.xy / u_resolution;\n"
+        "    float depth = -(u_view * vec4(TEXTURE(u_position, uv).xyz, 1.0)).z;\n"
+        "    vec2 coord = uv * u_aoResolution - 0.5;\n"
+        "    vec2 base = floor(coord);\n"
+        "    vec2 f = coord - base;\n"
+        "    float sum = 0.0;\n"
+        "    float total = 0.0;\n"
+        "    for (int y = 0; y < 2; y++)\n"
+        "    for (int x = 0; x < 2; x++) {\n"
+        "        vec2 offset = vec2(float(x), float(y));\n"
+        "        vec4 texel = TEXTURE(u_ao, (base + offset + 0.5) / u_aoResolution);\n"
+        "        vec2 bilinear = mix(1.0 - f, f, offset);\n"
+        "        float w = bilinear.x * bilinear.y / (0.001 + abs(depth - texel.g) / max(depth, 0.001));\n"
+        "        sum += texel.r * w;\n"
+        "        total += w;\n"
+        "    }\n"
+        "    fragColor = vec4(total > 0.0 ? sum / total : 1.0, depth, 0.0, 1.0);\n"
+        "}\n";
+
+    // Where each pixel was on the previous frame, if it was visible there
+    std::string temporal = getGlslHeader(false) +
+        "uniform sampler2D u_current;\n"
+        "uniform sampler2D u_previous;\n"
+        "uniform sampler2D u_position;\n"
+        "uniform mat4 u_previousView;\n"
+        "uniform mat4 u_previousViewProjection;\n"
+        "uniform vec2 u_resolution;\n"
+        "uniform float u_blend;\n"
+        "void main(void) {\n"
+        "    vec2 uv = gl_FragCoord.xy / u_resolution;\n"
+        "    vec4 current = TEXTURE(u_current, uv);\n"
+        "    vec4 world = vec4(TEXTURE(u_position, uv).xyz, 1.0);\n"
+        "    vec4 clip = u_previousViewProjection * world;\n"
+        "    vec2 puv = clip.xy / clip.w * 0.5 + 0.5;\n"
+        "    float expected = -(u_previousView * world).z;\n"
+        "    vec4 previous = TEXTURE(u_previous, puv);\n"
+        "    bool inside = puv.x >= 0.0 && puv.y >= 0.0 && puv.x <= 1.0 && puv.y <= 1.0;\n"
+        "    bool same = abs(previous.g - expected) < 0.05 * max(expected, 0.001);\n"
+        "    float ao = (inside && same && current.g > 0.0) ? mix(previous.r, current.r, u_blend) : current.r;\n"
+        "    fragColor = vec4(ao, current.g, 0.0, 1.0);\n"
+        "}\n";
+
+    std::string vert = vera::getDefaultSrc(vera::VERT_BILLBOARD);
+    return  m_ao_shader.setSource(ao, vert) &&
+            m_upsample_shader.setSource(upsample, vert) &&
+            m_temporal_shader.setSource(temporal, vert);
+}
+
+bool Ssao::render(const vera::Fbo& _position, const vera::Fbo& _normal, const glm::mat4& _view, const glm::mat4& _projection) {
+    if (!_position.isAllocated() || !_normal.isAllocated())
+        return false;
+
+    // The kernel size is a loop bound on the shader, both change together
+    if (m_kernel_samples != m_samples) {
+        loadKernel();
+        m_loaded = loadShaders();
+        m_kernel_samples = m_samples;
+        m_history_valid = false;
+    }
+
+    if (!m_loaded)
+        return false;
+
+    int width = _position.getWidth();
+    int height = _position.getHeight();
+    int aoWidth = halfResolution ? std::max(1, width / 2) : width;
+    int aoHeight = halfResolution ? std::max(1, height / 2) : height;
+
+    if (!m_ao.isAllocated() || m_ao.getWidth() != aoWidth || m_ao.getHeight() != aoHeight)
+        m_ao.allocate(aoWidth, aoHeight, vera::COLOR_FLOAT_TEXTURE, vera::NEAREST, vera::CLAMP);
+
+    if (halfResolution && (!m_upsampled.isAllocated() || m_upsampled.getWidth() != width || m_upsampled.getHeight() != height))
+        m_upsampled.allocate(width, height, vera::COLOR_FLOAT_TEXTURE, vera::NEAREST, vera::CLAMP);
+
+    if (temporal)
+        for (size_t i = 0; i < 2; i++)
+            if (!m_history[i].isAllocated() || m_history[i].getWidth() != width || m_history[i].getHeight() != height) {
+                m_history[i].allocate(width, height, vera::COLOR_FLOAT_TEXTURE, vera::NEAREST, vera::CLAMP);
+                m_history_valid = false;
+            }
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLboolean blend = glIsEnabled(GL_BLEND);
+    GLboolean depth = glIsEnabled(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    glDisable(GL_DEPTH_TEST);
+
+    // Occlusion
+    m_ao.bind();
+    glViewport(0, 0, aoWidth, aoHeight);
+    m_ao_shader.use();
+    m_ao_shader.textureIndex = 0;
+    m_ao_shader.setUniformTexture("u_position", &_position, m_ao_shader.textureIndex++);
+    m_ao_shader.setUniformTexture("u_normal", &_normal, m_ao_shader.textureIndex++);
+    m_ao_shader.setUniformTexture("u_kernel", &m_kernel, m_ao_shader.textureIndex++);
+    m_ao_shader.setUniformTexture("u_noise", &m_noise, m_ao_shader.textureIndex++);
+    m_ao_shader.setUniform("u_view", _view);
+    m_ao_shader.setUniform("u_projection", _projection);
+    m_ao_shader.setUniform("u_resolution", glm::vec2(aoWidth, aoHeight));
+    m_ao_shader.setUniform("u_radius", radius);
+    // Golden angle steps, so consecutive frames sample the hemisphere as differently as they can
+    m_ao_shader.setUniform("u_rotation", temporal ? float(m_frame % 64) * 2.39996f : 0.0f);
+    vera::getBillboard()->render(&m_ao_shader);
+    m_ao.unbind();
+    m_result = &m_ao;
+
+    // Back to full resolution
+    if (halfResolution) {
+        m_upsampled.bind();
+        glViewport(0, 0, width, height);
+        m_upsample_shader.use();
+        m_upsample_shader.textureIndex = 0;
+        m_upsample_shader.setUniformTexture("u_ao", &m_ao, m_upsample_shader.textureIndex++);
+        m_upsample_shader.setUniformTexture("u_position", &_position, m_upsample_shader.textureIndex++);
+        m_upsample_shader.setUniform("u_view", _view);
+        m_upsample_shader.setUniform("u_resolution", glm::vec2(width, height));
+        m_upsample_shader.setUniform("u_aoResolution", glm::vec2(aoWidth, aoHeight));
+        vera::getBillboard()->render(&m_upsample_shader);
+        m_upsampled.unbind();
+        m_result = &m_upsampled;
+    }
+
+    // Accumulation
+    if (temporal) {
+        const vera::Fbo* previous = &m_history[m_history_index];
+        m_history_index = 1 - m_history_index;
+        vera::Fbo* next = &m_history[m_history_index];
+
+        next->bind();
+        glViewport(0, 0, width, height);
+        m_temporal_shader.use();
+        m_temporal_shader.textureIndex = 0;
+        m_temporal_shader.setUniformTexture("u_current", m_result, m_temporal_shader.textureIndex++);
+        m_temporal_shader.setUniformTexture("u_previous", previous, m_temporal_shader.textureIndex++);
+        m_temporal_shader.setUniformTexture("u_position", &_position, m_temporal_shader.textureIndex++);
+        m_temporal_shader.setUniform("u_previousView", m_history_view);
+        m_temporal_shader.setUniform("u_previousViewProjection", m_history_viewProjection);
+        m_temporal_shader.setUniform("u_resolution", glm::vec2(width, height));
+        m_temporal_shader.setUniform("u_blend", m_history_valid ? SSAO_TEMPORAL_BLEND : 1.0f);
+        vera::getBillboard()->render(&m_temporal_shader);
+        next->unbind();
+        m_result = next;
+
+        m_history_view = _view;
+        m_history_viewProjection = _projection * _view;
+        m_history_valid = true;
+    }
+    else
+        m_history_valid = false;
+
+    m_frame++;
+
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (blend) glEnable(GL_BLEND);
+    if (depth) glEnable(GL_DEPTH_TEST);
+    return true;
+}
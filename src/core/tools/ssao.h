@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+
+#include "vera/gl/gl.h"
+#include "vera/gl/fbo.h"
+#include "vera/gl/shader.h"
+#include "vera/gl/texture.h"
+
+#include "glm/glm.hpp"
+
+#define SSAO_SAMPLES_MAX 256
+
+// Screen space ambient occlusion from the world space position and normal buffers of the scene.
+// A hemisphere kernel, kept on a texture so its size isn't bound by the uniform limits, is sampled
+// around each pixel, optionally at half resolution and brought back with a depth aware (bilateral)
+// upsample. With temporal on, the kernel rotates every frame and the result is blended with the
+// previous ones reprojected to where they are now.
+// The red channel of getFbo() holds the ambient light (1.0 unoccluded), green the view depth
+class Ssao {
+public:
+    Ssao();
+    virtual ~Ssao();
+
+    void        setSamples(int _samples);
+    int         getSamples() const { return m_samples; }
+
+    bool        render(const vera::Fbo& _position, const vera::Fbo& _normal, const glm::mat4& _view, const glm::mat4& _projection);
+    const vera::Fbo* getFbo() const { return m_result; }
+
+    // Forget the accumulated frames (camera cuts, scene changes)
+    void        reset() { m_history_valid = false; }
+    void        clear();
+
+    float       radius;
+    bool        halfResolution;
+    bool        temporal;
+
+protected:
+    bool        loadShaders();
+    void        loadKernel();
+
+    vera::Texture   m_kernel;
+    vera::Texture   m_noise;
+    int             m_samples;
+    int             m_kernel_samples;       // the ones m_kernel and m_ao_shader were made with
+
+    vera::Shader    m_ao_shader;
+    vera::Shader    m_upsample_shader;
+    vera::Shader    m_temporal_shader;
+
+    vera::Fbo       m_ao;
+    vera::Fbo       m_upsampled;
+    vera::Fbo       m_history[2];
+    size_t          m_history_index;
+    bool            m_history_valid;
+    glm::mat4       m_history_view;
+    glm::mat4       m_history_viewProjection;
+    size_t          m_frame;
+
+    const vera::Fbo* m_result;
+    bool            m_loaded;
+};
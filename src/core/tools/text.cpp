@@ -4,11 +4,13 @@
 #include <array>
 #include <functional>
 #include <regex>
+#include <sstream>
 #include <tuple>
 #include <cstring>
 
 #include "vera/ops/string.h"
 #include "vera/window.h"
+#include "vera/shaders/defaultShaders.h"
 
 namespace {
 
@@ -242,3 +244,92 @@ bool checkPattern(const std::string& _str) {
     return  (_str.find('*') != std::string::npos) ||
             (_str.find('?') != std::string::npos);
 }
+
+// Inject a per instance transform (a_instanceMatrix) into a vertex shader. The model 
+// matrices uniforms are wrapped by macros right after they are declared, so the rest of the 
+// code stays untouched. Returns an empty string if the source can't be patched.
+std::string getInstancedVertexSource(const std::string& _source) {
+    if (findId(_source, "a_instanceMatrix"))
+        return _source;
+
+    std::regex reAttribute(R"(^\s*(attribute|in)\s+vec\d\s+a_position\s*;)");
+    std::regex reUniform(R"(^\s*uniform\s+mat4\s+(u_modelViewProjectionMatrix|u_modelMatrix)\s*;)");
+    std::smatch match;
+
+    std::vector<std::string> lines;
+    std::istringstream stream(_source);
+    std::string line;
+    while (std::getline(stream, line))
+        lines.push_back(line);
+
+    std::string keyword = "";
+    std::vector<std::string> uniforms;
+    int last = -1;
+    for (size_t l = 0; l < lines.size(); l++) {
+        if (keyword.empty() && std::regex_search(lines[l], match, reAttribute)) {
+            keyword = match[1];
+            last = std::max(last, (int)l);
+        }
+        else if (std::regex_search(lines[l], match, reUniform)) {
+            uniforms.push_back(match[1]);
+            last = std::max(last, (int)l);
+        }
+    }
+
+    if (keyword.empty() || uniforms.size() == 0)
+        return "";
+
+    std::string rta = "";
+    for (size_t l = 0; l < lines.size(); l++) {
+        rta += lines[l] + "\n";
+
+        if ((int)l == last) {
+            rta += "#define MODEL_INSTANCED\n";
+            rta += keyword + " mat4 a_instanceMatrix;\n";
+            for (size_t u = 0; u < uniforms.size(); u++)
+                rta += "#define " + uniforms[u] + " (" + uniforms[u] + " * a_instanceMatrix)\n";
+        }
+    }
+
+    return rta;
+}
+
+int getGlslVersion(bool* _es) {
+    int version = 100;
+    bool es = false;
+
+    std::smatch match;
+    std::regex reVersion(R"(^\s*#version\s+(\d+)(\s+es)?)");
+    std::string billboard = vera::getDefaultSrc(vera::VERT_BILLBOARD);
+    if (std::regex_search(billboard, match, reVersion)) {
+        version = std::stoi(match[1]);
+        es = match[2].matched;
+    }
+
+    if (_es)
+        *_es = es;
+    return version;
+}
+
+std::string getGlslHeader(bool _vertex) {
+    bool es = false;
+    int version = getGlslVersion(&es);
+    bool modern = es ? version >= 300 : version >= 130;
+
+    std::string src = "";
+    if (version > 100)
+        src += "#version " + std::to_string(version) + (es ? " es" : "") + "\n";
+
+    src +=  "#ifdef GL_ES\n"
+            "precision highp float;\n"
+            "#endif\n\n";
+
+    if (_vertex)
+        src += modern ? "#define ATTRIBUTE in\n#define VARYING out\n" : "#define ATTRIBUTE attribute\n#define VARYING varying\n";
+    else if (modern)
+        src += "#define VARYING in\n#define TEXTURE texture\nout vec4 fragColor;\n";
+    else
+        src += "#define VARYING varying\n#define TEXTURE texture2D\n#define fragColor gl_FragColor\n";
+
+    return src + "\n";
+}
@@ -27,4 +27,13 @@ bool checkNormalBuffer(const std::string& _source);
 int  countSceneBuffers(const std::string& _source);
 
 int  countDevLookBillboards(const std::string& _source);
-int  countDevLookSpheres(const std::string& _source);
\ No newline at end of file
+int  countDevLookSpheres(const std::string& _source);
+
+std::string getInstancedVertexSource(const std::string& _source);
+
+// GLSL version of the default shaders (from their #version line), _es tells if it's GLSL ES
+int  getGlslVersion(bool* _es = nullptr);
+
+// #version and precision matching the default shaders, plus ATTRIBUTE, VARYING, TEXTURE and 
+// fragColor macros, so internal shaders can be written once for GLSL 100 and 130 (or ES 300)
+std::string getGlslHeader(bool _vertex);
@@ -0,0 +1,214 @@
+#include "textureArrays.h"
+
+#include <array>
+#include <algorithm>
+
+#include "hash.h"
+
+#include "vera/window.h"
+#include "vera/ops/string.h"
+
+TextureArrays::TextureArrays() : m_signature(0) {
+}
+
+TextureArrays::~TextureArrays() {
+    clear();
+}
+
+bool TextureArrays::supported() {
+#if defined(PLATFORM_RPI) || !defined(GL_TEXTURE_2D_ARRAY)
+    return false;
+#else
+    return vera::getVersion() >= 130;
+#endif
+}
+
+void TextureArrays::clear() {
+#if defined(GL_TEXTURE_2D_ARRAY)
+    for (size_t i = 0; i < m_arrays.size(); i++)
+        glDeleteTextures(1, &m_arrays[i].id);
+#endif
+    m_arrays.clear();
+    m_layers.clear();
+    m_samplers.clear();
+    m_signature = 0;
+}
+
+#if defined(GL_TEXTURE_2D_ARRAY)
+// Size and sampling of a texture (width, height, min and mag filters, s and t wraps).
+// Only the ones sharing all of them are packed together, so they sample the same as before
+typedef std::array<GLint, 6> Group;
+
+static bool getGroup(const vera::Texture* _texture, Group& _group) {
+    glBindTexture(GL_TEXTURE_2D, _texture->getTextureId());
+
+#if defined(GL_TEXTURE_INTERNAL_FORMAT)
+    // Arrays hold 8 bits per channel, deeper formats (16 bits, half or full floats) would be clamped into them
+    GLint format = 0;
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+    if (format != GL_RGBA8 && format != GL_RGB8 && format != GL_RGBA && format != GL_RGB)
+        return false;
+#endif
+
+    _group[0] = _texture->getWidth();
+    _group[1] = _texture->getHeight();
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, &_group[2]);
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, &_group[3]);
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, &_group[4]);
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, &_group[5]);
+    return _group[0] > 0 && _group[1] > 0;
+}
+#endif
+
+bool TextureArrays::pack(const vera::TexturesMap& _textures, const vera::TextureStreamsMap& _streams) {
+    // Checked every frame, so it's hashed in place. Textures are replaced by the same name,
+    // so their ids and sizes are part of it too
+    uint64_t total[2] = { _textures.size(), _streams.size() };
+    uint64_t signature = hashBytes(total, sizeof(total));
+    for (vera::TexturesMap::const_iterator it = _textures.begin(); it != _textures.end(); ++it) {
+        GLuint texture[3] = { it->second->getTextureId(), (GLuint)it->second->getWidth(), (GLuint)it->second->getHeight() };
+        signature = hashBytes(texture, sizeof(texture), hashString(it->first, signature));
+    }
+    if (signature == 0)
+        signature = 1;
+
+    if (signature == m_signature)
+        return false;
+
+    clear();
+    m_signature = signature;
+
+    if (!supported())
+        return true;
+
+#if defined(GL_TEXTURE_2D_ARRAY)
+    GLint maxLayers = 256;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+
+    GLint previousFbo = 0;
+    GLint previousTexture = 0;
+    GLint previousTexture2D = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFbo);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D_ARRAY, &previousTexture);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &previousTexture2D);
+
+    // Group by size and sampling, a lonely texture gains nothing from it. Streams change every frame, a copy of them would not
+    std::map< Group, std::vector<std::string> > groups;
+    for (vera::TexturesMap::const_iterator it = _textures.begin(); it != _textures.end(); ++it) {
+        Group group;
+        if (_streams.find(it->first) == _streams.end() && getGroup(it->second, group))
+            groups[group].push_back(it->first);
+    }
+    glBindTexture(GL_TEXTURE_2D, previousTexture2D);
+
+    GLuint fbo = 0;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+
+    for (std::map< Group, std::vector<std::string> >::iterator group = groups.begin(); group != groups.end(); ++group) {
+        const std::vector<std::string>& names = group->second;
+        for (size_t start = 0; start + 1 < names.size(); start += maxLayers) {
+            Array array;
+            array.width = group->first[0];
+            array.height = group->first[1];
+            array.layers = std::min((int)(names.size() - start), (int)maxLayers);
+
+            glGenTextures(1, &array.id);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, array.id);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, array.width, array.height, array.layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+            // Each texture is read through a framebuffer into its layer, without going through the CPU.
+            // Formats that can't be read that way (or into 8 bits) stay as they are
+            size_t index = m_arrays.size();
+            size_t packed = 0;
+            for (int l = 0; l < array.layers; l++) {
+                const std::string& name = names[start + l];
+                glGetError();
+                glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _textures.at(name)->getTextureId(), 0);
+                if (glCheckFramebufferStatus(GL_READ_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+                    continue;
+
+                glCopyTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, l, 0, 0, array.width, array.height);
+                if (glGetError() != GL_NO_ERROR)
+                    continue;
+
+                Layer layer;
+                layer.array = index;
+                layer.layer = l;
+                m_layers[name] = layer;
+                packed++;
+            }
+
+            if (packed == 0) {
+                glDeleteTextures(1, &array.id);
+                continue;
+            }
+
+            // Sampled like the textures it holds
+            GLint minFilter = group->first[2];
+            if (minFilter != GL_NEAREST && minFilter != GL_LINEAR)
+                glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, minFilter);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, group->first[3]);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, group->first[4]);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, group->first[5]);
+            m_arrays.push_back(array);
+        }
+    }
+
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFbo);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, previousTexture);
+#endif
+
+    return true;
+}
+
+const std::vector<std::string>& TextureArrays::getSamplers(GLuint _program) {
+    std::map<GLuint, std::vector<std::string> >::iterator it = m_samplers.find(_program);
+    if (it != m_samplers.end())
+        return it->second;
+
+    std::vector<std::string>& samplers = m_samplers[_program];
+    for (std::map<std::string, Layer>::const_iterator layer = m_layers.begin(); layer != m_layers.end(); ++layer)
+        if (glGetUniformLocation(_program, layer->first.c_str()) >= 0)
+            samplers.push_back(layer->first);
+    return samplers;
+}
+
+void TextureArrays::feedTo(vera::Shader* _shader, const vera::TexturesMap& _textures) {
+#if defined(GL_TEXTURE_2D_ARRAY)
+    for (size_t i = 0; i < m_arrays.size(); i++) {
+        size_t unit = _shader->textureIndex++;
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, m_arrays[i].id);
+        _shader->setUniform("u_textureArray" + vera::toString((int)i), (int)unit);
+    }
+#endif
+
+    const std::vector<std::string>& samplers = getSamplers(_shader->getProgram());
+    for (vera::TexturesMap::const_iterator it = _textures.begin(); it != _textures.end(); ++it) {
+        std::map<std::string, Layer>::const_iterator layer = m_layers.find(it->first);
+        if (layer == m_layers.end() || std::find(samplers.begin(), samplers.end(), it->first) != samplers.end())
+            _shader->setUniformTexture(it->first, it->second, _shader->textureIndex++ );
+        if (layer != m_layers.end())
+            _shader->setUniform(it->first + "Layer", float(layer->second.layer));
+        _shader->setUniform(it->first + "Resolution", float(it->second->getWidth()), float(it->second->getHeight()));
+    }
+}
+
+std::map<std::string, std::string> TextureArrays::getDefines() const {
+    std::map<std::string, std::string> defines;
+
+    std::string declarations;
+    for (size_t i = 0; i < m_arrays.size(); i++)
+        declarations += "uniform sampler2DArray u_textureArray" + vera::toString((int)i) + "; ";
+    defines["TEXTURE_ARRAYS"] = vera::toString((int)m_arrays.size());
+    defines["TEXTURE_ARRAYS_UNIFORMS"] = declarations;
+
+    for (std::map<std::string, Layer>::const_iterator it = m_layers.begin(); it != m_layers.end(); ++it)
+        defines[it->first + "Array"] = "u_textureArray" + vera::toString((int)it->second.array);
+
+    return defines;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "vera/gl/gl.h"
+#include "vera/gl/shader.h"
+#include "vera/gl/texture.h"
+#include "vera/gl/textureStream.h"
+
+// Packs the 8 bits textures of the scene that share the same size, filters and wraps into GL_TEXTURE_2D_ARRAYs,
+// so a program binds one unit per group instead of one per texture. Packed textures are sampled as
+//      texture(<name>Array, vec3(uv, <name>Layer))
+// where <name>Array is a define naming its u_textureArray<N> and <name>Layer a float uniform.
+// The TEXTURE_ARRAYS_UNIFORMS define holds the declaration of all the arrays.
+// Shaders that still sample a packed texture by its own name (like the MATERIAL_*MAP defines do) get it
+// bound as usual too, so only the ones rewritten to sample the arrays save texture units.
+// Needs GL 3.0 or GLES 3.0, elsewhere nothing is packed and textures are bound one by one as usual
+class TextureArrays {
+public:
+    TextureArrays();
+    virtual ~TextureArrays();
+
+    static bool supported();
+
+    // Only repacks when the textures changed since the last call. Returns true if it did
+    bool        pack(const vera::TexturesMap& _textures, const vera::TextureStreamsMap& _streams);
+    void        clear();
+
+    // Which packed textures each program samples by name is kept by program id, call it after
+    // compiling programs again as their ids can be reused
+    void        programsChanged() { m_samplers.clear(); }
+
+    bool        empty() const { return m_arrays.empty(); }
+    bool        have(const std::string& _name) const { return m_layers.find(_name) != m_layers.end(); }
+    size_t      getTotal() const { return m_arrays.size(); }
+    size_t      getPackedTotal() const { return m_layers.size(); }
+
+    // Binds the arrays and the textures left out of them, with their layer and resolution uniforms
+    void        feedTo(vera::Shader* _shader, const vera::TexturesMap& _textures);
+
+    // Defines for the shaders sampling from them
+    std::map<std::string, std::string> getDefines() const;
+
+protected:
+    struct Array {
+        GLuint      id;
+        int         width;
+        int         height;
+        int         layers;
+    };
+
+    struct Layer {
+        size_t      array;
+        int         layer;
+    };
+
+    const std::vector<std::string>& getSamplers(GLuint _program);
+
+    std::vector<Array>              m_arrays;
+    std::map<std::string, Layer>    m_layers;
+    std::map<GLuint, std::vector<std::string> > m_samplers;    // packed textures sampled by name, by program
+    uint64_t                        m_signature;
+};
@@ -234,12 +234,12 @@ void Uniforms::clear() {
     vera::Scene::clear();
 }
 
-bool Uniforms::feedTo(vera::Shader *_shader, bool _lights, bool _buffers ) {
+bool Uniforms::feedTo(vera::Shader *_shader, bool _lights, bool _buffers, bool _textures ) {
     bool update = false;
 
     // Pass native uniforms functions (u_time, u_data, etc...)
     for (UniformFunctionsMap::iterator it = functions.begin(); it != functions.end(); ++it) {
-        if (!_lights && ( it->first == "u_scene" || it->first == "u_sceneDepth" || it->first == "u_sceneNormal" || it->first == "u_scenePosition") )
+        if (!_lights && ( it->first == "u_scene" || it->first == "u_sceneDepth" || it->first == "u_sceneNormal" || it->first == "u_scenePosition" || it->first == "u_sceneSsao") )
             continue;
 
         if (it->second.present)
@@ -267,10 +267,12 @@ bool Uniforms::feedTo(vera::Shader *_shader, bool _lights, bool _buffers ) {
         }
     }
 
-    // Pass Textures Uniforms
-    for (vera::TexturesMap::iterator it = textures.begin(); it != textures.end(); ++it) {
-        _shader->setUniformTexture(it->first, it->second, _shader->textureIndex++ );
-        _shader->setUniform(it->first+"Resolution", float(it->second->getWidth()), float(it->second->getHeight()));
+    // Pass Textures Uniforms (unless the caller binds them some other way)
+    if (_textures) {
+        for (vera::TexturesMap::iterator it = textures.begin(); it != textures.end(); ++it) {
+            _shader->setUniformTexture(it->first, it->second, _shader->textureIndex++ );
+            _shader->setUniform(it->first+"Resolution", float(it->second->getWidth()), float(it->second->getHeight()));
+        }
     }
 
     for (vera::TextureStreamsMap::iterator it = streams.begin(); it != streams.end(); ++it) {
@@ -610,6 +612,9 @@ void Uniforms::printBuffers() {
 
     if (functions["u_sceneNormal"].present)
         std::cout << "uniform sampler2D u_sceneNormal;" << std::endl;
+
+    if (functions["u_sceneSsao"].present)
+        std::cout << "uniform sampler2D u_sceneSsao;" << std::endl;
 }
 
 void Uniforms::clearBuffers() {
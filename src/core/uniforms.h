@@ -63,6 +63,7 @@ typedef std::vector<vera::Pyramid>              PyramidsList;
 typedef std::vector<vera::Flood>                FloodList;
 
 typedef std::map<std::string, vera::Image>      ImagesMap;
+typedef std::vector<vera::Model*>               ModelsQueue;
 
 class Uniforms : public vera::Scene {
 public:
@@ -77,7 +78,7 @@ public:
     virtual bool        haveChange();
 
     // Feed uniforms to a specific shader
-    virtual bool        feedTo( vera::Shader *_shader, bool _lights = true, bool _buffers = true);
+    virtual bool        feedTo( vera::Shader *_shader, bool _lights = true, bool _buffers = true, bool _textures = true);
 
     // defines
     virtual void        addDefine(const std::string& _define, const std::string& _value);
@@ -94,6 +95,7 @@ public:
 
     std::mutex          loadMutex;
     ImagesMap           loadQueue;
+    ModelsQueue         loadModels;
 
     // Uniforms that trigger functions (u_time, u_data, etc.)
     UniformFunctionsMap functions;
@@ -2,8 +2,14 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include <deque>
+#include <limits>
 #include <string>
 #include <vector>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
 
 #include "engine.h"
 #include "headless.h"
@@ -24,6 +30,341 @@ namespace py = pybind11;
     [](const type& obj) { return obj.name; },\
     [](type& obj, const auto& value) { obj.name = value; }
 
+// Bulk mesh attributes from NumPy. Arrays already in float32 (or uint32) and C order are read in
+// place, anything else is converted once by pybind11. The copy into the mesh runs without the GIL
+typedef py::array_t<float, py::array::c_style | py::array::forcecast>       FloatArray;
+typedef py::array_t<uint32_t, py::array::c_style | py::array::forcecast>    IndexArray;
+
+static size_t meshRows(const FloatArray& _array, py::ssize_t _minColumns, py::ssize_t _maxColumns, const std::string& _name) {
+    if (_array.ndim() != 2 || _array.shape(1) < _minColumns || _array.shape(1) > _maxColumns) {
+        std::string shape = (_minColumns == _maxColumns)? std::to_string(_minColumns) : std::to_string(_minColumns) + " or " + std::to_string(_maxColumns);
+        throw py::value_error(_name + " should be an [N, " + shape + "] array");
+    }
+    return (size_t)_array.shape(0);
+}
+
+static void meshCheck(const vera::Mesh& _mesh, size_t _rows, bool _present, const std::string& _name) {
+    if (_present)
+        throw py::value_error("the mesh already has " + _name + ", set them on a new Mesh");
+    if (_mesh.getVerticesTotal() != _rows)
+        throw py::value_error(_name + " should be as many as the vertices (" + std::to_string(_mesh.getVerticesTotal()) + "), set the vertices first");
+}
+
+static void meshSetVertices(vera::Mesh& _mesh, const FloatArray& _vertices) {
+    size_t total = meshRows(_vertices, 3, 3, "vertices");
+    if (_mesh.getVerticesTotal() > 0)
+        throw py::value_error("the mesh already has vertices, set them on a new Mesh");
+
+    const float* src = _vertices.data();
+    py::gil_scoped_release release;
+    std::vector<glm::vec3> vertices(total);
+    if (total > 0)
+        std::memcpy(&vertices[0], src, total * sizeof(glm::vec3));
+    _mesh.addVertices(vertices);
+}
+
+static void meshSetNormals(vera::Mesh& _mesh, const FloatArray& _normals) {
+    size_t total = meshRows(_normals, 3, 3, "normals");
+    meshCheck(_mesh, total, _mesh.haveNormals(), "normals");
+
+    const float* src = _normals.data();
+    py::gil_scoped_release release;
+    for (size_t i = 0; i < total; i++, src += 3)
+        _mesh.addNormal(glm::vec3(src[0], src[1], src[2]));
+}
+
+static void meshSetColors(vera::Mesh& _mesh, const FloatArray& _colors) {
+    size_t total = meshRows(_colors, 3, 4, "colors");
+    meshCheck(_mesh, total, _mesh.haveColors(), "colors");
+
+    const float* src = _colors.data();
+    size_t columns = (size_t)_colors.shape(1);
+    py::gil_scoped_release release;
+    for (size_t i = 0; i < total; i++, src += columns)
+        _mesh.addColor(glm::vec4(src[0], src[1], src[2], columns == 4 ? src[3] : 1.0f));
+}
+
+static void meshSetTexCoords(vera::Mesh& _mesh, const FloatArray& _texcoords) {
+    size_t total = meshRows(_texcoords, 2, 2, "texcoords");
+    meshCheck(_mesh, total, _mesh.haveTexCoords(), "texcoords");
+
+    const float* src = _texcoords.data();
+    py::gil_scoped_release release;
+    for (size_t i = 0; i < total; i++, src += 2)
+        _mesh.addTexCoord(glm::vec2(src[0], src[1]));
+}
+
+static void meshSetIndices(vera::Mesh& _mesh, const IndexArray& _indices) {
+    if (_mesh.haveIndices())
+        throw py::value_error("the mesh already has indices, set them on a new Mesh");
+
+    const uint32_t* src = _indices.data();
+    size_t total = (size_t)_indices.size();
+    uint32_t limit = (uint32_t)std::min((size_t)std::numeric_limits<vera::INDEX_TYPE>::max(), _mesh.getVerticesTotal() > 0 ? _mesh.getVerticesTotal() - 1 : (size_t)std::numeric_limits<vera::INDEX_TYPE>::max());
+
+    bool valid = true;
+    {
+        py::gil_scoped_release release;
+        std::vector<vera::INDEX_TYPE> indices(total);
+        for (size_t i = 0; i < total && valid; i++) {
+            valid = src[i] <= limit;
+            indices[i] = (vera::INDEX_TYPE)src[i];
+        }
+        if (valid && total > 0)
+            _mesh.addIndices(&indices[0], (int)total);
+    }
+
+    if (!valid)
+        throw py::value_error("indices out of range (the largest allowed is " + std::to_string(limit) + ")");
+}
+
+// Closest surface under a pixel as a dict, or None
+static py::object raycast(Engine& _engine, float _x, float _y) {
+    RaycastHit hit;
+    if (!_engine.raycast(_x, _y, hit))
+        return py::none();
+
+    py::dict rta;
+    rta["model"] = hit.model;
+    rta["position"] = py::make_tuple(hit.position.x, hit.position.y, hit.position.z);
+    rta["normal"] = py::make_tuple(hit.normal.x, hit.normal.y, hit.normal.z);
+    rta["distance"] = hit.distance;
+    rta["microseconds"] = hit.microseconds;
+    return rta;
+}
+
+// Readbacks of the last frame as [height, width, 4] arrays, bottom row first like OpenGL
+static PixelsFormat pixelsFormat(const std::string& _format) {
+    if (_format == "rgba8")
+        return PIXELS_RGBA8;
+    else if (_format == "rgba16f")
+        return PIXELS_RGBA16F;
+    else if (_format == "rgba32f")
+        return PIXELS_RGBA32F;
+    throw py::value_error("unknown pixels format '" + _format + "', use rgba8, rgba16f or rgba32f");
+}
+
+static py::array pixelsArray(int _width, int _height, PixelsFormat _format) {
+    const char* dtype = (_format == PIXELS_RGBA8)? "uint8" : ((_format == PIXELS_RGBA16F)? "float16" : "float32");
+    return py::array(py::dtype(dtype), std::vector<py::ssize_t>{ _height, _width, 4 });
+}
+
+static py::array readPixels(Headless& _headless, const std::string& _format) {
+    PixelsFormat format = pixelsFormat(_format);
+    py::array pixels = pixelsArray(_headless.getPixelsWidth(), _headless.getPixelsHeight(), format);
+
+    bool done = false;
+    void* dst = pixels.mutable_data();
+    {
+        py::gil_scoped_release release;
+        done = _headless.readPixels(format, dst);
+    }
+
+    if (!done)
+        throw std::runtime_error("no frame to read, draw() first");
+    return pixels;
+}
+
+static void requestPixels(Headless& _headless, const std::string& _format) {
+    if (!_headless.requestPixels(pixelsFormat(_format)))
+        throw std::runtime_error("can't request more pixels, draw() first or getPixels() the pending ones");
+}
+
+// Oldest requested frame, or None
+static py::object getPixels(Headless& _headless) {
+    int width, height;
+    PixelsFormat format;
+    if (!_headless.peekPixels(width, height, format))
+        return py::none();
+
+    py::array pixels = pixelsArray(width, height, format);
+    bool done = false;
+    void* dst = pixels.mutable_data();
+    {
+        py::gil_scoped_release release;
+        done = _headless.getPixels(dst);
+    }
+
+    if (!done)
+        throw std::runtime_error("the pixels couldn't be read back");
+    return pixels;
+}
+
+// Draws each frame and streams it to _callback(frame, pixels) as soon as its readback lands,
+// keeping the next frames rendering meanwhile. _before(frame), if any, runs ahead of each draw
+// for per frame changes (setCamera, setUniform, ...). Pixels requested before would be handed over
+// as the first frames, so it refuses to start while there are any
+static void renderSequence(Headless& _headless, const std::vector<int>& _frames, const py::function& _callback, const std::string& _format, const py::object& _before) {
+    pixelsFormat(_format);      // unknown formats fail before drawing anything
+    if (_headless.havePixels())
+        throw std::runtime_error("getPixels() the pending requests before a sequence");
+    std::deque<int> pending;
+
+    for (size_t i = 0; i < _frames.size(); i++) {
+        _headless.setFrame(_frames[i]);
+        if (!_before.is_none())
+            _before(_frames[i]);
+
+        {
+            py::gil_scoped_release release;
+            if (!_headless.isInitialized())
+                _headless.draw();
+            _headless.draw();
+        }
+
+        // Leave one buffer free, the oldest frame is handed over before asking for another
+        if (pending.size() + 1 >= PIXELS_BUFFERS) {
+            py::object pixels = getPixels(_headless);
+            _callback(pending.front(), pixels);
+            pending.pop_front();
+        }
+
+        requestPixels(_headless, _format);
+        pending.push_back(_frames[i]);
+    }
+
+    while (!pending.empty()) {
+        py::object pixels = getPixels(_headless);
+        _callback(pending.front(), pixels);
+        pending.pop_front();
+    }
+}
+
+// GL type of the pixels of a uint8, uint16, float16 or float32 array, that go to the engine as they are
+// instead of being copied into a list of floats. Views in another order (flipped, transposed, ...) are
+// copied into C order keeping their type. Any other array is converted once to float32, with integers
+// normalized like GL does (0..1, or -1..1 when signed)
+static GLenum pixelsType(py::array& _pixels, int _width, int _height, int _channels) {
+    if (_width <= 0 || _height <= 0 || _channels < 1 || _channels > 4 || (size_t)_pixels.size() != (size_t)_width * _height * _channels)
+        throw py::value_error("pixels should have width x height x channels values, with 1 to 4 channels");
+
+    py::dtype type = _pixels.dtype();
+    GLenum glType = 0;
+    if (type.kind() == 'u' && type.itemsize() == 1)
+        glType = GL_UNSIGNED_BYTE;
+    else if (type.kind() == 'u' && type.itemsize() == 2)
+        glType = GL_UNSIGNED_SHORT;
+    else if (type.kind() == 'f' && type.itemsize() == 4)
+        glType = GL_FLOAT;
+#if defined(GL_HALF_FLOAT)
+    else if (type.kind() == 'f' && type.itemsize() == 2)
+        glType = GL_HALF_FLOAT;
+#endif
+
+    if (glType != 0) {
+        _pixels = py::array::ensure(_pixels, py::array::c_style);
+        if (!_pixels)
+            throw py::error_already_set();
+        return glType;
+    }
+
+    FloatArray floats = FloatArray::ensure(_pixels);
+    if (!floats)
+        throw py::error_already_set();
+
+    // Integers always come out as a new array, so it's fine to scale them in place
+    if (type.kind() == 'u' || type.kind() == 'i') {
+        float scale = (float)(1.0 / (std::ldexp(1.0, (int)type.itemsize() * 8 - (type.kind() == 'i'? 1 : 0)) - 1.0));
+        float* values = floats.mutable_data();
+        for (py::ssize_t i = 0; i < floats.size(); i++)
+            values[i] = std::max(values[i] * scale, -1.0f);
+    }
+
+    _pixels = floats;
+    return GL_FLOAT;
+}
+
+static bool loadTexture(Engine& _engine, const std::string& _name, int _width, int _height, int _channels, py::array _pixels) {
+    GLenum type = pixelsType(_pixels, _width, _height, _channels);
+    const void* pixels = _pixels.data();
+    py::gil_scoped_release release;
+    return _engine.loadTexture(_name, _width, _height, _channels, type, pixels);
+}
+
+static bool addCubemap(Engine& _engine, const std::string& _name, int _width, int _height, int _channels, py::array _pixels) {
+    GLenum type = pixelsType(_pixels, _width, _height, _channels);
+    const void* pixels = _pixels.data();
+    py::gil_scoped_release release;
+    return _engine.addCubemap(_name, _width, _height, _channels, type, pixels);
+}
+
+// Renders one frame per item of _params, a structured array whose fields are uniforms (1 to 4
+// values) or "frame", "camera" and "projection" (16 values, column major), into _out, a
+// [N, height, width, channels] array of uint8, float16 or float32 already allocated by the caller
+static void renderBatch(Headless& _headless, const py::array& _params, py::array& _out) {
+    py::dtype dtype = _params.dtype();
+    if (_params.ndim() != 1 || !py::hasattr(dtype, "names") || dtype.attr("names").is_none())
+        throw py::value_error("params should be a one dimensional structured array");
+
+    std::vector<BatchField> fields;
+    py::dict dtypeFields = dtype.attr("fields");
+    for (auto it : dtypeFields) {
+        py::tuple description = it.second.cast<py::tuple>();
+        py::dtype fieldType = description[0].cast<py::dtype>();
+        py::dtype base = fieldType.attr("base").cast<py::dtype>();
+
+        BatchField field;
+        field.name = it.first.cast<std::string>();
+        field.offset = description[1].cast<size_t>();
+        field.count = fieldType.itemsize() / base.itemsize();
+        if (base.kind() == 'f' && base.itemsize() == 4)
+            field.type = 'f';
+        else if (base.kind() == 'f' && base.itemsize() == 8)
+            field.type = 'd';
+        else if (base.kind() == 'i' && base.itemsize() == 4)
+            field.type = 'i';
+        else if (base.kind() == 'u' && base.itemsize() == 4)
+            field.type = 'u';
+        else
+            throw py::value_error("field " + field.name + " should be float32, float64, int32 or uint32");
+
+        bool matrix = field.name == "camera" || field.name == "projection";
+        if ((matrix && field.count != 16) || (!matrix && field.name != "frame" && (field.count < 1 || field.count > 4)) || (field.name == "frame" && field.count != 1))
+            throw py::value_error("field " + field.name + " has " + std::to_string(field.count) + " values, uniforms take 1 to 4, frame 1 and camera or projection 16");
+        fields.push_back(field);
+    }
+
+    PixelsFormat format;
+    py::dtype outType = _out.dtype();
+    if (outType.kind() == 'u' && outType.itemsize() == 1)
+        format = PIXELS_RGBA8;
+    else if (outType.kind() == 'f' && outType.itemsize() == 2)
+        format = PIXELS_RGBA16F;
+    else if (outType.kind() == 'f' && outType.itemsize() == 4)
+        format = PIXELS_RGBA32F;
+    else
+        throw py::value_error("out should be uint8, float16 or float32");
+
+    if (_out.ndim() != 4 || _out.shape(0) != _params.shape(0) || _out.shape(3) < 1 || _out.shape(3) > 4 || !(_out.flags() & py::array::c_style))
+        throw py::value_error("out should be a C ordered [N, height, width, channels] array, with N as many as params and up to 4 channels");
+    if (!_out.writeable())
+        throw py::value_error("out should be writeable");
+    if (_headless.havePixels())
+        throw std::runtime_error("getPixels() the pending requests before a batch");
+
+    // Reversed, strided or broadcast views are copied into C order first, items are read one after the other
+    py::array ordered = py::array::ensure(_params, py::array::c_style);
+    if (!ordered)
+        throw py::error_already_set();
+    const uint8_t* params = (const uint8_t*)ordered.data();
+    size_t stride = (size_t)ordered.itemsize();
+    size_t total = (size_t)ordered.shape(0);
+    int height = (int)_out.shape(1);
+    int width = (int)_out.shape(2);
+    size_t channels = (size_t)_out.shape(3);
+    uint8_t* out = (uint8_t*)_out.mutable_data();
+
+    bool done = false;
+    {
+        py::gil_scoped_release release;
+        done = _headless.renderBatch(params, stride, total, fields, format, width, height, channels, out);
+    }
+
+    if (!done)
+        throw std::runtime_error("the batch stopped: out frames are " + std::to_string(width) + "x" + std::to_string(height) +
+                                " and the engine renders " + std::to_string(_headless.getPixelsWidth()) + "x" + std::to_string(_headless.getPixelsHeight()) + " (see resize()), or a readback failed");
+}
+
 PYBIND11_MODULE(PyGlslViewer, m) {
     m.doc() = "PyGlslViewer bindings";
     
@@ -119,6 +460,13 @@ PYBIND11_MODULE(PyGlslViewer, m) {
         .def("addIndex",&vera::Mesh::addIndex, py::arg("_i"))
         .def("addTriangleIndices", &vera::Mesh::addTriangleIndices, py::arg("index1"), py::arg("index2"), py::arg("index3"))
         .def("invertWindingOrder",&vera::Mesh::invertWindingOrder)
+
+        // Whole attributes at once from NumPy arrays
+        .def("setVertices", &meshSetVertices, py::arg("_vertices"), "float32 array of [N, 3]")
+        .def("setNormals", &meshSetNormals, py::arg("_normals"), "float32 array of [N, 3], after the vertices")
+        .def("setColors", &meshSetColors, py::arg("_colors"), "float32 array of [N, 3] or [N, 4], after the vertices")
+        .def("setTexCoords", &meshSetTexCoords, py::arg("_texcoords"), "float32 array of [N, 2], after the vertices")
+        .def("setIndices", &meshSetIndices, py::arg("_indices"), "uint32 array of any shape, read in order (like [M, 3] for triangles)")
     ;
 
     py::class_<vera::Model>(m, "Model")
@@ -293,7 +641,8 @@ PYBIND11_MODULE(PyGlslViewer, m) {
 
         .def("showTextures",&Engine::showTextures, py::arg("_value"))
         .def("haveTexture",&Engine::haveTexture, py::arg("_name"))
-        .def("loadTexture",&Engine::loadTexture, py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
+        .def("loadTexture", &loadTexture, py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
+        .def("loadTexture", py::overload_cast<const std::string&, int, int, int, const std::vector<float>&>(&Engine::loadTexture), py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
         .def("addTexture",&Engine::addTexture, py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_id"))
         .def("printTextures", &Engine::printTextures)
 
@@ -303,9 +652,12 @@ PYBIND11_MODULE(PyGlslViewer, m) {
         .def("showCubemap",&Engine::showCubemap, py::arg("_value"))
         .def("enableCubemap",&Engine::enableCubemap, py::arg("_value"))
         .def("haveCubemap",&Engine::haveCubemap, py::arg("_name"))
-        .def("addCubemap",&Engine::addCubemap, py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
+        .def("addCubemap", &addCubemap, py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
+        .def("addCubemap", py::overload_cast<const std::string&, int, int, int, const std::vector<float>&>(&Engine::addCubemap), py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
         .def("printCubemaps", &Engine::printCubemaps)
 
+        .def("raycast", &raycast, py::arg("x"), py::arg("y"))
+
         .def("showPasses",&Engine::showPasses, py::arg("_value"))
         .def("printBuffers", &Engine::printBuffers)
 
@@ -357,7 +709,8 @@ PYBIND11_MODULE(PyGlslViewer, m) {
 
         .def("showTextures",&Headless::showTextures, py::arg("_value"))
         .def("haveTexture",&Headless::haveTexture, py::arg("_name"))
-        .def("loadTexture",&Headless::loadTexture, py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
+        .def("loadTexture", [](Headless& _headless, const std::string& _name, int _width, int _height, int _channels, py::array _pixels) { return loadTexture(_headless, _name, _width, _height, _channels, _pixels); }, py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
+        .def("loadTexture", py::overload_cast<const std::string&, int, int, int, const std::vector<float>&>(&Headless::loadTexture), py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
         .def("addTexture",&Engine::addTexture, py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_id"))
         .def("printTextures", &Headless::printTextures)
 
@@ -367,9 +720,19 @@ PYBIND11_MODULE(PyGlslViewer, m) {
         .def("showCubemap",&Headless::showCubemap, py::arg("_value"))
         .def("enableCubemap",&Headless::enableCubemap, py::arg("_value"))
         .def("haveCubemap",&Headless::haveCubemap, py::arg("_name"))
-        .def("addCubemap",&Headless::addCubemap, py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
+        .def("addCubemap", [](Headless& _headless, const std::string& _name, int _width, int _height, int _channels, py::array _pixels) { return addCubemap(_headless, _name, _width, _height, _channels, _pixels); }, py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
+        .def("addCubemap", py::overload_cast<const std::string&, int, int, int, const std::vector<float>&>(&Headless::addCubemap), py::arg("_name"), py::arg("_width"), py::arg("_height"), py::arg("_channels"), py::arg("_pixels"))
         .def("printCubemaps", &Headless::printCubemaps)
 
+        .def("raycast", [](Headless& _headless, float _x, float _y) { return raycast(_headless, _x, _y); }, py::arg("x"), py::arg("y"))
+
+        .def("readPixels", &readPixels, py::arg("format") = "rgba8")
+        .def("requestPixels", &requestPixels, py::arg("format") = "rgba8")
+        .def("getPixels", &getPixels)
+        .def("havePixels", &Headless::havePixels)
+        .def("renderBatch", &renderBatch, py::arg("params"), py::arg("out"))
+        .def("renderSequence", &renderSequence, py::arg("frames"), py::arg("callback"), py::arg("format") = "rgba8", py::arg("before") = py::none())
+
         .def("showPasses",&Headless::showPasses, py::arg("_value"))
         .def("printBuffers", &Headless::printBuffers)
 
@@ -1,9 +1,96 @@
 #include "engine.h"
 
+#include <cstring>
+
 #include "vera/shaders/defaultShaders.h"
 #include "vera/ops/draw.h"
 
 
+// IEEE 754 half float
+static float fromHalf(uint16_t _value) {
+    uint32_t sign = (uint32_t)(_value & 0x8000) << 16;
+    uint32_t exponent = (_value >> 10) & 0x1f;
+    uint32_t mantissa = _value & 0x3ff;
+
+    uint32_t bits;
+    if (exponent == 0x1f)
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else if (exponent != 0)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        bits = sign;
+    else {
+        // Subnormal: normalize it
+        exponent = 113;
+        while ((mantissa & 0x400) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+
+    float value;
+    std::memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+// Normalized [0,1] floats for the formats that need them, like the cubemaps
+static std::vector<float> toFloats(GLenum _type, const void* _pixels, size_t _total) {
+    std::vector<float> floats(_total);
+    if (_type == GL_UNSIGNED_BYTE) {
+        const uint8_t* src = (const uint8_t*)_pixels;
+        for (size_t i = 0; i < _total; i++)
+            floats[i] = src[i] / 255.0f;
+    }
+    else if (_type == GL_UNSIGNED_SHORT) {
+        const uint16_t* src = (const uint16_t*)_pixels;
+        for (size_t i = 0; i < _total; i++)
+            floats[i] = src[i] / 65535.0f;
+    }
+    else if (_type == GL_FLOAT)
+        std::memcpy(floats.data(), _pixels, _total * sizeof(float));
+    else {
+        const uint16_t* src = (const uint16_t*)_pixels;
+        for (size_t i = 0; i < _total; i++)
+            floats[i] = fromHalf(src[i]);
+    }
+    return floats;
+}
+
+// Replaces the pixels of a texture of the same size, without reallocating it
+static bool updateTexture(GLuint _id, int _width, int _height, int _channels, GLenum _type, const void* _pixels) {
+    GLenum format = GL_RGBA;
+    if (_channels == 3)
+        format = GL_RGB;
+#if defined(GL_RED) && defined(GL_RG)
+    else if (_channels == 2)
+        format = GL_RG;
+    else if (_channels == 1)
+        format = GL_RED;
+#else
+    else if (_channels == 2)
+        format = GL_LUMINANCE_ALPHA;
+    else if (_channels == 1)
+        format = GL_LUMINANCE;
+#endif
+
+    GLint previousTexture = 0;
+    GLint previousAlignment = 4;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &previousTexture);
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &previousAlignment);
+
+    glGetError();
+    glBindTexture(GL_TEXTURE_2D, _id);
+    // Rows of 8 bit RGB images are not 4 bytes aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _width, _height, format, _type, _pixels);
+    bool done = glGetError() == GL_NO_ERROR;
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, previousAlignment);
+    glBindTexture(GL_TEXTURE_2D, previousTexture);
+    return done;
+}
+
 Engine::Engine() : m_enableCubemap (true) {
     // verbose = true;
     help = false;
@@ -157,22 +244,76 @@ bool Engine::addTexture(const std::string& _name, int _width, int _height, int _
 }
 
 bool Engine::loadTexture(const std::string& _name, int _width, int _height, int _channels, const std::vector<float>& _pixels) {
-    if (uniforms.textures.find(_name) == uniforms.textures.end()) {
-        vera::Texture* tex = new vera::Texture();
-        if (tex->load(_width, _height, _channels, 32, _pixels.data())) {
-            uniforms.textures[_name] = tex;
+    if ((int)_pixels.size() < _width * _height * _channels)
+        return false;
+    return loadTexture(_name, _width, _height, _channels, GL_FLOAT, _pixels.data());
+}
 
-            if (verbose) {
-                std::cout << "uniform sampler2D   " << _name  << ";"<< std::endl;
-                std::cout << "uniform vec2        " << _name  << "Resolution;"<< std::endl;
-            }
+bool Engine::loadTexture(const std::string& _name, int _width, int _height, int _channels, GLenum _type, const void* _pixels) {
+    if (_width <= 0 || _height <= 0 || _channels < 1 || _channels > 4 || _pixels == NULL)
+        return false;
+
+    // Half floats are uploaded as they are on GL 3.x and GLES 3.0, elsewhere they widen to floats
+    std::vector<float> widened;
+    if (_type != GL_UNSIGNED_BYTE && _type != GL_UNSIGNED_SHORT && _type != GL_FLOAT) {
+#if defined(GL_HALF_FLOAT) && !defined(PLATFORM_RPI)
+        if (_type != GL_HALF_FLOAT)
+            return false;
+        if (vera::getVersion() < 130) {
+            widened = toFloats(_type, _pixels, (size_t)_width * _height * _channels);
+            _type = GL_FLOAT;
+            _pixels = widened.data();
+        }
+#else
+        return false;
+#endif
+    }
 
+    vera::TexturesMap::iterator it = uniforms.textures.find(_name);
+    if (it != uniforms.textures.end()) {
+        // Same storage: update in place, keeping the id shaders and texture arrays already know.
+        // Textures not made here (or replaced since) have an unknown format and are made again
+        std::map<std::string, TextureFormat>::const_iterator format = m_textureFormats.find(_name);
+        if (format != m_textureFormats.end() && format->second.texture == it->second &&
+            format->second.channels == _channels && format->second.type == _type &&
+            it->second->getWidth() == _width && it->second->getHeight() == _height &&
+            updateTexture(it->second->getTextureId(), _width, _height, _channels, _type, _pixels)) {
+            m_sceneRender.repackTextureArrays();
             return true;
         }
-        else
-            delete tex;
+
+        // The new one may get the same id back, so the arrays can't tell it changed by themselves
+        delete it->second;
+        uniforms.textures.erase(it);
+        m_textureFormats.erase(_name);
+        m_sceneRender.repackTextureArrays();
     }
-    return false;
+
+    vera::Texture* tex = new vera::Texture();
+    bool loaded = false;
+    if (_type == GL_UNSIGNED_BYTE)
+        loaded = tex->load(_width, _height, _channels, 8, _pixels);
+    else if (_type == GL_UNSIGNED_SHORT)
+        loaded = tex->load(_width, _height, _channels, 16, _pixels);
+    else if (_type == GL_FLOAT)
+        loaded = tex->load(_width, _height, _channels, 32, _pixels);
+    else
+        // Half floats: allocated as floats, then filled straight from the half ones
+        loaded = tex->load(_width, _height, _channels, 32, NULL) && updateTexture(tex->getTextureId(), _width, _height, _channels, _type, _pixels);
+
+    if (!loaded) {
+        delete tex;
+        return false;
+    }
+
+    uniforms.textures[_name] = tex;
+    m_textureFormats[_name] = { tex, _channels, _type };
+    if (verbose) {
+        std::cout << "uniform sampler2D   " << _name  << ";"<< std::endl;
+        std::cout << "uniform vec2        " << _name  << "Resolution;"<< std::endl;
+    }
+
+    return true;
 }
 
 bool Engine::haveCubemap(const std::string& _name) {
@@ -180,27 +321,46 @@ bool Engine::haveCubemap(const std::string& _name) {
 }
 
 bool Engine::addCubemap(const std::string& _name, int _width, int _height, int _channels, const std::vector<float>& _pixels) {
-    if (uniforms.cubemaps.find(_name) == uniforms.cubemaps.end()) {
-        vera::TextureCube* tex = new vera::TextureCube();
-        if ( tex->load(_width, _height, _channels, _pixels.data(), true) ) {
+    if ((int)_pixels.size() < _width * _height * _channels)
+        return false;
+    return addCubemap(_name, _width, _height, _channels, GL_FLOAT, _pixels.data());
+}
 
-            if (verbose) {
-                std::cout << "// " << _name << " loaded as: " << std::endl;
-                std::cout << "uniform samplerCube u_cubeMap;"<< std::endl;
-                std::cout << "uniform vec3        u_SH[9];"<< std::endl;
-            }
+bool Engine::addCubemap(const std::string& _name, int _width, int _height, int _channels, GLenum _type, const void* _pixels) {
+    if (_width <= 0 || _height <= 0 || _channels < 1 || _channels > 4 || _pixels == NULL)
+        return false;
 
-            uniforms.cubemaps[_name] = tex;
-            uniforms.activeCubemap = uniforms.cubemaps[_name];
+    // The faces and spherical harmonics are computed on the CPU from floats, only other formats get copied
+    std::vector<float> floats;
+    const float* pixels = (const float*)_pixels;
+    if (_type != GL_FLOAT) {
+        floats = toFloats(_type, _pixels, (size_t)_width * _height * _channels);
+        pixels = floats.data();
+    }
 
-            enableCubemap(true);
+    vera::TextureCube* tex = new vera::TextureCube();
+    if ( !tex->load(_width, _height, _channels, pixels, true) ) {
+        delete tex;
+        return false;
+    }
 
-            return true;
-        }
-        else
-            delete tex;
+    if (verbose) {
+        std::cout << "// " << _name << " loaded as: " << std::endl;
+        std::cout << "uniform samplerCube u_cubeMap;"<< std::endl;
+        std::cout << "uniform vec3        u_SH[9];"<< std::endl;
     }
-    return false;
+
+    // Loading again replaces it, the faces depend on the whole image so there is nothing to update in place
+    auto it = uniforms.cubemaps.find(_name);
+    if (it != uniforms.cubemaps.end())
+        delete it->second;
+
+    uniforms.cubemaps[_name] = tex;
+    uniforms.activeCubemap = uniforms.cubemaps[_name];
+
+    enableCubemap(true);
+
+    return true;
 }
 
 void Engine::setUniform(const std::string& _name, const std::vector<float>& _values) {
@@ -3,6 +3,7 @@
 #include <cstddef>
 #include <iostream>
 #include <functional>
+#include <map>
 
 #include "vera/types/camera.h"
 #include "../core/sandbox.h"
@@ -50,6 +51,9 @@ public:
     virtual void showTextures(bool _value) { m_showTextures = _value; };
     virtual bool haveTexture(const std::string& _name);
     virtual bool loadTexture(const std::string& _name, int _width, int _height, int _channels, const std::vector<float>& _pixels);
+    // _type is GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT, GL_HALF_FLOAT or GL_FLOAT. Pixels are uploaded as they are,
+    // into the existing texture when it was loaded here with the same size, channels and type
+    virtual bool loadTexture(const std::string& _name, int _width, int _height, int _channels, GLenum _type, const void* _pixels);
     virtual bool addTexture(const std::string& _name, int _width, int _height, int _id);
     virtual void printTextures() { uniforms.printTextures(); uniforms.printCubemaps(); }
 
@@ -57,10 +61,13 @@ public:
     virtual void enableCubemap(bool _value);
     virtual bool haveCubemap(const std::string& _name);
     virtual bool addCubemap(const std::string& _name, int _width, int _height, int _channels, const std::vector<float>& _pixels);
+    virtual bool addCubemap(const std::string& _name, int _width, int _height, int _channels, GLenum _type, const void* _pixels);
     virtual void printCubemaps() { uniforms.printCubemaps(); }
 
     virtual void setUniform(const std::string& _name, const std::vector<float>& _values);
 
+    virtual bool raycast(float _x, float _y, RaycastHit& _hit) { return m_sceneRender.raycast(uniforms, _x, _y, _hit); }
+
     virtual void showPasses(bool _value) { m_showPasses = _value; };
     virtual void showBoudningBox(bool _value) { m_sceneRender.showBBoxes = _value; }
     
@@ -71,7 +78,13 @@ public:
     virtual void draw();
 
 private:
+    struct TextureFormat {
+        vera::Texture*  texture;
+        int             channels;
+        GLenum          type;
+    };
 
+    std::map<std::string, TextureFormat>    m_textureFormats;   // of the ones made by loadTexture()
     bool    m_enableCubemap;
 
 };
\ No newline at end of file
@@ -1,10 +1,15 @@
 #include "headless.h"
 
+#include <cstring>
+
 #include "vera/shaders/defaultShaders.h"
 
 
-Headless::Headless() {
+Headless::Headless() : m_pixels_total(0) {
     m_sceneRender.showBBoxes = false;
+
+    // Frames always land on the record FBO, so they can be read back after draw()
+    m_capture = true;
 };
 
 Headless::~Headless() {
@@ -31,6 +36,238 @@ void Headless::draw() {
 }
 
 void Headless::close() {
+    // Pixel buffers go with the context
+#if defined(GL_PIXEL_PACK_BUFFER)
+    for (size_t i = 0; i < m_pixels_free.size(); i++)
+        if (m_pixels_free[i].pbo)
+            glDeleteBuffers(1, &m_pixels_free[i].pbo);
+    for (size_t i = 0; i < m_pixels_pending.size(); i++)
+        if (m_pixels_pending[i].pbo)
+            glDeleteBuffers(1, &m_pixels_pending[i].pbo);
+#endif
+    m_pixels_free.clear();
+    m_pixels_pending.clear();
+    m_pixels_total = 0;
+
     vera::closeGL();
 }
 
+size_t Headless::getPixelsBytes(int _width, int _height, PixelsFormat _format) {
+    size_t channel = (_format == PIXELS_RGBA8)? 1 : ((_format == PIXELS_RGBA16F)? 2 : 4);
+    return (size_t)_width * (size_t)_height * 4 * channel;
+}
+
+bool Headless::readFrame(PixelsFormat _format, int _width, int _height, void* _dst) {
+    GLenum type = GL_UNSIGNED_BYTE;
+    if (_format == PIXELS_RGBA32F)
+        type = GL_FLOAT;
+    else if (_format == PIXELS_RGBA16F) {
+    #if defined(GL_HALF_FLOAT)
+        type = GL_HALF_FLOAT;
+    #else
+        return false;
+    #endif
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_record_fbo.getId());
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, _width, _height, GL_RGBA, type, _dst);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return true;
+}
+
+bool Headless::readPixels(PixelsFormat _format, void* _dst) {
+    if (!m_record_fbo.isAllocated())
+        return false;
+
+    return readFrame(_format, m_record_fbo.getWidth(), m_record_fbo.getHeight(), _dst);
+}
+
+bool Headless::requestPixels(PixelsFormat _format) {
+    if (!m_record_fbo.isAllocated())
+        return false;
+
+    // Buffers are reused, new ones are only made while there are less than PIXELS_BUFFERS
+    PixelsBuffer buffer;
+    if (!m_pixels_free.empty()) {
+        buffer = std::move(m_pixels_free.back());
+        m_pixels_free.pop_back();
+    }
+    else if (m_pixels_total < PIXELS_BUFFERS) {
+        buffer.pbo = 0;
+        buffer.bytes = 0;
+        m_pixels_total++;
+    }
+    else
+        return false;
+
+    buffer.width = m_record_fbo.getWidth();
+    buffer.height = m_record_fbo.getHeight();
+    buffer.format = _format;
+    size_t bytes = getPixelsBytes(buffer.width, buffer.height, _format);
+
+    bool done = false;
+#if !defined(PLATFORM_RPI) && !defined(__EMSCRIPTEN__) && defined(GL_PIXEL_PACK_BUFFER) && defined(GL_MAP_READ_BIT)
+    if (vera::getVersion() >= 130) {
+        if (buffer.pbo == 0)
+            glGenBuffers(1, &buffer.pbo);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.pbo);
+        if (buffer.bytes < bytes) {
+            glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+            buffer.bytes = bytes;
+        }
+
+        // With a pack buffer bound the "pointer" is an offset on it, and the call doesn't wait for the GPU
+        done = readFrame(_format, buffer.width, buffer.height, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    else
+#endif
+    {
+        buffer.data.resize(bytes);
+        done = readFrame(_format, buffer.width, buffer.height, buffer.data.data());
+    }
+
+    if (done)
+        m_pixels_pending.push_back(std::move(buffer));
+    else
+        m_pixels_free.push_back(std::move(buffer));
+    return done;
+}
+
+void Headless::dropPixels() {
+    while (!m_pixels_pending.empty()) {
+        m_pixels_free.push_back(std::move(m_pixels_pending.front()));
+        m_pixels_pending.pop_front();
+    }
+}
+
+bool Headless::peekPixels(int& _width, int& _height, PixelsFormat& _format) const {
+    if (m_pixels_pending.empty())
+        return false;
+
+    _width = m_pixels_pending.front().width;
+    _height = m_pixels_pending.front().height;
+    _format = m_pixels_pending.front().format;
+    return true;
+}
+
+bool Headless::getPixels(void* _dst) {
+    if (m_pixels_pending.empty())
+        return false;
+
+    PixelsBuffer buffer = std::move(m_pixels_pending.front());
+    m_pixels_pending.pop_front();
+    size_t bytes = getPixelsBytes(buffer.width, buffer.height, buffer.format);
+
+    bool done = false;
+    if (!buffer.data.empty()) {
+        std::memcpy(_dst, buffer.data.data(), bytes);
+        done = true;
+    }
+#if !defined(PLATFORM_RPI) && !defined(__EMSCRIPTEN__) && defined(GL_PIXEL_PACK_BUFFER) && defined(GL_MAP_READ_BIT)
+    else if (buffer.pbo) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.pbo);
+        const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+        if (pixels) {
+            std::memcpy(_dst, pixels, bytes);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            done = true;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+#endif
+
+    m_pixels_free.push_back(std::move(buffer));
+    return done;
+}
+
+bool Headless::renderBatch(const uint8_t* _params, size_t _stride, size_t _total, const std::vector<BatchField>& _fields,
+                            PixelsFormat _format, int _width, int _height, size_t _channels, uint8_t* _out) {
+    size_t pixels = (size_t)_width * (size_t)_height;
+    size_t channel = getPixelsBytes(1, 1, _format) / 4;
+    size_t frameBytes = pixels * _channels * channel;
+
+    std::vector<uint8_t> rgba;
+    std::vector<float> values;
+    std::deque<size_t> pending;
+
+    // Readbacks are RGBA, outputs with less channels keep the first ones
+    auto collect = [&]() {
+        uint8_t* dst = _out + pending.front() * frameBytes;
+        pending.pop_front();
+        if (_channels == 4)
+            return getPixels(dst);
+
+        rgba.resize(pixels * 4 * channel);
+        if (!getPixels(rgba.data()))
+            return false;
+        for (size_t p = 0; p < pixels; p++)
+            std::memcpy(dst + p * _channels * channel, &rgba[p * 4 * channel], _channels * channel);
+        return true;
+    };
+
+    for (size_t i = 0; i < _total; i++) {
+        const uint8_t* item = _params + i * _stride;
+        for (size_t f = 0; f < _fields.size(); f++) {
+            const BatchField& field = _fields[f];
+            values.resize(field.count);
+            for (size_t v = 0; v < field.count; v++) {
+                if (field.type == 'd') {
+                    double value;
+                    std::memcpy(&value, item + field.offset + v * sizeof(double), sizeof(double));
+                    values[v] = (float)value;
+                }
+                else if (field.type == 'i') {
+                    int32_t value;
+                    std::memcpy(&value, item + field.offset + v * sizeof(int32_t), sizeof(int32_t));
+                    values[v] = (float)value;
+                }
+                else if (field.type == 'u') {
+                    uint32_t value;
+                    std::memcpy(&value, item + field.offset + v * sizeof(uint32_t), sizeof(uint32_t));
+                    values[v] = (float)value;
+                }
+                else
+                    std::memcpy(&values[v], item + field.offset + v * sizeof(float), sizeof(float));
+            }
+
+            const float* m = values.data();
+            if (field.name == "frame")
+                setFrame((size_t)values[0]);
+            else if (field.name == "camera" && uniforms.activeCamera)
+                uniforms.activeCamera->setTransformMatrix(m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7], m[8], m[9], m[10], m[11], m[12], m[13], m[14], m[15]);
+            else if (field.name == "projection" && uniforms.activeCamera)
+                uniforms.activeCamera->setProjection(m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7], m[8], m[9], m[10], m[11], m[12], m[13], m[14], m[15]);
+            else
+                setUniform(field.name, values);
+        }
+
+        if (!m_initialized)
+            draw();
+        draw();
+
+        // Leave one buffer free, the oldest frame is copied out before asking for another
+        bool done = getPixelsWidth() == _width && getPixelsHeight() == _height;
+        if (done && pending.size() + 1 >= PIXELS_BUFFERS)
+            done = collect();
+        if (done)
+            done = requestPixels(_format);
+
+        if (!done) {
+            dropPixels();
+            return false;
+        }
+        pending.push_back(i);
+    }
+
+    while (!pending.empty()) {
+        if (!collect()) {
+            dropPixels();
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -1,7 +1,31 @@
 #pragma once
 
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstdint>
+
 #include "engine.h"
 
+// Formats the last frame can be read back in, always RGBA
+enum PixelsFormat {
+    PIXELS_RGBA8 = 0,   // uint8
+    PIXELS_RGBA16F,     // float16
+    PIXELS_RGBA32F      // float32
+};
+
+// Readbacks that can be in flight at once
+#define PIXELS_BUFFERS 3
+
+// Column of a batch of parameters: a uniform, or "frame", "camera" (transform) and "projection"
+// (4x4 column major, like setTransformMatrix and setProjection)
+struct BatchField {
+    std::string     name;
+    size_t          offset;     // from the start of each item
+    size_t          count;      // values
+    char            type;       // 'f' float32, 'd' float64, 'i' int32 or 'u' uint32
+};
+
 class Headless : public Engine {
 public:
 
@@ -14,4 +38,47 @@ public:
 
     void close();
 
-};
\ No newline at end of file
+    // The first frame after init() only settles the viewport
+    bool    isInitialized() const { return m_initialized; }
+
+    // Size of the last frame drawn, and the bytes it takes on _format
+    int     getPixelsWidth() const { return m_record_fbo.getWidth(); }
+    int     getPixelsHeight() const { return m_record_fbo.getHeight(); }
+    static size_t getPixelsBytes(int _width, int _height, PixelsFormat _format);
+
+    // Copy of the last frame drawn into _dst, bottom row first
+    bool    readPixels(PixelsFormat _format, void* _dst);
+
+    // Same, in two halves so the copy overlaps with the next frames. requestPixels() queues the
+    // copy into a pixel buffer and returns right away. getPixels() hands back the oldest one,
+    // waiting for it only if the GPU didn't get there yet
+    bool    requestPixels(PixelsFormat _format);
+    bool    havePixels() const { return !m_pixels_pending.empty(); }
+    bool    peekPixels(int& _width, int& _height, PixelsFormat& _format) const;
+    bool    getPixels(void* _dst);
+
+    // Renders _total items, each one _stride bytes apart on _params, applying their _fields before
+    // drawing. Frames land one after the other on _out ([_total, _height, _width, _channels]) as
+    // their readbacks arrive, while the next ones are drawn. Returns false if the frame size
+    // doesn't match or a readback fails
+    bool    renderBatch(const uint8_t* _params, size_t _stride, size_t _total, const std::vector<BatchField>& _fields,
+                        PixelsFormat _format, int _width, int _height, size_t _channels, uint8_t* _out);
+
+private:
+    struct PixelsBuffer {
+        GLuint                  pbo;
+        size_t                  bytes;
+        std::vector<uint8_t>    data;       // where there are no pixel buffers
+        int                     width;
+        int                     height;
+        PixelsFormat            format;
+    };
+
+    bool    readFrame(PixelsFormat _format, int _width, int _height, void* _dst);
+    void    dropPixels();
+
+    std::deque<PixelsBuffer>    m_pixels_pending;
+    std::vector<PixelsBuffer>   m_pixels_free;
+    size_t                      m_pixels_total;
+
+};